@@ -0,0 +1,168 @@
+/*
+ * bench_admit.c - trace-driven hit ratio of the cache with TinyLFU
+ *     admission against plain CLOCK replacement
+ *
+ * usage: ./bench_admit [tracefile]
+ *
+ * A trace file has one request per line, "key size". Without one, a
+ * synthetic trace is generated: NOBJS objects with Zipf(ZIPF_S)
+ * popularity and sizes between 1 KB and 100 KB, interleaved with scans
+ * that fetch SCAN_LEN never-repeated URLs each, the way a crawler does.
+ *
+ * Each policy replays the trace in a fresh child process through
+ * cache_lookup()/cache_insert(), inserting the object after every
+ * miss, and reports request and byte hit ratios.
+ */
+#include "csapp.h"
+#include "proxy.h"
+#include "cache.h"
+
+#define NOBJS 4000       /* Distinct popular objects */
+#define ZIPF_S 0.9       /* Zipf exponent of their popularity */
+#define NREQS 400000     /* Requests in the synthetic trace */
+#define SCAN_EVERY 20000 /* Requests between crawler scans */
+#define SCAN_LEN 2000    /* One-off URLs per scan */
+
+typedef struct
+{
+  char *key;
+  size_t size;
+} request_t;
+
+static request_t *trace;
+static size_t ntrace;
+
+static void load_trace(char *file);
+static void make_trace(void);
+static size_t object_size(unsigned long id);
+static void replay(char *name, int admission);
+
+int main(int argc, char **argv)
+{
+  if (argc > 1)
+    load_trace(argv[1]);
+  else
+    make_trace();
+
+  printf("%-8s %10s %10s %10s %10s\n", "policy", "hit%", "bytehit%",
+         "admitted", "rejected");
+  replay("clock", 0);
+  replay("tinylfu", 1);
+  return 0;
+}
+
+/*
+ * replay - run the trace through a fresh cache and print its hit ratios
+ */
+static void replay(char *name, int admission)
+{
+  static char obj[MAX_OBJECT_SIZE];
+  unsigned long hits = 0, admitted = 0, rejected = 0, a, r;
+  double bytes = 0, hitbytes = 0;
+  char stats[MAXBUF], *line;
+  size_t i, n;
+  char *copy;
+  int status;
+
+  fflush(stdout);
+  if (Fork() > 0)
+  {
+    Wait(&status); /* The cache is global, so each run gets a process */
+    return;
+  }
+
+  cache_init(CACHE_SHARDS, admission);
+  for (i = 0; i < ntrace; i++)
+  {
+    bytes += trace[i].size;
+    if ((copy = cache_lookup(trace[i].key, &n, NULL)) != NULL)
+    {
+      hits++;
+      hitbytes += n;
+      Free(copy);
+    }
+    else
+      cache_insert(trace[i].key, obj, trace[i].size, NULL);
+  }
+
+  /* Admission counters are columns 6 and 7 of the shard lines */
+  cache_print_stats(stats, sizeof(stats));
+  for (line = strtok(stats, "\n"); line; line = strtok(NULL, "\n"))
+    if (sscanf(line, "%*d %*u %*u %*u %*u %lu %lu", &a, &r) == 2)
+    {
+      admitted += a;
+      rejected += r;
+    }
+  printf("%-8s %9.2f%% %9.2f%% %10lu %10lu\n", name, 100.0 * hits / ntrace,
+         100.0 * hitbytes / bytes, admitted, rejected);
+  exit(0);
+}
+
+/*
+ * make_trace - Zipf requests over NOBJS objects, broken up by scans
+ */
+static void make_trace(void)
+{
+  double *cdf = Malloc(NOBJS * sizeof(double)), sum = 0, u;
+  unsigned long scanid = 0;
+  char key[MAXLINE];
+  size_t i, lo, hi;
+  int j;
+
+  for (i = 0; i < NOBJS; i++)
+    cdf[i] = sum += 1.0 / pow(i + 1, ZIPF_S);
+  trace = Malloc((NREQS + NREQS / SCAN_EVERY * SCAN_LEN) * sizeof(request_t));
+  srand48(15213);
+
+  for (i = 0; i < NREQS; i++)
+  {
+    if (i % SCAN_EVERY == SCAN_EVERY - 1)
+      for (j = 0; j < SCAN_LEN; j++, scanid++)
+      {
+        snprintf(key, sizeof(key), "crawl.example.com:80/page/%lu", scanid);
+        trace[ntrace].key = strdup(key);
+        trace[ntrace++].size = object_size(scanid + NOBJS);
+      }
+
+    /* Smallest rank whose cumulative weight reaches u */
+    u = drand48() * sum;
+    for (lo = 0, hi = NOBJS - 1; lo < hi;)
+      if (cdf[(lo + hi) / 2] < u)
+        lo = (lo + hi) / 2 + 1;
+      else
+        hi = (lo + hi) / 2;
+    snprintf(key, sizeof(key), "www.example.com:80/obj/%zu", lo);
+    trace[ntrace].key = strdup(key);
+    trace[ntrace++].size = object_size(lo);
+  }
+  Free(cdf);
+}
+
+/*
+ * object_size - a stable size for object id, log-uniform in 1-100 KB
+ */
+static size_t object_size(unsigned long id)
+{
+  unsigned long x = id * 0x9E3779B97F4A7C15UL;
+
+  return (size_t)(1024 * pow(100, (x >> 11) / 9007199254740992.0));
+}
+
+static void load_trace(char *file)
+{
+  FILE *fp = Fopen(file, "r");
+  size_t cap = 1024, size;
+  char line[MAXLINE], key[MAXLINE];
+
+  trace = Malloc(cap * sizeof(request_t));
+  while (Fgets(line, sizeof(line), fp))
+  {
+    if (sscanf(line, "%8191s %zu", key, &size) != 2)
+      continue;
+    if (ntrace == cap)
+      trace = Realloc(trace, (cap *= 2) * sizeof(request_t));
+    trace[ntrace].key = strdup(key);
+    trace[ntrace++].size = size < MAX_OBJECT_SIZE ? size : MAX_OBJECT_SIZE;
+  }
+  Fclose(fp);
+}
@@ -0,0 +1,213 @@
+/*
+ * bench_index.c - compare the disk tier's SIMD-probed key index
+ *     (hindex.c) against a plain chained hash table, as the memory
+ *     cache uses, with the same keys and hash.
+ *
+ * usage: ./bench_index [nkeys ...]   (default: 10000 100000 1000000)
+ *
+ * For each size, the keys are URL-shaped cache keys ("host:port/path").
+ * Both tables are loaded to the same number of keys and then probed in
+ * a shuffled order, once with keys that are present and once with keys
+ * that are not. Results are nanoseconds per lookup.
+ */
+#include "csapp.h"
+#include "epoch.h"
+#include "hindex.h"
+
+#define ROUNDS 5 /* Lookup passes over the key set, best one wins */
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+typedef struct node
+{
+  char *key;
+  unsigned long hash;
+  struct node *next;
+} node_t;
+
+typedef struct
+{
+  node_t **buckets;
+  size_t nbuckets;
+} chain_t;
+
+static unsigned long hash(const char *key);
+static void chain_init(chain_t *c, size_t nkeys);
+static void chain_insert(chain_t *c, node_t *n);
+static node_t *chain_find(chain_t *c, const char *key, unsigned long h);
+static int key_matches(void *val, void *key);
+static double now_ns(void);
+static void shuffle(char **keys, size_t n);
+static void run(size_t n);
+
+int main(int argc, char **argv)
+{
+  static const size_t sizes[] = {10000, 100000, 1000000};
+  int i;
+
+  srand(15213);
+  printf("%10s %12s %12s %12s %12s\n", "keys", "swiss-hit", "chain-hit",
+         "swiss-miss", "chain-miss");
+  if (argc > 1)
+    for (i = 1; i < argc; i++)
+      run(strtoul(argv[i], NULL, 10));
+  else
+    for (i = 0; i < 3; i++)
+      run(sizes[i]);
+  return 0;
+}
+
+/*
+ * run - load n keys into both tables and time hit and miss lookups
+ */
+static void run(size_t n)
+{
+  char **keys = Malloc(n * sizeof(char *));
+  char **absent = Malloc(n * sizeof(char *));
+  node_t *nodes = Malloc(n * sizeof(node_t));
+  unsigned long *hashes = Malloc(n * sizeof(unsigned long));
+  unsigned long *ahashes = Malloc(n * sizeof(unsigned long));
+  double best[4] = {1e30, 1e30, 1e30, 1e30}, t;
+  volatile size_t found = 0;
+  hindex_t ix;
+  chain_t chain;
+  size_t i;
+  int r;
+
+  hindex_init(&ix, 64); /* Grow through resizes, as the cache does */
+  chain_init(&chain, n);
+  for (i = 0; i < n; i++)
+  {
+    char buf[MAXLINE];
+
+    snprintf(buf, sizeof(buf), "www.example%zu.com:80/static/img/%zu.jpg",
+             i % 97, i);
+    keys[i] = strdup(buf);
+    snprintf(buf, sizeof(buf), "www.example%zu.com:80/missing/%zu.html",
+             i % 97, i);
+    absent[i] = strdup(buf);
+    nodes[i].key = keys[i];
+    nodes[i].hash = hash(keys[i]);
+    chain_insert(&chain, &nodes[i]);
+    hindex_insert(&ix, nodes[i].hash, &nodes[i]);
+  }
+  shuffle(keys, n);
+  for (i = 0; i < n; i++)
+  {
+    hashes[i] = hash(keys[i]);
+    ahashes[i] = hash(absent[i]);
+  }
+
+  /* Hashing is done up front so only the probe itself is timed */
+  for (r = 0; r < ROUNDS; r++)
+  {
+    epoch_enter();
+    t = now_ns();
+    for (i = 0; i < n; i++)
+      found += hindex_find(&ix, hashes[i], key_matches, keys[i]) != NULL;
+    best[0] = MIN(best[0], (now_ns() - t) / n);
+    t = now_ns();
+    for (i = 0; i < n; i++)
+      found += chain_find(&chain, keys[i], hashes[i]) != NULL;
+    best[1] = MIN(best[1], (now_ns() - t) / n);
+    t = now_ns();
+    for (i = 0; i < n; i++)
+      found += hindex_find(&ix, ahashes[i], key_matches, absent[i]) != NULL;
+    best[2] = MIN(best[2], (now_ns() - t) / n);
+    t = now_ns();
+    for (i = 0; i < n; i++)
+      found += chain_find(&chain, absent[i], ahashes[i]) != NULL;
+    best[3] = MIN(best[3], (now_ns() - t) / n);
+    epoch_exit();
+  }
+  if (found != 2 * ROUNDS * n)
+    app_error("bench_index: lookup mismatch");
+  printf("%10zu %9.1f ns %9.1f ns %9.1f ns %9.1f ns\n", n, best[0], best[1],
+         best[2], best[3]);
+
+  for (i = 0; i < n; i++)
+  {
+    free(keys[i]);
+    free(absent[i]);
+  }
+  free(keys);
+  free(absent);
+  free(nodes);
+  free(hashes);
+  free(ahashes);
+  free(chain.buckets);
+  /* The swiss table is left to exit, as the cache never frees it */
+}
+
+/*
+ * hash - FNV-1a over the key, the same hash the cache uses
+ */
+static unsigned long hash(const char *key)
+{
+  unsigned long h = 14695981039346656037UL;
+
+  while (*key)
+  {
+    h ^= (unsigned char)*key++;
+    h *= 1099511628211UL;
+  }
+  return h;
+}
+
+/*
+ * chain_init - one bucket per key, rounded up to a power of two
+ */
+static void chain_init(chain_t *c, size_t nkeys)
+{
+  c->nbuckets = 1;
+  while (c->nbuckets < nkeys)
+    c->nbuckets <<= 1;
+  c->buckets = Calloc(c->nbuckets, sizeof(node_t *));
+}
+
+static void chain_insert(chain_t *c, node_t *n)
+{
+  node_t **b = &c->buckets[n->hash & (c->nbuckets - 1)];
+
+  n->next = *b;
+  *b = n;
+}
+
+static node_t *chain_find(chain_t *c, const char *key, unsigned long h)
+{
+  node_t *n;
+
+  for (n = c->buckets[h & (c->nbuckets - 1)]; n; n = n->next)
+    if (n->hash == h && !strcmp(n->key, key))
+      return n;
+  return NULL;
+}
+
+static int key_matches(void *val, void *key)
+{
+  return !strcmp(((node_t *)val)->key, key);
+}
+
+static double now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+ * shuffle - Fisher-Yates, so lookups don't follow insertion order
+ */
+static void shuffle(char **keys, size_t n)
+{
+  size_t i, j;
+  char *tmp;
+
+  for (i = n - 1; i > 0; i--)
+  {
+    j = ((size_t)rand() * RAND_MAX + rand()) % (i + 1);
+    tmp = keys[i];
+    keys[i] = keys[j];
+    keys[j] = tmp;
+  }
+}
@@ -0,0 +1,192 @@
+/*
+ * bench_scan.c - throughput of the rio buffer scanners in csapp.c: the
+ *     scalar, SSE2 and AVX2 searches for '\n' behind rio_readlineb() and
+ *     for "\r\n\r\n" behind rio_readhdrsb(), against the byte-at-a-time
+ *     rio_readlineb() they replaced
+ *
+ * usage: ./bench_scan [nrequests]   (default: 200000)
+ *
+ * Each path reads pipelined copies of the same request header block out
+ * of a rio_t whose buffer has been filled with as many as fit, either a
+ * line at a time or a block at a time. Refilling the buffer is outside
+ * the timing. Results are bytes per cycle (time stamp counter ticks
+ * where there is one, else bytes per nanosecond) for a browser-style
+ * request and one carrying a long Cookie header; levels the CPU lacks
+ * are skipped.
+ */
+#include "csapp.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC
+#define ticks() ((double)__rdtsc())
+#define UNIT "B/cycle"
+#else
+#define ticks() now_ns()
+#define UNIT "B/ns"
+#endif
+
+#define ROUNDS 5 /* Passes over the requests, best one wins */
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+static const char *browser_req =
+    "GET http://www.example.com/static/css/site.css?v=20240117 HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 "
+    "(KHTML, like Gecko) Chrome/120.0.0.0 Safari/537.36\r\n"
+    "Accept: text/css,*/*;q=0.1\r\n"
+    "Accept-Encoding: gzip, deflate\r\n"
+    "Accept-Language: en-US,en;q=0.9,ko;q=0.8\r\n"
+    "Cache-Control: no-cache\r\n"
+    "Pragma: no-cache\r\n"
+    "Referer: http://www.example.com/index.html\r\n"
+    "Cookie: session=4f2a9c1e7b; theme=dark; consent=1\r\n"
+    "Proxy-Connection: keep-alive\r\n"
+    "\r\n";
+
+typedef ssize_t (*read_fn)(rio_t *rp, char *buf);
+
+static char cookie_req[MAXBUF];
+static const char *levels[] = {"scalar", "sse2", "avx2"};
+
+static ssize_t read_bytewise(rio_t *rp, char *buf);
+static ssize_t read_lines(rio_t *rp, char *buf);
+static ssize_t read_block(rio_t *rp, char *buf);
+static double run(read_fn read, const char *req, size_t n);
+static void report(const char *name, const char *req, size_t n);
+#ifndef HAVE_TSC
+static double now_ns(void);
+#endif
+
+int main(int argc, char **argv)
+{
+  size_t n = argc > 1 ? strtoul(argv[1], NULL, 10) : 200000;
+  int len, i;
+
+  /* The browser request with a 1.5 KB Cookie line in place of its own */
+  len = sprintf(cookie_req, "%.*s", (int)(strstr(browser_req, "Cookie:") -
+                                          browser_req), browser_req);
+  len += sprintf(cookie_req + len, "Cookie: ");
+  for (i = 0; i < 48; i++)
+    len += sprintf(cookie_req + len, "k%02d=%024x; ", i, i * 2654435761u);
+  sprintf(cookie_req + len, "end=1\r\nProxy-Connection: keep-alive\r\n\r\n");
+
+  printf("%8s %7s %12s %12s %12s   (%s)\n", "request", "scanner", "bytewise",
+         "readlineb", "readhdrsb", UNIT);
+  report("browser", browser_req, n);
+  report("cookie", cookie_req, n / 4);
+  return 0;
+}
+
+/*
+ * report - one row per scanner level the CPU has, with the bytewise
+ *     baseline alongside
+ */
+static void report(const char *name, const char *req, size_t n)
+{
+  double base;
+  int level;
+
+  rio_scan_select(RIO_SCAN_SCALAR);
+  base = run(read_bytewise, req, n);
+  for (level = RIO_SCAN_SCALAR; level <= RIO_SCAN_AVX2; level++)
+  {
+    if (rio_scan_select(level) != level)
+      break;
+    printf("%8s %7s %12.3f %12.3f %12.3f\n", level ? "" : name,
+           levels[level], base, run(read_lines, req, n),
+           run(read_block, req, n));
+  }
+}
+
+/*
+ * run - read n copies of req, refilling the rio buffer as it empties
+ *     return the best bytes per tick over ROUNDS passes
+ */
+static double run(read_fn read, const char *req, size_t n)
+{
+  static rio_t rio;
+  static char buf[MAXBUF];
+  size_t len = strlen(req), per = sizeof(rio.rio_buf) / len, done, k, i;
+  double t, spent, best = 0;
+  ssize_t sum = 0;
+  int r;
+
+  rio_readinitb(&rio, -1); /* Never read: the buffer is refilled here */
+  for (r = 0; r < ROUNDS; r++)
+  {
+    spent = 0;
+    for (done = 0; done < n; done += k)
+    {
+      k = MIN(per, n - done);
+      for (i = 0; i < k; i++)
+        memcpy(rio.rio_buf + i * len, req, len);
+      rio.rio_bufptr = rio.rio_buf;
+      rio.rio_cnt = k * len;
+
+      t = ticks();
+      for (i = 0; i < k; i++)
+        sum += read(&rio, buf);
+      spent += ticks() - t;
+    }
+    if (n * len / spent > best)
+      best = n * len / spent;
+  }
+  if (sum != (ssize_t)(ROUNDS * n * len))
+    app_error("a request was misread");
+  return best;
+}
+
+/*
+ * read_bytewise - a header block through the old rio_readlineb(), one
+ *     rio_readnb() call per byte
+ */
+static ssize_t read_bytewise(rio_t *rp, char *buf)
+{
+  ssize_t total = 0, n;
+  char c, *p;
+
+  do
+  {
+    for (p = buf, n = 0; n < MAXLINE - 1 && rio_readnb(rp, &c, 1) == 1; n++)
+      if ((*p++ = c) == '\n')
+      {
+        n++;
+        break;
+      }
+    *p = '\0';
+    total += n;
+  } while (n > 2);
+  return total;
+}
+
+/*
+ * read_lines - a header block a line at a time, as the proxy read it
+ *     before http.c
+ */
+static ssize_t read_lines(rio_t *rp, char *buf)
+{
+  ssize_t total = 0, n;
+
+  do
+    total += n = rio_readlineb(rp, buf, MAXLINE);
+  while (n > 2);
+  return total;
+}
+
+/*
+ * read_block - a header block in one call
+ */
+static ssize_t read_block(rio_t *rp, char *buf)
+{
+  return rio_readhdrsb(rp, buf, MAXBUF);
+}
+
+#ifndef HAVE_TSC
+static double now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+#endif
@@ -0,0 +1,554 @@
+/*
+ * cache.c - URL-keyed in-memory cache of complete origin responses
+ *
+ * Objects larger than MAX_OBJECT_SIZE are never stored, and the sum of
+ * the stored object sizes never exceeds MAX_CACHE_SIZE.
+ *
+ * The cache is split into a power-of-two number of shards, chosen by
+ * the hash of the key. Each shard has its own writer lock, key index,
+ * eviction ring and a slice of MAX_CACHE_SIZE as its byte budget (the
+ * slices add up to exactly MAX_CACHE_SIZE). The key index is NBUCKETS
+ * hash chains per shard: a shard never holds more than its slice of
+ * MAX_CACHE_SIZE, so the chains stay short and a hit is one bucket load
+ * away from its entry. (The disk tier, whose lookups mostly miss, uses
+ * the open-addressing index in hindex.c instead.)
+ *
+ * Lookups take no lock at all. Entries are published into the bucket
+ * chains with release stores and readers walk them inside an epoch
+ * (epoch.c); an entry that is evicted or replaced is unlinked under the
+ * shard lock and retired, and only freed after every reader that could
+ * have seen it has left its epoch. A hit therefore writes nothing that
+ * other cores share: recency is one "referenced" bit per entry, set only
+ * if it is clear, and eviction runs the CLOCK algorithm over the shard's
+ * ring, giving referenced entries a second chance. Hit and miss counts
+ * are kept per thread and summed when printed.
+ *
+ * With admission on, an object that needs room is only let in if the
+ * TinyLFU sketch (tinylfu.c) estimates it is requested more often than
+ * the entry the CLOCK hand would evict first; otherwise the cache is
+ * left as it was. Every lookup is recorded in the sketch.
+ *
+ * Each entry, its key and its object share one chunk from the slab
+ * allocator (slab.c) instead of three malloc blocks, so the cache's
+ * resident memory follows the bytes it holds and an insert never waits
+ * on malloc's lock. An insert the slab arena cannot fit is dropped and
+ * counted as "nomem".
+ *
+ * Objects evicted by the CLOCK hand are spilled to the disk tier
+ * (disk.c), when there is one, once the shard lock is released: the
+ * inserting thread stays in its epoch until then, so the retired
+ * entries cannot be freed before their bytes are copied out.
+ *
+ * After a warm restart, a lookup that misses takes the object from the
+ * snapshot the proxy was started with (snapshot.c), if it is there, and
+ * inserts it with the referenced bit it had when the snapshot was saved.
+ * cache_walk() lets snapshot_save() read every entry in CLOCK order.
+ *
+ * Each entry carries its cache_meta_t: the time it stops being fresh.
+ * A lookup returns stale objects too, for the caller to revalidate, and
+ * cache_refresh() moves the time on in place when the origin answers
+ * 304 Not Modified, so the object's bytes are never copied again.
+ *
+ * Each shard also queues its entries by expiry time on a hierarchical
+ * timing wheel (wheel.c), advanced under the writer lock on every
+ * insert. An entry that expires with no validator can only be fetched
+ * again in full, so it is dropped then and its bytes go to new objects
+ * before the CLOCK hand evicts anything live; entries that can be
+ * revalidated stay. Expiring an entry costs O(1), with no scan of the
+ * shard. One with a stale-while-revalidate or stale-if-error window is
+ * only queued to go at the end of it, since until then it may still be
+ * served.
+ *
+ * In the last CACHE_AHEAD_FRACTION of its lifetime an entry counts its
+ * hits, and the one that makes CACHE_AHEAD_HITS is told (meta->hot) to
+ * refresh it before it expires. Only those hits write to the entry;
+ * cache_refresh() and a new copy start the count again.
+ */
+#include "csapp.h"
+#include "proxy.h"
+#include "epoch.h"
+#include "slab.h"
+#include "tinylfu.h"
+#include "disk.h"
+#include "snapshot.h"
+#include "wheel.h"
+#include "cache.h"
+
+#define NBUCKETS 256 /* Hash buckets of each shard's key index */
+
+typedef struct cache_entry
+{
+  char *key;                   /* Both point into the entry's own chunk */
+  char *obj;
+  size_t size;
+  unsigned long hash;
+  cache_meta_t meta;           /* expires is moved on by cache_refresh() */
+  wheel_node_t timer;          /* On the shard's wheel until it expires */
+  int ahead_hits;              /* Hits close to expiry, see cache_lookup() */
+  int referenced;              /* Set on hit, cleared by the CLOCK hand */
+  struct cache_entry *hnext;   /* Next entry in the same bucket */
+  struct cache_entry *prev;    /* Neighbours on the shard's CLOCK ring */
+  struct cache_entry *next;
+} cache_entry_t;
+
+typedef struct
+{
+  pthread_mutex_t lock;              /* Serializes writers only */
+  cache_entry_t *buckets[NBUCKETS];  /* Read without the lock */
+  cache_entry_t *hand;               /* CLOCK hand; NULL if empty */
+  wheel_t wheel;                     /* Entries by expiry time */
+  size_t size;                       /* Sum of the sizes of cached objects */
+  size_t budget;                     /* This shard's share of MAX_CACHE_SIZE */
+  unsigned long contended;           /* Writer lock acquisitions that waited */
+  unsigned long nomem;               /* Inserts the slab arena refused */
+  unsigned long admitted;            /* Inserts that beat their victim */
+  unsigned long rejected;            /* Inserts that lost to their victim */
+  unsigned long expired;             /* Dropped by the wheel when stale */
+} __attribute__((aligned(64))) cache_shard_t;
+
+/* Per-thread counters, so hits never share a cache line */
+typedef struct
+{
+  unsigned long hits[CACHE_MAX_SHARDS];
+  unsigned long misses[CACHE_MAX_SHARDS];
+} __attribute__((aligned(64))) cache_tstats_t;
+
+static cache_shard_t *shards;
+static int nshards;
+static int admission; /* Nonzero to filter inserts through TinyLFU */
+static cache_tstats_t tstats[EPOCH_MAX_THREADS];
+
+static int insert(const char *key, unsigned long h, const char *obj,
+                  size_t size, const cache_meta_t *meta, int referenced);
+static unsigned long hash(const char *key);
+static cache_shard_t *shard_of(unsigned long h);
+static cache_entry_t **bucket_of(cache_shard_t *s, unsigned long h);
+static cache_entry_t *find(cache_shard_t *s, const char *key,
+                           unsigned long h);
+static void lock(cache_shard_t *s);
+static cache_entry_t *clock_victim(cache_shard_t *s);
+static void unlink_entry(cache_shard_t *s, cache_entry_t *e);
+static void expire_entry(wheel_node_t *n, void *arg);
+static time_t drop_time(const cache_meta_t *meta);
+static void destroy_entry(void *e);
+
+/*
+ * cache_init - start with an empty cache of n shards; n must be a power
+ *     of two no larger than CACHE_MAX_SHARDS. admit selects TinyLFU
+ *     admission (nonzero) or plain CLOCK replacement (zero).
+ */
+void cache_init(int n, int admit)
+{
+  int i, rc;
+
+  if (n <= 0 || n > CACHE_MAX_SHARDS || (n & (n - 1)))
+    app_error("cache_init: shard count must be a power of two <= "
+              "MAX_CACHE_SIZE / MAX_OBJECT_SIZE");
+
+  nshards = n;
+  if ((rc = posix_memalign((void **)&shards, 64, n * sizeof(cache_shard_t))))
+    posix_error(rc, "posix_memalign error");
+  memset(shards, 0, n * sizeof(cache_shard_t));
+  for (i = 0; i < n; i++)
+  {
+    if ((rc = pthread_mutex_init(&shards[i].lock, NULL)) != 0)
+      posix_error(rc, "pthread_mutex_init error");
+    shards[i].budget = MAX_CACHE_SIZE / n + (i < MAX_CACHE_SIZE % n);
+    wheel_init(&shards[i].wheel, time(NULL));
+  }
+  slab_init(MAX_CACHE_SIZE);
+  tinylfu_init();
+  admission = admit;
+}
+
+/*
+ * cache_lookup - return a malloc'd copy of the object cached under key
+ *     (and its size in *size and, unless meta is NULL, its metadata in
+ *     *meta), or NULL on a miss. The caller frees it. The object may be
+ *     stale. meta->hot is set on the one hit that makes it hot close to
+ *     its expiry.
+ */
+char *cache_lookup(const char *key, size_t *size, cache_meta_t *meta)
+{
+  unsigned long h = hash(key);
+  cache_shard_t *s = shard_of(h);
+  cache_tstats_t *ts = &tstats[epoch_thread_id()];
+  cache_entry_t *e;
+  char *copy = NULL;
+  const char *snap;
+  cache_meta_t m;
+  time_t now, ahead;
+  int referenced;
+
+  if (admission)
+    tinylfu_record(h);
+  epoch_enter();
+  if ((e = find(s, key, h)) != NULL)
+  {
+    copy = Malloc(e->size);
+    memcpy(copy, e->obj, e->size);
+    *size = e->size;
+    m.expires = __atomic_load_n(&e->meta.expires, __ATOMIC_RELAXED);
+    m.born = __atomic_load_n(&e->meta.born, __ATOMIC_RELAXED);
+    m.revalidate = e->meta.revalidate;
+    m.stale_until = __atomic_load_n(&e->meta.stale_until, __ATOMIC_RELAXED);
+    m.error_until = __atomic_load_n(&e->meta.error_until, __ATOMIC_RELAXED);
+    m.hot = 0;
+    now = time(NULL);
+    if ((ahead = (m.expires - m.born) / CACHE_AHEAD_FRACTION) < 1)
+      ahead = 1;
+    if (m.expires > now && m.expires - now <= ahead)
+      m.hot = __atomic_add_fetch(&e->ahead_hits, 1, __ATOMIC_RELAXED) ==
+              CACHE_AHEAD_HITS;
+    if (!__atomic_load_n(&e->referenced, __ATOMIC_RELAXED))
+      __atomic_store_n(&e->referenced, 1, __ATOMIC_RELAXED);
+  }
+  epoch_exit();
+
+  /* Fault the object in from a warm-restart snapshot */
+  if (!copy && snapshot_find(key, h, &snap, size, &m, &referenced))
+  {
+    copy = Malloc(*size);
+    memcpy(copy, snap, *size);
+    insert(key, h, snap, *size, &m, referenced);
+  }
+
+  if (copy && meta)
+    *meta = m;
+  if (copy)
+    ts->hits[s - shards]++;
+  else
+    ts->misses[s - shards]++;
+  return copy;
+}
+
+/*
+ * cache_insert - store a copy of obj under key, evicting entries of the
+ *     key's shard with the CLOCK algorithm until it fits. Objects over
+ *     MAX_OBJECT_SIZE, and objects that lose the admission test, are
+ *     ignored. A NULL meta means the object was just fetched and is
+ *     fresh for CACHE_FRESH_SECS, with no validator.
+ *     return 1 if the object was stored, 0 if not
+ */
+int cache_insert(const char *key, const char *obj, size_t size,
+                 const cache_meta_t *meta)
+{
+  time_t now = time(NULL);
+  cache_meta_t m = {now + CACHE_FRESH_SECS, now, 0, 0, 0, 0};
+
+  return insert(key, hash(key), obj, size, meta ? meta : &m, 0);
+}
+
+/*
+ * cache_refresh - give the object cached under key the new age, expiry
+ *     and stale windows in meta, after the origin said it has not changed
+ *     return 1 if it was cached, 0 if not
+ */
+int cache_refresh(const char *key, const cache_meta_t *meta)
+{
+  unsigned long h = hash(key);
+  cache_shard_t *s = shard_of(h);
+  cache_entry_t *e;
+
+  lock(s);
+  if ((e = find(s, key, h)) != NULL)
+  {
+    __atomic_store_n(&e->meta.born, meta->born, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->meta.expires, meta->expires, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->meta.stale_until, meta->stale_until,
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&e->meta.error_until, meta->error_until,
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&e->ahead_hits, 0, __ATOMIC_RELAXED);
+    wheel_del(&s->wheel, &e->timer);
+    wheel_add(&s->wheel, &e->timer, drop_time(meta));
+  }
+  pthread_mutex_unlock(&s->lock);
+  return e != NULL;
+}
+
+/*
+ * cache_walk - call fn on every cached object, shard by shard in CLOCK
+ *     order from the hand, with the shard's writer lock held
+ */
+void cache_walk(cache_walk_t fn, void *arg)
+{
+  cache_entry_t *e;
+  int i;
+
+  for (i = 0; i < nshards; i++)
+  {
+    lock(&shards[i]);
+    if ((e = shards[i].hand) != NULL)
+      do
+      {
+        fn(arg, e->key, e->hash, e->obj, e->size, &e->meta,
+           __atomic_load_n(&e->referenced, __ATOMIC_RELAXED));
+        e = e->next;
+      } while (e != shards[i].hand);
+    pthread_mutex_unlock(&shards[i].lock);
+  }
+}
+
+/*
+ * cache_print_stats - write per-shard counters as text into buf
+ *     return the number of bytes written
+ */
+int cache_print_stats(char *buf, size_t size)
+{
+  size_t len = 0;
+  int i, t;
+
+  len += snprintf(buf, size, "shard hits misses contended nomem admitted "
+                             "rejected bytes budget expired\n");
+  for (i = 0; i < nshards && len < size; i++)
+  {
+    cache_shard_t *s = &shards[i];
+    unsigned long hits = 0, misses = 0;
+    for (t = 0; t < EPOCH_MAX_THREADS; t++)
+    {
+      hits += __atomic_load_n(&tstats[t].hits[i], __ATOMIC_RELAXED);
+      misses += __atomic_load_n(&tstats[t].misses[i], __ATOMIC_RELAXED);
+    }
+    len += snprintf(buf + len, size - len,
+                    "%d %lu %lu %lu %lu %lu %lu %lu %lu %lu\n", i, hits,
+                    misses,
+                    __atomic_load_n(&s->contended, __ATOMIC_RELAXED),
+                    __atomic_load_n(&s->nomem, __ATOMIC_RELAXED),
+                    __atomic_load_n(&s->admitted, __ATOMIC_RELAXED),
+                    __atomic_load_n(&s->rejected, __ATOMIC_RELAXED),
+                    (unsigned long)__atomic_load_n(&s->size, __ATOMIC_RELAXED),
+                    (unsigned long)s->budget,
+                    __atomic_load_n(&s->expired, __ATOMIC_RELAXED));
+  }
+  if (len < size)
+    len += slab_print_stats(buf + len, size - len);
+  if (len < size)
+    len += snapshot_print_stats(buf + len, size - len);
+  return len < size ? len : size - 1;
+}
+
+/*
+ * insert - cache_insert() for key of hash h, with the entry's metadata
+ *     and referenced bit starting as given
+ */
+static int insert(const char *key, unsigned long h, const char *obj,
+                  size_t size, const cache_meta_t *meta, int referenced)
+{
+  cache_shard_t *s = shard_of(h);
+  size_t klen = strlen(key) + 1;
+  cache_entry_t *e, *p, *spill = NULL;
+
+  if (size > MAX_OBJECT_SIZE || size > s->budget)
+    return 0;
+
+  if ((e = slab_alloc(sizeof(cache_entry_t) + klen + size)) == NULL)
+  {
+    __atomic_add_fetch(&s->nomem, 1, __ATOMIC_RELAXED);
+    return 0;
+  }
+  e->key = (char *)(e + 1);
+  memcpy(e->key, key, klen);
+  e->obj = e->key + klen;
+  memcpy(e->obj, obj, size);
+  e->size = size;
+  e->hash = h;
+  e->meta = *meta;
+  e->meta.hot = 0;
+  e->ahead_hits = 0;
+  e->referenced = referenced;
+
+  epoch_enter(); /* Evicted entries stay readable until spilled */
+  lock(s);
+  wheel_advance(&s->wheel, time(NULL), expire_entry, s);
+
+  /*
+   * A new copy of a key already cached (another worker fetched it too,
+   * or a refresh) is always let in: its requests are already counted in
+   * the sketch, and turning it away after dropping the old copy would
+   * lose both.
+   */
+  p = find(s, key, h);
+  if (!p && admission && s->size + size > s->budget)
+  {
+    if (!tinylfu_admit(h, clock_victim(s)->hash))
+    {
+      s->rejected++;
+      pthread_mutex_unlock(&s->lock);
+      epoch_exit();
+      slab_free(e); /* Never published */
+      return 0;
+    }
+    s->admitted++;
+  }
+  if (p)
+    unlink_entry(s, p);
+  while (s->size + size > s->budget)
+  {
+    p = clock_victim(s);
+    unlink_entry(s, p);
+    p->next = spill; /* Off the ring now; spilled once unlocked */
+    spill = p;
+  }
+
+  /* Add to the ring just behind the hand, the last place it will look */
+  if (s->hand)
+  {
+    e->next = s->hand;
+    e->prev = s->hand->prev;
+    e->prev->next = e;
+    s->hand->prev = e;
+  }
+  else
+    s->hand = e->next = e->prev = e;
+  s->size += size;
+  wheel_add(&s->wheel, &e->timer, drop_time(&e->meta));
+
+  /* Publish: e is fully built before readers can reach it */
+  e->hnext = *bucket_of(s, h);
+  __atomic_store_n(bucket_of(s, h), e, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&s->lock);
+
+  /* Disk writes wait on nothing the shard's other writers hold */
+  for (; spill; spill = p)
+  {
+    p = spill->next;
+    disk_spill(spill->key, spill->obj, spill->size, &spill->meta);
+  }
+  epoch_exit();
+  return 1;
+}
+
+/*
+ * hash - FNV-1a hash of a key
+ */
+static unsigned long hash(const char *key)
+{
+  unsigned long h = 14695981039346656037UL;
+
+  while (*key)
+  {
+    h ^= (unsigned char)*key++;
+    h *= 1099511628211UL;
+  }
+  return h;
+}
+
+/*
+ * shard_of - the shard that owns hash h (low bits pick the shard)
+ */
+static cache_shard_t *shard_of(unsigned long h)
+{
+  return &shards[h & (nshards - 1)];
+}
+
+static cache_entry_t **bucket_of(cache_shard_t *s, unsigned long h)
+{
+  return &s->buckets[(h / nshards) % NBUCKETS];
+}
+
+/*
+ * find - the entry cached under key in shard s, or NULL. Readers call
+ *     it inside an epoch, writers with the shard lock held.
+ */
+static cache_entry_t *find(cache_shard_t *s, const char *key,
+                           unsigned long h)
+{
+  cache_entry_t *e;
+
+  for (e = __atomic_load_n(bucket_of(s, h), __ATOMIC_ACQUIRE); e;
+       e = __atomic_load_n(&e->hnext, __ATOMIC_ACQUIRE))
+    if (e->hash == h && !strcmp(e->key, key))
+      return e;
+  return NULL;
+}
+
+/*
+ * lock - take a shard's writer lock, counting the times it was busy
+ */
+static void lock(cache_shard_t *s)
+{
+  if (pthread_mutex_trylock(&s->lock) == 0)
+    return;
+  __atomic_add_fetch(&s->contended, 1, __ATOMIC_RELAXED);
+  pthread_mutex_lock(&s->lock);
+}
+
+/*
+ * clock_victim - advance the CLOCK hand past referenced entries,
+ *     clearing their bits, and return the entry it stops at (caller
+ *     holds the shard lock; the shard must not be empty)
+ */
+static cache_entry_t *clock_victim(cache_shard_t *s)
+{
+  while (__atomic_load_n(&s->hand->referenced, __ATOMIC_RELAXED))
+  {
+    __atomic_store_n(&s->hand->referenced, 0, __ATOMIC_RELAXED);
+    s->hand = s->hand->next;
+  }
+  return s->hand;
+}
+
+/*
+ * unlink_entry - remove an entry from its bucket and the CLOCK ring and
+ *     retire it (caller holds the shard lock). Readers already on the
+ *     entry may keep walking from it: its hnext is left intact.
+ */
+static void unlink_entry(cache_shard_t *s, cache_entry_t *e)
+{
+  cache_entry_t **pp = bucket_of(s, e->hash);
+
+  while (*pp != e)
+    pp = &(*pp)->hnext;
+  __atomic_store_n(pp, e->hnext, __ATOMIC_RELEASE);
+  wheel_del(&s->wheel, &e->timer);
+
+  if (e->next == e)
+    s->hand = NULL;
+  else
+  {
+    e->prev->next = e->next;
+    e->next->prev = e->prev;
+    if (s->hand == e)
+      s->hand = e->next;
+  }
+  s->size -= e->size;
+  epoch_retire(e, destroy_entry);
+}
+
+/*
+ * expire_entry - wheel callback for an entry that has gone stale, and
+ *     is past its stale windows: drop it unless it can be revalidated
+ *     (caller holds the shard lock)
+ */
+static void expire_entry(wheel_node_t *n, void *arg)
+{
+  cache_entry_t *e = (cache_entry_t *)((char *)n -
+                                       offsetof(cache_entry_t, timer));
+  cache_shard_t *s = arg;
+
+  if (e->meta.revalidate)
+    return;
+  s->expired++;
+  unlink_entry(s, e);
+}
+
+/*
+ * drop_time - when the wheel should look at an entry: when it expires
+ *     or, if later, when the last of its stale windows closes
+ */
+static time_t drop_time(const cache_meta_t *meta)
+{
+  time_t t = meta->expires;
+
+  if (meta->stale_until > t)
+    t = meta->stale_until;
+  if (meta->error_until > t)
+    t = meta->error_until;
+  return t;
+}
+
+static void destroy_entry(void *e)
+{
+  slab_free(e);
+}
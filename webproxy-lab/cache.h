@@ -0,0 +1,40 @@
+/*
+ * cache.h - URL-keyed in-memory cache of complete origin responses
+ */
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include <stddef.h>
+#include <time.h>
+
+#define CACHE_SHARDS 8     /* Default number of shards */
+#define CACHE_MAX_SHARDS 8 /* Each shard must still hold MAX_OBJECT_SIZE */
+#define CACHE_FRESH_SECS 60 /* Served without asking the origin this long */
+#define CACHE_AHEAD_FRACTION 10 /* Refresh-ahead window: last 1/10 of a lifetime */
+#define CACHE_AHEAD_HITS 3  /* Hits in that window that make an entry hot */
+
+/* What is kept about an object besides its bytes (see fresh.c) */
+typedef struct
+{
+  time_t expires;  /* After this the object must be revalidated */
+  time_t born;     /* When the origin made it; a hit's Age is now - born */
+  int revalidate;  /* It has a validator to revalidate with */
+  time_t stale_until; /* Until then, served stale while it is refreshed */
+  time_t error_until; /* Until then, served stale if the origin fails */
+  int hot;         /* Set by the cache_lookup() that should refresh it */
+} cache_meta_t;
+
+/* Called by cache_walk() for each cached object */
+typedef void (*cache_walk_t)(void *arg, const char *key, unsigned long hash,
+                             const char *obj, size_t size,
+                             const cache_meta_t *meta, int referenced);
+
+void cache_init(int nshards, int admission);
+char *cache_lookup(const char *key, size_t *size, cache_meta_t *meta);
+int cache_insert(const char *key, const char *obj, size_t size,
+                 const cache_meta_t *meta);
+int cache_refresh(const char *key, const cache_meta_t *meta);
+void cache_walk(cache_walk_t fn, void *arg);
+int cache_print_stats(char *buf, size_t size);
+
+#endif /* __CACHE_H__ */
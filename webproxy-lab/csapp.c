@@ -1,6 +1,15 @@
 /* 
  * csapp.c - Functions for the CS:APP3e book
  *
+ * Updated 10/2026:
+ *   - rio_readlineb scans the rio buffer for '\n' with SSE2/AVX2 (picked
+ *     at run time with cpuid, see rio_scan.c) instead of reading a byte
+ *     at a time
+ *   - Added rio_readhdrsb to read a whole "\r\n\r\n"-terminated header
+ *     block the same way
+ *   - Added rio_setwait so a thread's rio reads and writes wait for the
+ *     socket in a function of its own (the proxy's deadlines)
+ *
  * Updated 10/2016 reb:
  *   - Fixed bug in sio_ltoa that didn't cover negative numbers
  *
@@ -742,6 +751,8 @@ void V(sem_t *sem)
  * The Rio package - Robust I/O functions
  ****************************************/
 
+static __thread rio_wait_t rio_waitfn; /* See rio_setwait() */
+
 /*
  * rio_readn - Robustly read n bytes (unbuffered)
  */
@@ -779,8 +790,20 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n)
     char *bufp = usrbuf;
 
     while (nleft > 0) {
-	if ((nwritten = write(fd, bufp, nleft)) <= 0) {
-	    if (errno == EINTR)  /* Interrupted by sig handler return */
+	if (rio_waitfn) {       /* Only ever block in rio_waitfn */
+	    nwritten = send(fd, bufp, nleft, MSG_DONTWAIT);
+	    if (nwritten < 0 && errno == ENOTSOCK)
+		nwritten = write(fd, bufp, nleft);
+	}
+	else
+	    nwritten = write(fd, bufp, nleft);
+	if (nwritten <= 0) {
+	    if ((errno == EAGAIN || errno == EWOULDBLOCK) && rio_waitfn) {
+		if (rio_waitfn(fd, POLLOUT) < 0)
+		    return -1;
+		nwritten = 0;
+	    }
+	    else if (errno == EINTR)  /* Interrupted by sig handler return */
 		nwritten = 0;    /* and call write() again */
 	    else
 		return -1;       /* errno set by write() */
@@ -793,6 +816,37 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n)
 /* $end rio_writen */
 
 
+/*
+ * rio_setwait - make the calling thread's buffered rio reads and
+ *     rio_writen() wait in fn rather than in read() or write(): they
+ *     use MSG_DONTWAIT, and call fn when the socket is not ready yet. fn
+ *     returns 0 once the descriptor is ready, or -1 with errno set to
+ *     give up (a deadline).
+ */
+void rio_setwait(rio_wait_t fn)
+{
+    rio_waitfn = fn;
+}
+
+/*
+ * rio_wait - wait until fd is ready for events (POLLIN, POLLOUT), in the
+ *     thread's rio_setwait() function if it has one, else in poll()
+ *     return 0, or -1 with errno set
+ */
+int rio_wait(int fd, int events)
+{
+    struct pollfd pfd;
+
+    if (rio_waitfn)
+	return rio_waitfn(fd, events);
+    pfd.fd = fd;
+    pfd.events = events;
+    while (poll(&pfd, 1, -1) < 0)
+	if (errno != EINTR)
+	    return -1;
+    return 0;
+}
+
 /* 
  * rio_read - This is a wrapper for the Unix read() function that
  *    transfers min(n, rio_cnt) bytes from an internal buffer to a user
@@ -802,15 +856,25 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n)
  *    read() if the internal buffer is empty.
  */
 /* $begin rio_read */
-static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
+static ssize_t rio_fill(rio_t *rp)
 {
-    int cnt;
-
     while (rp->rio_cnt <= 0) {  /* Refill if buf is empty */
-	rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, 
-			   sizeof(rp->rio_buf));
+	if (rio_waitfn) {       /* Only ever block in rio_waitfn */
+	    rp->rio_cnt = recv(rp->rio_fd, rp->rio_buf,
+			       sizeof(rp->rio_buf), MSG_DONTWAIT);
+	    if (rp->rio_cnt < 0 && errno == ENOTSOCK)
+		rp->rio_cnt = read(rp->rio_fd, rp->rio_buf,
+				   sizeof(rp->rio_buf));
+	}
+	else
+	    rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, 
+			       sizeof(rp->rio_buf));
 	if (rp->rio_cnt < 0) {
-	    if (errno != EINTR) /* Interrupted by sig handler return */
+	    if ((errno == EAGAIN || errno == EWOULDBLOCK) && rio_waitfn) {
+		if (rio_waitfn(rp->rio_fd, POLLIN) < 0)
+		    return -1;
+	    }
+	    else if (errno != EINTR) /* Interrupted by sig handler return */
 		return -1;
 	}
 	else if (rp->rio_cnt == 0)  /* EOF */
@@ -818,6 +882,15 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
 	else 
 	    rp->rio_bufptr = rp->rio_buf; /* Reset buffer ptr */
     }
+    return rp->rio_cnt;
+}
+
+static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
+{
+    int cnt;
+
+    if ((cnt = rio_fill(rp)) <= 0)
+	return cnt;
 
     /* Copy min(n, rp->rio_cnt) bytes from internal buf to user buf */
     cnt = n;          
@@ -870,29 +943,76 @@ ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n)
 /* $begin rio_readlineb */
 ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) 
 {
-    int n, rc;
-    char c, *bufp = usrbuf;
-
-    for (n = 1; n < maxlen; n++) { 
-        if ((rc = rio_read(rp, &c, 1)) == 1) {
-	    *bufp++ = c;
-	    if (c == '\n') {
-                n++;
-     		break;
-            }
-	} else if (rc == 0) {
-	    if (n == 1)
-		return 0; /* EOF, no data read */
-	    else
-		break;    /* EOF, some data was read */
-	} else
-	    return -1;	  /* Error */
+    size_t n = 0, cnt;
+    ssize_t rc;
+    char *bufp = usrbuf, *nl = NULL;
+
+    /* Copy up to and including the first '\n' a buffer at a time */
+    while (!nl && n + 1 < maxlen) {
+	if ((rc = rio_fill(rp)) < 0)
+	    return -1;          /* Error */
+	if (rc == 0)
+	    break;              /* EOF */
+	cnt = rp->rio_cnt;
+	if (cnt > maxlen - 1 - n)
+	    cnt = maxlen - 1 - n;
+	if ((nl = rio_scan_nl(rp->rio_bufptr, cnt)) != NULL)
+	    cnt = nl - rp->rio_bufptr + 1;
+	memcpy(bufp, rp->rio_bufptr, cnt);
+	rp->rio_bufptr += cnt;
+	rp->rio_cnt -= cnt;
+	bufp += cnt;
+	n += cnt;
     }
-    *bufp = 0;
-    return n-1;
+    if (maxlen > 0)
+	*bufp = 0;
+    return n;
 }
 /* $end rio_readlineb */
 
+/*
+ * rio_readhdrsb - Robustly read a header block up to and including the
+ *     "\r\n\r\n" that ends it (buffered). Like rio_readlineb, a block
+ *     longer than maxlen-1 bytes comes back truncated and the rest is
+ *     left for the next read.
+ */
+ssize_t rio_readhdrsb(rio_t *rp, void *usrbuf, size_t maxlen)
+{
+    static const char eoh[] = "\r\n\r\n";
+    size_t n = 0, cnt, k;
+    ssize_t rc;
+    char *bufp = usrbuf, *end = NULL;
+
+    while (!end && n + 1 < maxlen) {
+	if ((rc = rio_fill(rp)) < 0)
+	    return -1;
+	if (rc == 0)
+	    break;
+	cnt = rp->rio_cnt;
+	if (cnt > maxlen - 1 - n)
+	    cnt = maxlen - 1 - n;
+
+	/* The end may straddle what was copied already and the new bytes */
+	for (k = 1; k <= 3 && !end; k++)
+	    if (n >= 4 - k && k <= cnt &&
+		!memcmp(bufp - (4 - k), eoh, 4 - k) &&
+		!memcmp(rp->rio_bufptr, eoh + 4 - k, k))
+		end = rp->rio_bufptr + k;
+	if (!end && (end = rio_scan_eoh(rp->rio_bufptr, cnt)) != NULL)
+	    end += 4;
+	if (end)
+	    cnt = end - rp->rio_bufptr;
+	memcpy(bufp, rp->rio_bufptr, cnt);
+	rp->rio_bufptr += cnt;
+	rp->rio_cnt -= cnt;
+	bufp += cnt;
+	n += cnt;
+    }
+    if (maxlen > 0)
+	*bufp = 0;
+    return n;
+}
+
 /**********************************
  * Wrappers for robust I/O routines
  **********************************/
@@ -28,6 +28,8 @@
 #include <netdb.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <poll.h>
+#include "rio_scan.h" /* Buffer scanners for rio_readlineb and rio_readhdrsb */
 
 /* Default file permissions are DEF_MODE & ~DEF_UMASK */
 /* $begin createmasks */
@@ -178,6 +180,12 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n);
 void rio_readinitb(rio_t *rp, int fd); 
 ssize_t	rio_readnb(rio_t *rp, void *usrbuf, size_t n);
 ssize_t	rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
+ssize_t	rio_readhdrsb(rio_t *rp, void *usrbuf, size_t maxlen);
+
+/* Waits for a descriptor to be ready, in place of blocking in the kernel */
+typedef int (*rio_wait_t)(int fd, int events);
+void rio_setwait(rio_wait_t fn);
+int rio_wait(int fd, int events);
 
 /* Wrappers for Rio package */
 ssize_t Rio_readn(int fd, void *usrbuf, size_t n);
@@ -0,0 +1,265 @@
+/*
+ * deadline.c - I/O deadlines on a per-thread timing wheel
+ *
+ * Every thread that arms a deadline gets a timing wheel of its own
+ * (wheel.c), so arming, cancelling and firing one takes no lock and
+ * costs O(1) however many are armed. Deadlines have the wheel's
+ * one-second resolution and pass up to a second late, never early; how
+ * long each kind allows is set in deadline.h.
+ *
+ * A pool worker waits on one socket at a time, and its waits answer to
+ * a single deadline armed with no callback: the header deadline while a
+ * request is read, the origin's connect, first-byte and idle deadlines
+ * while it is fetched, and the keep-alive one between requests. From its
+ * first deadline on, the thread's rio reads (csapp.c), request header
+ * reads (http.c), origin connects (dns.c) and splices (relay.c) no
+ * longer block in the kernel but in deadline_wait(), which polls the
+ * socket and wakes at each tick of the wheel to fire what has come due.
+ * Once the deadline passes the wait fails with ETIMEDOUT, so the worker
+ * drops the connection instead of staying parked on a peer that never
+ * answers, like nop-server.py. An idle deadline starts again with each
+ * wait: it bounds how long the origin stays silent, not how long the
+ * whole body takes.
+ *
+ * A wait for a socket to take more bytes (other than an origin's
+ * connect) answers to a send deadline of its own instead, and the
+ * thread's deadline is held off the wheel meanwhile. A client that
+ * stops reading thus loses its connection after DEADLINE_SEND_SECS,
+ * while the origin's deadline only counts the time spent waiting on the
+ * origin, and a flight's leader can drop its client and carry on.
+ *
+ * The event loop (event.c) arms one deadline per connection with a
+ * callback, sleeps in epoll_wait() no longer than deadline_next() and
+ * then fires what has come due with deadline_expire().
+ */
+#include <poll.h>
+#include "csapp.h"
+#include "http.h"
+#include "deadline.h"
+
+typedef struct
+{
+  wheel_t wheel;
+  deadline_t *current; /* The deadline blocking waits answer to, or NULL */
+} timers_t;
+
+static __thread timers_t *timers;
+
+static const int secs[DEADLINE_KINDS] = {
+    DEADLINE_HEADER_SECS, DEADLINE_CONNECT_SECS, DEADLINE_FIRST_BYTE_SECS,
+    DEADLINE_IDLE_SECS, DEADLINE_KEEPALIVE_SECS, DEADLINE_SEND_SECS};
+static unsigned long nfired[DEADLINE_KINDS];
+
+static timers_t *my_timers(void);
+static int wait_send(timers_t *t, int fd, int events, int ms);
+static int wait_ready(timers_t *t, int fd, int events, int ms);
+static void fire(wheel_node_t *n, void *arg);
+static int tick_ms(void);
+
+/*
+ * deadline_init - start with d not armed
+ */
+void deadline_init(deadline_t *d)
+{
+  d->node.next = NULL;
+  d->kind = DEADLINE_HEADER;
+  d->expired = 0;
+  d->fire = NULL;
+}
+
+/*
+ * deadline_arm - arm d, or move it if it is armed already, to pass the
+ *     time kind allows from now. With a NULL fire it becomes the one the
+ *     thread's blocking waits answer to; otherwise fire is called when
+ *     it passes.
+ */
+void deadline_arm(deadline_t *d, deadline_kind_t kind, deadline_fire_t fire)
+{
+  timers_t *t = my_timers();
+  time_t now = time(NULL);
+
+  if (d->node.next)
+    wheel_del(&t->wheel, &d->node);
+  if (t->wheel.count == 0)
+    wheel_advance(&t->wheel, now, NULL, NULL); /* Just sets the clock */
+  d->kind = kind;
+  d->expired = 0;
+  d->fire = fire;
+  wheel_add(&t->wheel, &d->node, now + secs[kind] + 1); /* Never early */
+  if (fire == NULL)
+    t->current = d;
+}
+
+/*
+ * deadline_cancel - disarm d; it keeps its expired flag
+ */
+void deadline_cancel(deadline_t *d)
+{
+  if (d->node.next)
+    wheel_del(&timers->wheel, &d->node);
+  if (timers && timers->current == d)
+    timers->current = NULL;
+}
+
+/*
+ * deadline_poll - wait up to ms milliseconds (forever if negative) for
+ *     fd to be ready for events, firing the thread's deadlines as they
+ *     come due. A wait for POLLOUT, unless connecting, answers to a send
+ *     deadline rather than the thread's.
+ *     return 1 if fd is ready, 0 if ms ran out, or -1 with errno set if
+ *     the deadline passed (ETIMEDOUT) or poll() failed
+ */
+int deadline_poll(int fd, int events, int ms)
+{
+  timers_t *t = my_timers();
+  deadline_t *d = t->current;
+
+  if ((events & POLLOUT) && !(d && d->kind == DEADLINE_CONNECT))
+    return wait_send(t, fd, events, ms);
+  if (d && d->kind == DEADLINE_IDLE && !d->expired)
+    deadline_arm(d, DEADLINE_IDLE, NULL); /* Counts from each wait */
+  return wait_ready(t, fd, events, ms);
+}
+
+/*
+ * deadline_wait - rio_setwait() hook: block until fd is ready for events
+ *     return 0, or -1 with errno set as deadline_poll()
+ */
+int deadline_wait(int fd, int events)
+{
+  return deadline_poll(fd, events, -1) < 0 ? -1 : 0;
+}
+
+/*
+ * deadline_next - how long an event loop may sleep before it should
+ *     call deadline_expire()
+ *     return milliseconds, or -1 if the thread has nothing armed
+ */
+int deadline_next(void)
+{
+  return timers && timers->wheel.count > 0 ? tick_ms() : -1;
+}
+
+/*
+ * deadline_expire - fire the thread's deadlines that have come due
+ */
+void deadline_expire(void)
+{
+  if (timers && timers->wheel.count > 0)
+    wheel_advance(&timers->wheel, time(NULL), fire, NULL);
+}
+
+/*
+ * deadline_print_stats - write how many deadlines of each kind have
+ *     passed into buf
+ *     return the number of bytes written
+ */
+int deadline_print_stats(char *buf, size_t size)
+{
+  int n = snprintf(
+      buf, size,
+      "header %lu connect %lu first_byte %lu idle %lu keepalive %lu "
+      "send %lu\n",
+      __atomic_load_n(&nfired[DEADLINE_HEADER], __ATOMIC_RELAXED),
+      __atomic_load_n(&nfired[DEADLINE_CONNECT], __ATOMIC_RELAXED),
+      __atomic_load_n(&nfired[DEADLINE_FIRST_BYTE], __ATOMIC_RELAXED),
+      __atomic_load_n(&nfired[DEADLINE_IDLE], __ATOMIC_RELAXED),
+      __atomic_load_n(&nfired[DEADLINE_KEEPALIVE], __ATOMIC_RELAXED),
+      __atomic_load_n(&nfired[DEADLINE_SEND], __ATOMIC_RELAXED));
+
+  return n < size ? n : size - 1;
+}
+
+/*
+ * my_timers - the calling thread's wheel, made on first use; from then
+ *     on its rio and request header reads wait in deadline_wait()
+ */
+static timers_t *my_timers(void)
+{
+  if (timers == NULL)
+  {
+    timers = Malloc(sizeof(timers_t));
+    wheel_init(&timers->wheel, time(NULL));
+    timers->current = NULL;
+    rio_setwait(deadline_wait);
+    http_setwait(deadline_wait);
+  }
+  return timers;
+}
+
+/*
+ * wait_send - deadline_poll() for fd to take more bytes, under a send
+ *     deadline of its own; the thread's deadline is held off the wheel
+ *     meanwhile, and starts over after if it has not passed
+ */
+static int wait_send(timers_t *t, int fd, int events, int ms)
+{
+  deadline_t *outer = t->current, send;
+  int rc;
+
+  if (outer)
+    wheel_del(&t->wheel, &outer->node);
+  deadline_init(&send);
+  deadline_arm(&send, DEADLINE_SEND, NULL);
+  rc = wait_ready(t, fd, events, ms);
+  deadline_cancel(&send);
+  if ((t->current = outer) != NULL && !outer->expired)
+    deadline_arm(outer, outer->kind, NULL);
+  return rc;
+}
+
+/*
+ * wait_ready - deadline_poll() once the deadline it answers to is set
+ */
+static int wait_ready(timers_t *t, int fd, int events, int ms)
+{
+  deadline_t *d;
+  struct pollfd pfd;
+  int rc, step;
+
+  pfd.fd = fd;
+  pfd.events = events;
+  while (1)
+  {
+    if ((d = t->current) != NULL && d->expired)
+    {
+      errno = ETIMEDOUT;
+      return -1;
+    }
+    step = t->wheel.count > 0 ? tick_ms() : -1;
+    if (ms >= 0 && (step < 0 || step > ms))
+      step = ms;
+    if ((rc = poll(&pfd, 1, step)) > 0)
+      return 1;
+    if (rc < 0 && errno != EINTR)
+      return -1;
+    if (t->wheel.count > 0)
+      wheel_advance(&t->wheel, time(NULL), fire, NULL);
+    if (rc == 0 && ms >= 0 && (ms -= step) <= 0)
+      return 0;
+  }
+}
+
+/*
+ * fire - wheel callback for a deadline that has passed
+ */
+static void fire(wheel_node_t *n, void *arg)
+{
+  deadline_t *d = (deadline_t *)((char *)n - offsetof(deadline_t, node));
+
+  d->expired = 1;
+  __atomic_add_fetch(&nfired[d->kind], 1, __ATOMIC_RELAXED);
+  if (d->fire)
+    d->fire(d);
+}
+
+/*
+ * tick_ms - milliseconds to the next tick of the wheel's clock
+ */
+static int tick_ms(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return 1000 - ts.tv_nsec / 1000000;
+}
@@ -0,0 +1,50 @@
+/*
+ * deadline.h - I/O deadlines on a per-thread timing wheel
+ */
+#ifndef __DEADLINE_H__
+#define __DEADLINE_H__
+
+#include <stddef.h>
+#include "wheel.h"
+
+#define DEADLINE_HEADER_SECS 10     /* For a client to send a request's headers */
+#define DEADLINE_CONNECT_SECS 5     /* For an origin to accept a connection */
+#define DEADLINE_FIRST_BYTE_SECS 30 /* For an origin to start its response */
+#define DEADLINE_IDLE_SECS 30       /* For an origin to send more of it */
+#define DEADLINE_KEEPALIVE_SECS 5   /* For a client's next request */
+#define DEADLINE_SEND_SECS 30       /* For a peer to take more of a response */
+
+typedef enum
+{
+  DEADLINE_HEADER,
+  DEADLINE_CONNECT,
+  DEADLINE_FIRST_BYTE,
+  DEADLINE_IDLE,
+  DEADLINE_KEEPALIVE,
+  DEADLINE_SEND,
+  DEADLINE_KINDS
+} deadline_kind_t;
+
+typedef struct deadline deadline_t;
+
+/* Called by deadline_expire() when a deadline passes */
+typedef void (*deadline_fire_t)(deadline_t *d);
+
+struct deadline
+{
+  wheel_node_t node;    /* On its thread's wheel while armed */
+  deadline_kind_t kind;
+  int expired;          /* Set once it has passed */
+  deadline_fire_t fire; /* NULL: it bounds the thread's blocking waits */
+};
+
+void deadline_init(deadline_t *d);
+void deadline_arm(deadline_t *d, deadline_kind_t kind, deadline_fire_t fire);
+void deadline_cancel(deadline_t *d);
+int deadline_poll(int fd, int events, int ms);
+int deadline_wait(int fd, int events);
+int deadline_next(void);
+void deadline_expire(void);
+int deadline_print_stats(char *buf, size_t size);
+
+#endif /* __DEADLINE_H__ */
@@ -0,0 +1,516 @@
+/*
+ * disk.c - second cache tier on local disk for objects evicted from RAM
+ *
+ * When the memory cache (cache.c) evicts an object to make room it
+ * spills it here instead of losing it. The store is DISK_SEGMENTS files
+ * of DISK_SEGMENT_SIZE bytes in the directory given to disk_init(),
+ * written as a log: records are appended to the current segment, and
+ * when it is full writing moves on to the next one, wrapping around.
+ * A segment about to be reused is dropped from the index as a whole
+ * first, so the objects spilled longest ago go first and space is never
+ * managed object by object.
+ *
+ * Spilling never touches the disk on the caller's thread. The record
+ * (header, key, object) is copied into the filling batch buffer, which
+ * stands for the next bytes of the current segment. The writer thread
+ * writes a batch with one pwrite() once the next record does not fit
+ * in it, or DISK_FLUSH_MS after its first record, while spills carry on
+ * into the other buffer. If both buffers are taken the disk is behind
+ * and the spill is dropped (and counted).
+ *
+ * The index maps each written key to its segment, offset, size and
+ * cache metadata. It is an open-addressing table (hindex.c) under one
+ * lock, taken only on a memory miss. Most of those are for objects that
+ * were never spilled, and the index turns them away from its control
+ * bytes alone, without walking a chain. A hit pins its segment so that
+ * it is not rewritten while the object is read. The pool worker sends
+ * the object with sendfile() straight from the page cache or, once it
+ * has been hit DISK_PROMOTE_HITS times, reads it back into the memory
+ * cache; the disk copy of a promoted object is forgotten, so an object
+ * lives in one tier at a time.
+ */
+#include <sys/sendfile.h>
+#include "csapp.h"
+#include "epoch.h"
+#include "hindex.h"
+#include "disk.h"
+
+#define INDEX_CAPACITY 4096   /* Initial entries in the index */
+#define DISK_MAGIC 0x6b736964 /* "disk", at the start of each record */
+
+/* Record header, followed by the key (with its NUL) and the object */
+typedef struct
+{
+  unsigned int magic;
+  unsigned int klen;
+  unsigned int size;
+  cache_meta_t meta;
+} disk_rec_t;
+
+typedef struct disk_entry
+{
+  char *key;
+  unsigned long hash;
+  int seg;
+  off_t off; /* Of the object in the segment */
+  size_t size;
+  cache_meta_t meta;
+  int hits;
+  struct disk_entry *seg_prev, *seg_next; /* Entries in the same segment */
+} disk_entry_t;
+
+typedef struct
+{
+  int fd;
+  int pins;              /* Hits being read from the segment */
+  disk_entry_t *entries;
+} segment_t;
+
+/* Bytes gathered for one write to a segment */
+typedef struct
+{
+  char *buf;
+  size_t len;
+  int seg; /* Where buf[0] goes */
+  off_t off;
+} batch_t;
+
+/* The index and the segments, under ilock */
+static pthread_mutex_t ilock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t unpinned = PTHREAD_COND_INITIALIZER;
+static hindex_t keys;  /* disk_entry_t by key hash */
+static segment_t segs[DISK_SEGMENTS];
+static unsigned long nentries, nhits, nmisses, npromoted, nevicted;
+
+/* The batches, under lock */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t changed = PTHREAD_COND_INITIALIZER;
+static batch_t batches[2];
+static batch_t *filling = &batches[0]; /* Taking spills */
+static batch_t *sealed;                /* Handed to the writer, or NULL */
+static int full;                       /* filling turned a spill away */
+static unsigned long nspilled, ndropped, nbatches, nbytes, nerrors;
+
+static int enabled;
+
+static void *writer(void *vargp);
+static int room(size_t n);
+static void seal(void);
+static void write_batch(batch_t *b);
+static void index_add(const char *key, int seg, off_t off, size_t size,
+                      const cache_meta_t *meta);
+static void drop_segment(int seg);
+static void remove_entry(disk_entry_t *e);
+static disk_entry_t *find(const char *key, unsigned long h);
+static int key_matches(void *val, void *key);
+static unsigned long hash(const char *key);
+
+/*
+ * disk_init - create the segment files in dir (emptying any left from
+ *     an earlier run) and start the writer thread
+ */
+void disk_init(const char *dir)
+{
+  char path[MAXLINE];
+  pthread_t tid;
+  int i;
+
+  for (i = 0; i < DISK_SEGMENTS; i++)
+  {
+    snprintf(path, sizeof(path), "%s/segment.%02d", dir, i);
+    segs[i].fd = Open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  }
+  for (i = 0; i < 2; i++)
+    batches[i].buf = Malloc(DISK_BATCH_SIZE);
+  hindex_init(&keys, INDEX_CAPACITY);
+  enabled = 1;
+  Pthread_create(&tid, NULL, writer, NULL);
+}
+
+/*
+ * disk_spill - queue a copy of an object evicted from memory to be
+ *     written to disk; does nothing unless disk_init() was called
+ */
+void disk_spill(const char *key, const char *obj, size_t size,
+                const cache_meta_t *meta)
+{
+  size_t klen = strlen(key) + 1, n = sizeof(disk_rec_t) + klen + size;
+  disk_rec_t rec = {DISK_MAGIC, klen, size, *meta};
+  char *p;
+
+  if (!enabled || n > DISK_BATCH_SIZE)
+    return;
+  pthread_mutex_lock(&lock);
+  if (!room(n))
+  {
+    ndropped++;
+    pthread_mutex_unlock(&lock);
+    return;
+  }
+  p = filling->buf + filling->len;
+  memcpy(p, &rec, sizeof(rec));
+  memcpy(p + sizeof(rec), key, klen);
+  memcpy(p + sizeof(rec) + klen, obj, size);
+  if (filling->len == 0)
+    pthread_cond_signal(&changed); /* Starts the flush timer */
+  filling->len += n;
+  nspilled++;
+  pthread_mutex_unlock(&lock);
+}
+
+/*
+ * disk_lookup - find key on disk and pin it in *ref; the caller reads
+ *     it with disk_read() and disk_sendfile() and then disk_release()s
+ *     it. ref->promote says it should go back to the memory cache.
+ *     return 1 on a hit, 0 on a miss
+ */
+int disk_lookup(const char *key, disk_ref_t *ref)
+{
+  disk_entry_t *e;
+
+  if (!enabled)
+    return 0;
+  pthread_mutex_lock(&ilock);
+  if ((e = find(key, hash(key))) == NULL)
+  {
+    nmisses++;
+    pthread_mutex_unlock(&ilock);
+    return 0;
+  }
+  nhits++;
+  ref->seg = e->seg;
+  ref->fd = segs[e->seg].fd;
+  ref->off = e->off;
+  ref->size = e->size;
+  ref->meta = e->meta;
+  ref->promote = ++e->hits >= DISK_PROMOTE_HITS;
+  segs[e->seg].pins++;
+  pthread_mutex_unlock(&ilock);
+  return 1;
+}
+
+/*
+ * disk_read - read the first n bytes of a pinned object into buf
+ *     return n, or -1 on error
+ */
+ssize_t disk_read(disk_ref_t *ref, char *buf, size_t n)
+{
+  size_t done;
+  ssize_t rc;
+
+  for (done = 0; done < n; done += rc)
+    if ((rc = pread(ref->fd, buf + done, n - done, ref->off + done)) <= 0)
+    {
+      if (rc < 0 && errno == EINTR)
+        rc = 0;
+      else
+        return -1;
+    }
+  return n;
+}
+
+/*
+ * disk_sendfile - send a pinned object to fd from byte from to the end
+ *     without copying it through user space. fd is non-blocking
+ *     meanwhile, so a client that stops reading is waited for in
+ *     rio_wait(), under the thread's deadlines.
+ *     return 0, or -1 on error
+ */
+int disk_sendfile(int fd, disk_ref_t *ref, size_t from)
+{
+  off_t off = ref->off + from;
+  size_t left = ref->size - from;
+  int flags = fcntl(fd, F_GETFL);
+  ssize_t n;
+
+  fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+  while (left > 0)
+  {
+    if ((n = sendfile(fd, ref->fd, &off, left)) <= 0)
+    {
+      if (n < 0 && (errno == EINTR ||
+                    (errno == EAGAIN && rio_wait(fd, POLLOUT) == 0)))
+        continue;
+      break;
+    }
+    left -= n;
+  }
+  fcntl(fd, F_SETFL, flags);
+  return left > 0 ? -1 : 0;
+}
+
+/*
+ * disk_release - unpin an object found by disk_lookup(). If it has been
+ *     promoted to the memory cache its disk copy is forgotten.
+ */
+void disk_release(const char *key, disk_ref_t *ref, int promoted)
+{
+  disk_entry_t *e;
+
+  pthread_mutex_lock(&ilock);
+  if (promoted && (e = find(key, hash(key))) != NULL &&
+      e->seg == ref->seg && e->off == ref->off)
+  {
+    npromoted++;
+    remove_entry(e);
+  }
+  if (--segs[ref->seg].pins == 0)
+    pthread_cond_broadcast(&unpinned);
+  pthread_mutex_unlock(&ilock);
+}
+
+/*
+ * disk_print_stats - write the disk tier's counters into buf
+ *     return the number of bytes written
+ */
+int disk_print_stats(char *buf, size_t size)
+{
+  int n;
+
+  if (!enabled)
+    n = snprintf(buf, size, "disk tier off (-d dir)\n");
+  else
+  {
+    pthread_mutex_lock(&lock);
+    n = snprintf(buf, size,
+                 "spilled %lu dropped %lu batches %lu bytes %lu errors %lu\n",
+                 nspilled, ndropped, nbatches, nbytes, nerrors);
+    pthread_mutex_unlock(&lock);
+    if (n < size)
+    {
+      pthread_mutex_lock(&ilock);
+      n += snprintf(buf + n, size - n,
+                    "entries %lu hits %lu misses %lu promoted %lu "
+                    "evicted %lu\n",
+                    nentries, nhits, nmisses, npromoted, nevicted);
+      pthread_mutex_unlock(&ilock);
+    }
+  }
+  return n < size ? n : size - 1;
+}
+
+/*
+ * writer - writer thread: write each sealed batch, sealing a partial
+ *     one DISK_FLUSH_MS after its first record arrived
+ */
+static void *writer(void *vargp)
+{
+  struct timespec deadline;
+  batch_t *b;
+
+  Pthread_detach(pthread_self());
+  pthread_mutex_lock(&lock);
+  while (1)
+  {
+    if (!sealed && full)
+      seal(); /* Spills are being dropped: no time to wait */
+    while (!sealed && filling->len == 0)
+      pthread_cond_wait(&changed, &lock);
+    if (!sealed)
+    {
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_nsec += DISK_FLUSH_MS * 1000000L;
+      deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+      deadline.tv_nsec %= 1000000000L;
+      while (!sealed &&
+             pthread_cond_timedwait(&changed, &lock, &deadline) != ETIMEDOUT)
+        ;
+      if (!sealed)
+        seal();
+    }
+    b = sealed;
+    pthread_mutex_unlock(&lock);
+
+    write_batch(b);
+
+    pthread_mutex_lock(&lock);
+    sealed = NULL;
+  }
+  return NULL;
+}
+
+/*
+ * room - make room for n more bytes in the filling batch, sealing it
+ *     and moving to the next segment as needed (caller holds lock)
+ *     return 1, or 0 if the writer is too far behind to take the batch
+ */
+static int room(size_t n)
+{
+  if (filling->len + n <= DISK_BATCH_SIZE &&
+      filling->off + filling->len + n <= DISK_SEGMENT_SIZE)
+    return 1;
+  if (filling->len > 0)
+  {
+    if (sealed)
+    {
+      full = 1;
+      return 0;
+    }
+    seal();
+  }
+  if (filling->off + n > DISK_SEGMENT_SIZE)
+  {
+    filling->seg = (filling->seg + 1) % DISK_SEGMENTS;
+    filling->off = 0;
+  }
+  return 1;
+}
+
+/*
+ * seal - hand the filling batch to the writer and start the other one
+ *     where it ends (caller holds lock; the writer must be idle)
+ */
+static void seal(void)
+{
+  batch_t *next = filling == &batches[0] ? &batches[1] : &batches[0];
+
+  next->seg = filling->seg;
+  next->off = filling->off + filling->len;
+  next->len = 0;
+  sealed = filling;
+  filling = next;
+  full = 0;
+  pthread_cond_signal(&changed);
+}
+
+/*
+ * write_batch - write a sealed batch to its segment and index its
+ *     records. The first batch of a segment drops what the segment held.
+ */
+static void write_batch(batch_t *b)
+{
+  size_t done;
+  ssize_t n;
+  disk_rec_t rec;
+  char *p;
+
+  if (b->off == 0)
+    drop_segment(b->seg);
+  for (done = 0; done < b->len; done += n)
+    if ((n = pwrite(segs[b->seg].fd, b->buf + done, b->len - done,
+                    b->off + done)) < 0)
+    {
+      if (errno == EINTR)
+        n = 0;
+      else
+      {
+        pthread_mutex_lock(&lock);
+        nerrors++;
+        pthread_mutex_unlock(&lock);
+        return;
+      }
+    }
+
+  epoch_enter(); /* Leaving it frees index tables a resize replaced */
+  for (p = b->buf; p < b->buf + b->len; p += sizeof(rec) + rec.klen + rec.size)
+  {
+    memcpy(&rec, p, sizeof(rec));
+    index_add(p + sizeof(rec), b->seg,
+              b->off + (p - b->buf) + sizeof(rec) + rec.klen, rec.size,
+              &rec.meta);
+  }
+  epoch_exit();
+  pthread_mutex_lock(&lock);
+  nbatches++;
+  nbytes += b->len;
+  pthread_mutex_unlock(&lock);
+}
+
+/*
+ * index_add - index a written object, replacing an older copy
+ */
+static void index_add(const char *key, int seg, off_t off, size_t size,
+                      const cache_meta_t *meta)
+{
+  unsigned long h = hash(key);
+  disk_entry_t *old, *e = Malloc(sizeof(disk_entry_t));
+
+  e->key = strdup(key);
+  e->hash = h;
+  e->seg = seg;
+  e->off = off;
+  e->size = size;
+  e->meta = *meta;
+  e->hits = 0;
+
+  pthread_mutex_lock(&ilock);
+  if ((old = find(key, h)) != NULL)
+    remove_entry(old);
+  hindex_insert(&keys, h, e);
+  e->seg_prev = NULL;
+  if ((e->seg_next = segs[seg].entries) != NULL)
+    e->seg_next->seg_prev = e;
+  segs[seg].entries = e;
+  nentries++;
+  pthread_mutex_unlock(&ilock);
+}
+
+/*
+ * drop_segment - forget every object in a segment and wait until no hit
+ *     is still reading from it, so that it can be rewritten
+ */
+static void drop_segment(int seg)
+{
+  segment_t *s = &segs[seg];
+  disk_entry_t *e;
+
+  pthread_mutex_lock(&ilock);
+  while ((e = s->entries) != NULL)
+  {
+    nevicted++;
+    remove_entry(e);
+  }
+  while (s->pins > 0)
+    pthread_cond_wait(&unpinned, &ilock);
+  pthread_mutex_unlock(&ilock);
+}
+
+/*
+ * remove_entry - drop an entry from the index and its segment, and free
+ *     it (caller holds ilock)
+ */
+static void remove_entry(disk_entry_t *e)
+{
+  hindex_remove(&keys, e->hash, e);
+  if (e->seg_prev)
+    e->seg_prev->seg_next = e->seg_next;
+  else
+    segs[e->seg].entries = e->seg_next;
+  if (e->seg_next)
+    e->seg_next->seg_prev = e->seg_prev;
+  nentries--;
+  free(e->key);
+  Free(e);
+}
+
+/*
+ * find - key's entry, or NULL (caller holds ilock, which also keeps the
+ *     index from being resized under it, so no epoch is needed)
+ */
+static disk_entry_t *find(const char *key, unsigned long h)
+{
+  return hindex_find(&keys, h, key_matches, (void *)key);
+}
+
+/*
+ * key_matches - confirm that an index hit is the entry for key
+ */
+static int key_matches(void *val, void *key)
+{
+  return !strcmp(((disk_entry_t *)val)->key, key);
+}
+
+/*
+ * hash - FNV-1a hash of a key, as in cache.c
+ */
+static unsigned long hash(const char *key)
+{
+  unsigned long h = 14695981039346656037UL;
+
+  while (*key)
+  {
+    h ^= (unsigned char)*key++;
+    h *= 1099511628211UL;
+  }
+  return h;
+}
@@ -0,0 +1,37 @@
+/*
+ * disk.h - second cache tier on local disk for objects evicted from RAM
+ */
+#ifndef __DISK_H__
+#define __DISK_H__
+
+#include <stddef.h>
+#include <sys/types.h>
+#include "cache.h"
+
+#define DISK_SEGMENTS 16             /* Segment files, reused in turn */
+#define DISK_SEGMENT_SIZE (8 << 20)  /* Bytes per segment file */
+#define DISK_BATCH_SIZE (1 << 20)    /* Bytes gathered per write */
+#define DISK_FLUSH_MS 50             /* Longest a spilled object waits */
+#define DISK_PROMOTE_HITS 2          /* Disk hits that move it back to RAM */
+
+/* A disk hit, pinned until disk_release() */
+typedef struct
+{
+  int seg;
+  int fd;
+  off_t off;     /* Of the object in the segment file */
+  size_t size;
+  cache_meta_t meta;
+  int promote;   /* Hot enough to move back to the memory cache */
+} disk_ref_t;
+
+void disk_init(const char *dir);
+void disk_spill(const char *key, const char *obj, size_t size,
+                const cache_meta_t *meta);
+int disk_lookup(const char *key, disk_ref_t *ref);
+ssize_t disk_read(disk_ref_t *ref, char *buf, size_t n);
+int disk_sendfile(int fd, disk_ref_t *ref, size_t from);
+void disk_release(const char *key, disk_ref_t *ref, int promoted);
+int disk_print_stats(char *buf, size_t size);
+
+#endif /* __DISK_H__ */
@@ -0,0 +1,341 @@
+/*
+ * dns.c - cache of resolved origin addresses
+ *
+ * open_clientfd() runs getaddrinfo() for every connection. Here the
+ * result is kept per "host:port" for DNS_TTL seconds (getaddrinfo()
+ * does not report the record's own TTL), and a failed lookup is kept
+ * for DNS_NEG_TTL seconds so a dead name does not cost a full resolver
+ * timeout on every request.
+ *
+ * Stampede guard: the first miss for a name inserts a pending entry and
+ * resolves without the lock; other threads that miss on the same name
+ * meanwhile wait on a condition variable for that one lookup instead
+ * of starting their own.
+ *
+ * A resolved list is copied into a single reference-counted block laid
+ * out as [header][addrinfo nodes][socket addresses], so a hit hands out
+ * the shared list with one atomic increment and dns_freeaddrinfo()
+ * drops it without taking the lock. The block outlives its entry for as
+ * long as a caller holds it.
+ *
+ * Unlike Open_clientfd(), nothing here exits the process: errors come
+ * back as EAI_* codes, or as open_clientfd()'s -2/-1.
+ *
+ * dns_open_clientfd() connects without blocking and waits in rio_wait(),
+ * so a thread with a connect deadline (deadline.c) gives up on an origin
+ * that never answers the handshake.
+ */
+#include "csapp.h"
+#include "dns.h"
+
+#define NBUCKETS 1024 /* Hash buckets of the name table */
+
+typedef struct
+{
+  long refs; /* The entry's reference plus one per caller */
+} block_t;
+
+typedef struct entry
+{
+  char *key;       /* "host:port" */
+  int pending;     /* Being resolved by some thread */
+  int err;         /* EAI_* of a failed lookup, or 0 */
+  block_t *block;  /* Addresses of a successful lookup */
+  time_t expires;
+  struct entry *next;
+} entry_t;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t resolved = PTHREAD_COND_INITIALIZER;
+static entry_t *buckets[NBUCKETS];
+static int nentries;
+static time_t last_sweep;
+static unsigned long nhits, nmisses, nnegative, nwaits, nfailed;
+
+static entry_t **find(const char *key);
+static int answer(entry_t *e, struct addrinfo **res);
+static void drop(entry_t **ep);
+static void sweep(time_t now);
+static block_t *copy_list(struct addrinfo *list);
+static void release(block_t *b);
+
+/*
+ * dns_getaddrinfo - getaddrinfo() for a stream connection to host:port,
+ *     answered from the cache when possible
+ *     return 0 with the list in *res (free it with dns_freeaddrinfo()),
+ *     or an EAI_* code
+ */
+int dns_getaddrinfo(const char *host, const char *port,
+                    struct addrinfo **res)
+{
+  struct addrinfo hints, *list;
+  char key[MAXLINE];
+  entry_t **ep, *e;
+  block_t *b = NULL;
+  time_t now;
+  int rc, waited = 0;
+
+  snprintf(key, sizeof(key), "%s:%s", host, port);
+  pthread_mutex_lock(&lock);
+  now = time(NULL);
+  if (now != last_sweep)
+    sweep(now);
+  while ((e = *(ep = find(key))) != NULL && e->pending)
+  {
+    nwaits += !waited++; /* Someone is already resolving it */
+    pthread_cond_wait(&resolved, &lock);
+    now = time(NULL);
+  }
+  if (e && now < e->expires)
+  {
+    rc = answer(e, res);
+    pthread_mutex_unlock(&lock);
+    return rc;
+  }
+  if (e)
+    drop(ep); /* Expired */
+
+  /* Miss: publish a pending entry and resolve without the lock */
+  nmisses++;
+  e = NULL;
+  if (nentries < DNS_MAX_ENTRIES)
+  {
+    e = Calloc(1, sizeof(entry_t));
+    e->key = strdup(key);
+    e->pending = 1;
+    e->next = *ep;
+    *ep = e;
+    nentries++;
+  }
+  pthread_mutex_unlock(&lock);
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+  if ((rc = getaddrinfo(host, port, &hints, &list)) == 0)
+  {
+    b = copy_list(list);
+    freeaddrinfo(list);
+    *res = (struct addrinfo *)(b + 1);
+  }
+
+  pthread_mutex_lock(&lock);
+  if (rc)
+    nfailed++;
+  if (e)
+  {
+    e->pending = 0;
+    e->err = rc;
+    e->expires = time(NULL) + (rc ? DNS_NEG_TTL : DNS_TTL);
+    if ((e->block = b) != NULL)
+      __atomic_add_fetch(&b->refs, 1, __ATOMIC_RELAXED); /* The entry's */
+    pthread_cond_broadcast(&resolved);
+  }
+  pthread_mutex_unlock(&lock);
+  return rc;
+}
+
+/*
+ * dns_peek - dns_getaddrinfo() answered from the cache alone, for
+ *     callers that must not block on a lookup
+ *     return 0 with the list in *res, the EAI_* code of a cached
+ *     failure, or DNS_MISS if the name is not cached or still pending
+ */
+int dns_peek(const char *host, const char *port, struct addrinfo **res)
+{
+  char key[MAXLINE];
+  entry_t *e;
+  int rc = DNS_MISS;
+
+  snprintf(key, sizeof(key), "%s:%s", host, port);
+  pthread_mutex_lock(&lock);
+  if ((e = *find(key)) != NULL && !e->pending && time(NULL) < e->expires)
+    rc = answer(e, res);
+  pthread_mutex_unlock(&lock);
+  return rc;
+}
+
+/*
+ * dns_freeaddrinfo - give back a list from dns_getaddrinfo()
+ */
+void dns_freeaddrinfo(struct addrinfo *res)
+{
+  if (res != NULL)
+    release((block_t *)res - 1);
+}
+
+/*
+ * dns_invalidate - forget host:port, e.g. after none of its addresses
+ *     accepted a connection
+ */
+void dns_invalidate(const char *host, const char *port)
+{
+  char key[MAXLINE];
+  entry_t **ep;
+
+  snprintf(key, sizeof(key), "%s:%s", host, port);
+  pthread_mutex_lock(&lock);
+  if (*(ep = find(key)) != NULL && !(*ep)->pending)
+    drop(ep);
+  pthread_mutex_unlock(&lock);
+}
+
+/*
+ * dns_open_clientfd - open_clientfd() over the cached addresses, each
+ *     connect waiting in rio_wait(); the descriptor returned blocks
+ *     return a connected descriptor, -2 if host:port does not resolve,
+ *     or -1 with errno set if no address accepted the connection
+ */
+int dns_open_clientfd(const char *host, const char *port)
+{
+  struct addrinfo *list, *p;
+  int fd = -1, err;
+  socklen_t errlen = sizeof(err);
+
+  if (dns_getaddrinfo(host, port, &list) != 0)
+    return -2;
+  for (p = list; p; p = p->ai_next)
+  {
+    if ((fd = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK,
+                     p->ai_protocol)) < 0)
+      continue;
+    if (connect(fd, p->ai_addr, p->ai_addrlen) == 0 ||
+        (errno == EINPROGRESS && rio_wait(fd, POLLOUT) == 0 &&
+         getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errlen) == 0 &&
+         (errno = err) == 0))
+    {
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+      break;
+    }
+    close(fd);
+    fd = -1;
+  }
+  dns_freeaddrinfo(list);
+  if (fd < 0)
+    dns_invalidate(host, port); /* The name may have moved */
+  return fd;
+}
+
+/*
+ * dns_print_stats - write the resolver cache counters into buf
+ *     return the number of bytes written
+ */
+int dns_print_stats(char *buf, size_t size)
+{
+  int n;
+
+  pthread_mutex_lock(&lock);
+  n = snprintf(buf, size, "hits %lu negative %lu misses %lu waits %lu "
+                          "failed %lu entries %d\n",
+               nhits, nnegative, nmisses, nwaits, nfailed, nentries);
+  pthread_mutex_unlock(&lock);
+  return n < size ? n : size - 1;
+}
+
+/*
+ * find - the link that points at key's entry, or at the NULL where it
+ *     would go (caller holds the lock)
+ */
+static entry_t **find(const char *key)
+{
+  unsigned long h = 14695981039346656037UL; /* FNV-1a, as in cache.c */
+  const char *p;
+  entry_t **ep;
+
+  for (p = key; *p; p++)
+    h = (h ^ (unsigned char)*p) * 1099511628211UL;
+  for (ep = &buckets[h % NBUCKETS]; *ep; ep = &(*ep)->next)
+    if (!strcmp((*ep)->key, key))
+      break;
+  return ep;
+}
+
+/*
+ * answer - hand out a fresh entry's result (caller holds the lock)
+ *     return 0 with a reference to the list in *res, or the EAI_* code
+ */
+static int answer(entry_t *e, struct addrinfo **res)
+{
+  if (e->err)
+  {
+    nnegative++;
+    return e->err;
+  }
+  nhits++;
+  __atomic_add_fetch(&e->block->refs, 1, __ATOMIC_RELAXED);
+  *res = (struct addrinfo *)(e->block + 1);
+  return 0;
+}
+
+/*
+ * drop - unlink and free a resolved entry (caller holds the lock)
+ */
+static void drop(entry_t **ep)
+{
+  entry_t *e = *ep;
+
+  *ep = e->next;
+  if (e->block)
+    release(e->block);
+  free(e->key);
+  Free(e);
+  nentries--;
+}
+
+/*
+ * sweep - drop every expired entry (caller holds the lock)
+ */
+static void sweep(time_t now)
+{
+  entry_t **ep;
+  int i;
+
+  last_sweep = now;
+  for (i = 0; i < NBUCKETS; i++)
+    for (ep = &buckets[i]; *ep;)
+      if (!(*ep)->pending && now >= (*ep)->expires)
+        drop(ep);
+      else
+        ep = &(*ep)->next;
+}
+
+/*
+ * copy_list - copy a getaddrinfo() list into one block holding one
+ *     reference, for the caller
+ */
+static block_t *copy_list(struct addrinfo *list)
+{
+  struct addrinfo *p, *q;
+  size_t n = 0, addrlen = 0;
+  block_t *b;
+  char *addr;
+
+  for (p = list; p; p = p->ai_next)
+  {
+    n++;
+    addrlen += (p->ai_addrlen + 7) & ~7UL; /* Keep each one aligned */
+  }
+  b = Malloc(sizeof(block_t) + n * sizeof(struct addrinfo) + addrlen);
+  b->refs = 1;
+  q = (struct addrinfo *)(b + 1);
+  addr = (char *)(q + n);
+  for (p = list; p; p = p->ai_next, q++)
+  {
+    *q = *p;
+    q->ai_canonname = NULL;
+    q->ai_addr = (struct sockaddr *)addr;
+    memcpy(addr, p->ai_addr, p->ai_addrlen);
+    addr += (p->ai_addrlen + 7) & ~7UL;
+    q->ai_next = p->ai_next ? q + 1 : NULL;
+  }
+  return b;
+}
+
+/*
+ * release - drop one reference to a block, freeing it with the last
+ */
+static void release(block_t *b)
+{
+  if (__atomic_sub_fetch(&b->refs, 1, __ATOMIC_ACQ_REL) == 0)
+    Free(b);
+}
@@ -0,0 +1,23 @@
+/*
+ * dns.h - cache of resolved origin addresses
+ */
+#ifndef __DNS_H__
+#define __DNS_H__
+
+#include <stddef.h>
+#include <netdb.h>
+
+#define DNS_TTL 60           /* Seconds a resolved address list is kept */
+#define DNS_NEG_TTL 5        /* Seconds a failed lookup is remembered */
+#define DNS_MAX_ENTRIES 4096 /* Names cached at once */
+#define DNS_MISS 1           /* dns_peek(): not in the cache (yet) */
+
+int dns_getaddrinfo(const char *host, const char *port,
+                    struct addrinfo **res);
+int dns_peek(const char *host, const char *port, struct addrinfo **res);
+void dns_freeaddrinfo(struct addrinfo *res);
+void dns_invalidate(const char *host, const char *port);
+int dns_open_clientfd(const char *host, const char *port);
+int dns_print_stats(char *buf, size_t size);
+
+#endif /* __DNS_H__ */
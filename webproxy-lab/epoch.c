@@ -0,0 +1,182 @@
+/*
+ * epoch.c - epoch-based reclamation for lock-free readers
+ *
+ * A reader brackets every access to shared nodes with epoch_enter() and
+ * epoch_exit(). A writer that unlinks a node calls epoch_retire() instead
+ * of freeing it, and the node is destroyed only once no reader can still
+ * hold a pointer to it.
+ *
+ * There is a global epoch counter and one slot per thread that records
+ * the epoch the thread entered (0 while it is outside a critical
+ * section). The global epoch only advances when every thread inside a
+ * critical section has observed the current one. A node retired in
+ * epoch e was unlinked before any reader that enters at e+1 started, so
+ * once the global epoch reaches e+2 no reader can reach it any more.
+ *
+ * Readers only write their own slot, which sits on its own cache line,
+ * so a lookup never writes memory shared with other cores. Retired
+ * nodes wait on per-thread limbo lists, one for each of the last three
+ * epochs, so retiring takes no lock either. A thread with nodes in limbo
+ * tries to advance and free them each time it leaves a critical
+ * section, so retired memory does not wait for that thread's next
+ * RETIRE_BATCH retires.
+ */
+#include "csapp.h"
+#include "epoch.h"
+
+#define RETIRE_BATCH 32 /* Retires between attempts to advance the epoch */
+
+typedef struct retired
+{
+  void *ptr;
+  void (*destroy)(void *);
+  struct retired *next;
+} retired_t;
+
+typedef struct
+{
+  unsigned long epoch;   /* Epoch entered, or 0 when not in a section */
+  int nesting;           /* epoch_enter() depth of this thread */
+  unsigned long limbo_epoch[3];
+  retired_t *limbo[3];   /* Nodes retired in limbo_epoch[i] */
+  int nretired;          /* Retires since the last advance attempt */
+} __attribute__((aligned(64))) epoch_slot_t;
+
+static epoch_slot_t slots[EPOCH_MAX_THREADS];
+static unsigned long global_epoch = 1;
+static int nthreads; /* Slots handed out so far */
+static __thread int my_id = -1;
+
+static epoch_slot_t *my_slot(void);
+static void try_advance(void);
+static void reclaim(epoch_slot_t *s);
+static void free_list(retired_t *r);
+
+/*
+ * epoch_enter - begin a read-side critical section
+ */
+void epoch_enter(void)
+{
+  epoch_slot_t *s = my_slot();
+
+  if (s->nesting++ > 0)
+    return;
+  __atomic_store_n(&s->epoch,
+                   __atomic_load_n(&global_epoch, __ATOMIC_RELAXED),
+                   __ATOMIC_RELAXED);
+  /* Publish the slot before reading any shared pointer */
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+/*
+ * epoch_exit - end a read-side critical section
+ */
+void epoch_exit(void)
+{
+  epoch_slot_t *s = my_slot();
+
+  if (--s->nesting > 0)
+    return;
+  __atomic_store_n(&s->epoch, 0, __ATOMIC_RELEASE);
+  if (s->limbo[0] || s->limbo[1] || s->limbo[2])
+    reclaim(s);
+}
+
+/*
+ * epoch_retire - destroy ptr once every reader that may see it is gone
+ */
+void epoch_retire(void *ptr, void (*destroy)(void *))
+{
+  epoch_slot_t *s = my_slot();
+  unsigned long e = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+  int i = e % 3;
+  retired_t *r;
+
+  /* The list in slot i last held epoch e-3 (or older): safe by now */
+  if (s->limbo_epoch[i] != e)
+  {
+    free_list(s->limbo[i]);
+    s->limbo[i] = NULL;
+    s->limbo_epoch[i] = e;
+  }
+
+  r = Malloc(sizeof(retired_t));
+  r->ptr = ptr;
+  r->destroy = destroy;
+  r->next = s->limbo[i];
+  s->limbo[i] = r;
+
+  if (++s->nretired >= RETIRE_BATCH)
+  {
+    s->nretired = 0;
+    reclaim(s);
+  }
+}
+
+/*
+ * epoch_thread_id - small dense id of the calling thread
+ */
+int epoch_thread_id(void)
+{
+  if (my_id < 0)
+  {
+    my_id = __atomic_fetch_add(&nthreads, 1, __ATOMIC_RELAXED);
+    if (my_id >= EPOCH_MAX_THREADS)
+      app_error("epoch: too many threads");
+  }
+  return my_id;
+}
+
+static epoch_slot_t *my_slot(void)
+{
+  return &slots[epoch_thread_id()];
+}
+
+/*
+ * try_advance - bump the global epoch if every active reader is in it
+ */
+static void try_advance(void)
+{
+  unsigned long e = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+  int i, n = __atomic_load_n(&nthreads, __ATOMIC_ACQUIRE);
+
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  for (i = 0; i < n; i++)
+  {
+    unsigned long t = __atomic_load_n(&slots[i].epoch, __ATOMIC_ACQUIRE);
+    if (t != 0 && t != e)
+      return; /* Someone is still reading in an older epoch */
+  }
+  __atomic_compare_exchange_n(&global_epoch, &e, e + 1, 0,
+                              __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+}
+
+/*
+ * reclaim - advance the epoch if possible and free the calling thread's
+ *     limbo lists that no reader can reach any more
+ */
+static void reclaim(epoch_slot_t *s)
+{
+  unsigned long e;
+  int i;
+
+  try_advance();
+  e = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+  for (i = 0; i < 3; i++)
+    if (s->limbo[i] && s->limbo_epoch[i] + 2 <= e)
+    {
+      free_list(s->limbo[i]);
+      s->limbo[i] = NULL;
+    }
+}
+
+static void free_list(retired_t *r)
+{
+  while (r)
+  {
+    retired_t *next = r->next;
+    r->destroy(r->ptr);
+    Free(r);
+    r = next;
+  }
+}
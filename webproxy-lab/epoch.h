@@ -0,0 +1,14 @@
+/*
+ * epoch.h - epoch-based reclamation for lock-free readers
+ */
+#ifndef __EPOCH_H__
+#define __EPOCH_H__
+
+#define EPOCH_MAX_THREADS 256 /* Threads that may ever enter an epoch */
+
+void epoch_enter(void);
+void epoch_exit(void);
+void epoch_retire(void *ptr, void (*destroy)(void *));
+int epoch_thread_id(void);
+
+#endif /* __EPOCH_H__ */
@@ -0,0 +1,702 @@
+/*
+ * event.c - single-threaded, epoll-driven proxy engine
+ *
+ * Every client connection is a small state machine whose sockets are
+ * non-blocking and registered with one epoll instance:
+ *
+ *   READ_REQUEST   -> collect the request line and headers from the client
+ *   RESOLVE_ORIGIN -> the origin's name is being looked up (resolver.c)
+ *   CONNECT_ORIGIN -> non-blocking connect() to the origin is in progress
+ *   SEND_REQUEST   -> write the rewritten request to the origin
+ *   READ_RESPONSE  -> wait for the next chunk of the origin's response
+ *   WRITE_RESPONSE -> drain that chunk to the client
+ *
+ * A connection only ever waits on one socket at a time and owns a single
+ * MAXBUF buffer, reused for the request and then for the response, so
+ * memory per client is about 8 KB and no thread is parked on a slow
+ * client or a silent origin such as nop-server.py. The origin is not
+ * read while a chunk is still draining to the client, and the client's
+ * socket queues at most RELAY_NOTSENT_LOWAT unsent bytes in the kernel
+ * (relay_lowat()), so a fast origin cannot make a slow client's
+ * connection hold more.
+ *
+ * Each connection carries one deadline on the loop's timing wheel
+ * (deadline.c), armed for whatever it waits on: the client's request
+ * headers, the origin's lookup and connect, its first byte and then
+ * each next one, and the client taking each chunk. epoll_wait() sleeps
+ * no longer than the next tick of the wheel, and a connection whose
+ * deadline passes is answered with a 408 or 504 if nothing was sent
+ * yet, or else closed.
+ *
+ * Names missing from the DNS cache are resolved on the resolver threads,
+ * whose eventfd is watched alongside the sockets, so a slow lookup does
+ * not hold up the loop.
+ *
+ * Fresh cache hits are written from a copy of the cached object with
+ * an Age header; stale ones are fetched again in full, and misses keep
+ * a copy of the response while it fits in MAX_OBJECT_SIZE and insert it
+ * once the origin closes.
+ */
+#include <sys/epoll.h>
+#include "csapp.h"
+#include "proxy.h"
+#include "cache.h"
+#include "fresh.h"
+#include "event.h"
+#include "dns.h"
+#include "resolver.h"
+#include "deadline.h"
+#include "relay.h"
+#include "listener.h"
+
+#define MAXEVENTS 256 /* Events handled per epoll_wait() */
+
+typedef enum
+{
+  READ_REQUEST,
+  RESOLVE_ORIGIN,
+  CONNECT_ORIGIN,
+  SEND_REQUEST,
+  READ_RESPONSE,
+  WRITE_RESPONSE
+} conn_state_t;
+
+typedef struct conn conn_t;
+
+/* One socket of a connection; its address is the epoll user data */
+typedef struct
+{
+  int fd;
+  uint32_t events; /* Interest set currently registered */
+  int registered;  /* Whether fd has been added to epoll */
+  conn_t *conn;
+} endpoint_t;
+
+struct conn
+{
+  conn_state_t state;
+  endpoint_t client;
+  endpoint_t server;
+  struct addrinfo *addrs;     /* Resolved origin addresses */
+  struct addrinfo *next_addr; /* Next address to try connecting to */
+  resolver_req_t *lookup;     /* Name lookup in progress */
+  int closing;                /* Close once buf has been drained */
+  int dead;                   /* Closed; freed at the end of the batch */
+  conn_t *next_dead;
+  char *key;     /* Cache key while the response may still be cached */
+  char *obj;     /* Copy of the response so far, for the cache */
+  size_t objlen; /* Bytes in obj */
+  size_t objcap; /* Bytes allocated for obj */
+  char *wbuf;    /* What WRITE_RESPONSE drains: buf or a cached copy */
+  size_t len;    /* Bytes in wbuf */
+  size_t off;    /* Bytes of wbuf already written */
+  http_req_t req; /* Request parsed so far in buf */
+  deadline_t deadline; /* For whatever the connection waits on */
+  char buf[MAXBUF];
+};
+
+static int epfd;
+static conn_t *dead_list;     /* Connections closed during this batch */
+static endpoint_t resolver_ep; /* Marks the resolver's eventfd */
+
+static void accept_conn(int listenfd);
+static void open_conn(int connfd);
+static void handle_event(endpoint_t *ep, uint32_t events);
+static void read_request(conn_t *c);
+static void start_request(conn_t *c);
+static void origin_resolved(void *arg, int err, struct addrinfo *res);
+static void try_connect(conn_t *c);
+static void finish_connect(conn_t *c);
+static void send_request(conn_t *c);
+static void read_response(conn_t *c);
+static void write_response(conn_t *c);
+static void reply_error(conn_t *c, char *cause, char *errnum,
+                        char *shortmsg, char *longmsg);
+static void reply_raw(conn_t *c, char *response);
+static void keep_for_cache(conn_t *c, char *data, size_t n);
+static void store_response(conn_t *c);
+static char *with_age(char *obj, size_t *size, long age);
+static void watch(endpoint_t *ep, uint32_t events);
+static void close_endpoint(endpoint_t *ep);
+static void close_conn(conn_t *c);
+static void conn_expired(deadline_t *d);
+
+/*
+ * event_loop - serve connections accepted on listenfd forever
+ */
+void event_loop(int listenfd)
+{
+  struct epoll_event ev, events[MAXEVENTS];
+  int i, n;
+
+  if ((epfd = epoll_create1(0)) < 0)
+    unix_error("epoll_create1 error");
+  fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK);
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL; /* NULL marks the listening socket */
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd, &ev) < 0)
+    unix_error("epoll_ctl error");
+  ev.data.ptr = &resolver_ep;
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, resolver_init(RESOLVER_THREADS),
+                &ev) < 0)
+    unix_error("epoll_ctl error");
+
+  while (1)
+  {
+    if ((n = epoll_wait(epfd, events, MAXEVENTS, deadline_next())) < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      unix_error("epoll_wait error");
+    }
+    for (i = 0; i < n; i++)
+    {
+      if (events[i].data.ptr == NULL)
+        accept_conn(listenfd);
+      else if (events[i].data.ptr == &resolver_ep)
+        resolver_complete(origin_resolved);
+      else
+        handle_event(events[i].data.ptr, events[i].events);
+    }
+    deadline_expire();
+
+    /* Events later in the batch may still point at closed connections */
+    while (dead_list)
+    {
+      conn_t *c = dead_list;
+      dead_list = c->next_dead;
+      Free(c);
+    }
+  }
+}
+
+/*
+ * accept_conn - accept the clients queued on listenfd, a batch at a time
+ *     (the socket stays readable while more are queued), and start
+ *     reading their requests
+ */
+static void accept_conn(int listenfd)
+{
+  int fds[LISTENER_BATCH], i, n;
+
+  if ((n = listener_accept(listenfd, fds, LISTENER_BATCH,
+                           SOCK_NONBLOCK | SOCK_CLOEXEC)) < 0)
+    fprintf(stderr, "accept error: %s\n", strerror(errno));
+  for (i = 0; i < n; i++)
+    open_conn(fds[i]);
+}
+
+/*
+ * open_conn - start reading a new client's request
+ */
+static void open_conn(int connfd)
+{
+  conn_t *c;
+
+  relay_lowat(connfd);
+
+  c = Calloc(1, sizeof(conn_t));
+  c->state = READ_REQUEST;
+  c->client.fd = connfd;
+  c->client.conn = c;
+  c->server.fd = -1;
+  c->server.conn = c;
+  c->wbuf = c->buf;
+  http_init(&c->req);
+  deadline_arm(&c->deadline, DEADLINE_HEADER, conn_expired);
+  watch(&c->client, EPOLLIN);
+}
+
+/*
+ * handle_event - advance a connection's state machine
+ */
+static void handle_event(endpoint_t *ep, uint32_t events)
+{
+  conn_t *c = ep->conn;
+
+  if (c->dead)
+    return;
+
+  /* The client hung up while we were waiting on the origin */
+  if (ep == &c->client && c->state != READ_REQUEST &&
+      (events & (EPOLLERR | EPOLLHUP)))
+  {
+    close_conn(c);
+    return;
+  }
+
+  switch (c->state)
+  {
+  case READ_REQUEST:
+    read_request(c);
+    break;
+  case RESOLVE_ORIGIN:
+    break; /* Only hangups, handled above */
+  case CONNECT_ORIGIN:
+    finish_connect(c);
+    break;
+  case SEND_REQUEST:
+    send_request(c);
+    break;
+  case READ_RESPONSE:
+    read_response(c);
+    break;
+  case WRITE_RESPONSE:
+    write_response(c);
+    break;
+  }
+}
+
+/*
+ * read_request - buffer client bytes until the header block is complete,
+ *     parsing each read's bytes as they arrive
+ */
+static void read_request(conn_t *c)
+{
+  ssize_t n, rc;
+
+  n = read(c->client.fd, c->buf + c->len, sizeof(c->buf) - 1 - c->len);
+  if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    return;
+  if (n <= 0)
+  {
+    close_conn(c);
+    return;
+  }
+  c->len += n;
+  c->buf[c->len] = '\0';
+
+  if ((rc = http_parse(&c->req, c->buf, c->len)) > 0)
+    start_request(c);
+  else if (rc == HTTP_BAD)
+    reply_error(c, "request", "400", "Bad Request",
+                "Proxy could not parse the request");
+  else if (c->len == sizeof(c->buf) - 1)
+    reply_error(c, "request", "400", "Bad Request",
+                "Request headers are too large");
+}
+
+/*
+ * start_request - rewrite the buffered request for the origin and begin
+ *     connecting to it
+ */
+static void start_request(conn_t *c)
+{
+  char host[MAXLINE], port[MAXLINE], path[MAXLINE], key[MAXLINE];
+  char out[MAXLINE + MAXBUF];
+  struct addrinfo *res;
+  size_t size;
+  cache_meta_t meta;
+  int len, rc;
+
+  deadline_cancel(&c->deadline);
+  if ((len = rewrite_request(&c->req, out, sizeof(out), host, port,
+                             path)) < 0 ||
+      len >= sizeof(c->buf))
+  {
+    if (len >= 0)
+      format_error(out, sizeof(out), "request", "400", "Bad Request",
+                   "Request headers are too large");
+    reply_raw(c, out);
+    return;
+  }
+  memcpy(c->buf, out, len);
+  c->len = len;
+  c->off = 0;
+
+  if (make_cache_key(key, sizeof(key), host, port, path) == 0)
+  {
+    /* Serve a fresh hit without contacting the origin */
+    if ((c->wbuf = cache_lookup(key, &size, &meta)) != NULL &&
+        meta.expires <= time(NULL))
+    {
+      Free(c->wbuf);
+      c->wbuf = NULL;
+    }
+    if (c->wbuf != NULL)
+    {
+      c->wbuf = with_age(c->wbuf, &size, time(NULL) - meta.born);
+      c->len = size;
+      c->closing = 1;
+      c->state = WRITE_RESPONSE;
+      watch(&c->client, 0);
+      write_response(c);
+      return;
+    }
+    c->wbuf = c->buf;
+    c->key = Malloc(strlen(key) + 1);
+    strcpy(c->key, key);
+  }
+
+  /* Resolve the origin from the DNS cache, or else on the resolver
+     threads while this loop carries on. As for a pool worker, one
+     connect deadline covers the lookup, every address tried and
+     handing the origin the request. */
+  deadline_arm(&c->deadline, DEADLINE_CONNECT, conn_expired);
+  watch(&c->client, 0);
+  if ((rc = dns_peek(host, port, &res)) == DNS_MISS)
+  {
+    c->state = RESOLVE_ORIGIN;
+    c->lookup = resolver_submit(host, port, c);
+    return;
+  }
+  origin_resolved(c, rc, res);
+}
+
+/*
+ * origin_resolved - the origin's addresses are known: start connecting
+ */
+static void origin_resolved(void *arg, int err, struct addrinfo *res)
+{
+  conn_t *c = arg;
+
+  c->lookup = NULL;
+  if (err)
+  {
+    reply_error(c, "origin", "502", "Bad Gateway",
+                "Proxy could not resolve the origin server");
+    return;
+  }
+  c->addrs = c->next_addr = res;
+  try_connect(c);
+}
+
+/*
+ * try_connect - start a non-blocking connect to the next origin address
+ */
+static void try_connect(conn_t *c)
+{
+  struct addrinfo *p;
+
+  while ((p = c->next_addr) != NULL)
+  {
+    c->next_addr = p->ai_next;
+    c->server.fd = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK,
+                          p->ai_protocol);
+    if (c->server.fd < 0)
+      continue;
+    if (connect(c->server.fd, p->ai_addr, p->ai_addrlen) == 0)
+    {
+      c->state = SEND_REQUEST;
+      send_request(c);
+      return;
+    }
+    if (errno == EINPROGRESS)
+    {
+      c->state = CONNECT_ORIGIN;
+      watch(&c->server, EPOLLOUT);
+      return;
+    }
+    close_endpoint(&c->server);
+  }
+
+  reply_error(c, "origin", "502", "Bad Gateway",
+              "Proxy could not connect to the origin server");
+}
+
+/*
+ * finish_connect - the origin socket became writable: check the outcome
+ */
+static void finish_connect(conn_t *c)
+{
+  int err = 0;
+  socklen_t errlen = sizeof(err);
+
+  getsockopt(c->server.fd, SOL_SOCKET, SO_ERROR, &err, &errlen);
+  if (err)
+  {
+    close_endpoint(&c->server);
+    try_connect(c);
+    return;
+  }
+  c->state = SEND_REQUEST;
+  send_request(c);
+}
+
+/*
+ * send_request - write the rewritten request to the origin
+ */
+static void send_request(conn_t *c)
+{
+  ssize_t n;
+
+  if (c->addrs)
+  {
+    dns_freeaddrinfo(c->addrs);
+    c->addrs = c->next_addr = NULL;
+  }
+
+  while (c->off < c->len)
+  {
+    n = write(c->server.fd, c->buf + c->off, c->len - c->off);
+    if (n < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+      {
+        watch(&c->server, EPOLLOUT);
+        return;
+      }
+      close_conn(c);
+      return;
+    }
+    c->off += n;
+  }
+
+  c->state = READ_RESPONSE;
+  c->len = c->off = 0;
+  deadline_arm(&c->deadline, DEADLINE_FIRST_BYTE, conn_expired);
+  watch(&c->server, EPOLLIN);
+}
+
+/*
+ * read_response - read the next chunk of the origin's response
+ */
+static void read_response(conn_t *c)
+{
+  ssize_t n;
+
+  n = read(c->server.fd, c->buf, sizeof(c->buf));
+  if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    return;
+  if (n <= 0)
+  {
+    /* Origin finished (or failed) and buf is empty */
+    if (n == 0 && c->key && response_cacheable(c->obj, c->objlen))
+      store_response(c);
+    close_conn(c);
+    return;
+  }
+  deadline_cancel(&c->deadline);
+  keep_for_cache(c, c->buf, n);
+  c->len = n;
+  c->off = 0;
+  c->state = WRITE_RESPONSE;
+  watch(&c->server, 0);
+  write_response(c);
+}
+
+/*
+ * write_response - drain buf to the client, then go back to the origin
+ */
+static void write_response(conn_t *c)
+{
+  ssize_t n;
+
+  while (c->off < c->len)
+  {
+    n = write(c->client.fd, c->wbuf + c->off, c->len - c->off);
+    if (n < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+      {
+        deadline_arm(&c->deadline, DEADLINE_SEND, conn_expired);
+        watch(&c->client, EPOLLOUT);
+        return;
+      }
+      close_conn(c);
+      return;
+    }
+    c->off += n;
+  }
+
+  if (c->closing)
+  {
+    close_conn(c);
+    return;
+  }
+  c->state = READ_RESPONSE;
+  deadline_arm(&c->deadline, DEADLINE_IDLE, conn_expired);
+  watch(&c->client, 0);
+  watch(&c->server, EPOLLIN);
+}
+
+/*
+ * store_response - cache a complete response for as long as its
+ *     headers let it stay fresh, unless they forbid storing it. The
+ *     request's send time is not kept, so its time in flight is not
+ *     counted in its age.
+ */
+static void store_response(conn_t *c)
+{
+  fresh_t f;
+  cache_meta_t meta;
+  time_t now = time(NULL);
+
+  fresh_init(&f);
+  fresh_scan(&f, c->obj, c->objlen);
+  if (fresh_meta(&f, now, now, &meta) == 0)
+    cache_insert(c->key, c->obj, c->objlen, &meta);
+}
+
+/*
+ * with_age - a malloc'd copy of the cached response obj (size bytes,
+ *     updated) with an Age header of age seconds after the status line
+ *     in place of any it had; obj is freed
+ */
+static char *with_age(char *obj, size_t *size, long age)
+{
+  char *out = Malloc(*size + 32), *q = out, *p, *eol, *end = obj + *size;
+
+  for (p = obj; (eol = memchr(p, '\n', end - p)) != NULL; p = eol + 1)
+  {
+    if (p > obj && (eol == p || (eol == p + 1 && *p == '\r')))
+      break;
+    if (strncasecmp(p, "Age:", 4))
+    {
+      memcpy(q, p, eol + 1 - p);
+      q += eol + 1 - p;
+    }
+    if (p == obj)
+      q += sprintf(q, "Age: %ld\r\n", age);
+  }
+  memcpy(q, p, end - p);
+  *size = q + (end - p) - out;
+  Free(obj);
+  return out;
+}
+
+/*
+ * keep_for_cache - append response bytes to the cache copy, giving up
+ *     on caching once the response outgrows MAX_OBJECT_SIZE
+ */
+static void keep_for_cache(conn_t *c, char *data, size_t n)
+{
+  if (!c->key)
+    return;
+  if (c->objlen + n > MAX_OBJECT_SIZE)
+  {
+    Free(c->key);
+    c->key = NULL;
+    return;
+  }
+  if (c->objlen + n > c->objcap)
+  {
+    c->objcap = c->objcap ? 2 * c->objcap : MAXBUF;
+    if (c->objcap < c->objlen + n)
+      c->objcap = c->objlen + n;
+    if (c->objcap > MAX_OBJECT_SIZE)
+      c->objcap = MAX_OBJECT_SIZE;
+    c->obj = Realloc(c->obj, c->objcap);
+  }
+  memcpy(c->obj + c->objlen, data, n);
+  c->objlen += n;
+}
+
+/*
+ * reply_error - send an error response to the client and then close
+ */
+static void reply_error(conn_t *c, char *cause, char *errnum,
+                        char *shortmsg, char *longmsg)
+{
+  char buf[MAXBUF];
+
+  format_error(buf, sizeof(buf), cause, errnum, shortmsg, longmsg);
+  reply_raw(c, buf);
+}
+
+/*
+ * reply_raw - send a prepared response to the client and then close
+ */
+static void reply_raw(conn_t *c, char *response)
+{
+  close_endpoint(&c->server);
+  c->len = strlen(response);
+  if (c->len > sizeof(c->buf))
+    c->len = sizeof(c->buf);
+  memcpy(c->buf, response, c->len);
+  c->wbuf = c->buf;
+  c->off = 0;
+  c->closing = 1;
+  c->state = WRITE_RESPONSE;
+  write_response(c);
+}
+
+/*
+ * watch - set the epoll interest set of an endpoint
+ */
+static void watch(endpoint_t *ep, uint32_t events)
+{
+  struct epoll_event ev;
+
+  if (ep->registered && ep->events == events)
+    return;
+  ev.events = events;
+  ev.data.ptr = ep;
+  if (epoll_ctl(epfd, ep->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+                ep->fd, &ev) < 0)
+    unix_error("epoll_ctl error");
+  ep->registered = 1;
+  ep->events = events;
+}
+
+/*
+ * close_endpoint - close one socket (closing also drops it from epoll)
+ */
+static void close_endpoint(endpoint_t *ep)
+{
+  if (ep->fd >= 0)
+    close(ep->fd);
+  ep->fd = -1;
+  ep->registered = 0;
+  ep->events = 0;
+}
+
+/*
+ * close_conn - tear a connection down; memory is reclaimed after the
+ *     current batch of events has been dispatched
+ */
+static void close_conn(conn_t *c)
+{
+  deadline_cancel(&c->deadline);
+  close_endpoint(&c->client);
+  close_endpoint(&c->server);
+  if (c->lookup)
+    resolver_cancel(c->lookup);
+  c->lookup = NULL;
+  if (c->addrs)
+    dns_freeaddrinfo(c->addrs);
+  c->addrs = NULL;
+  if (c->wbuf != c->buf)
+    Free(c->wbuf); /* A cached copy */
+  c->wbuf = c->buf;
+  if (c->key)
+    Free(c->key);
+  if (c->obj)
+    Free(c->obj);
+  c->key = c->obj = NULL;
+  c->dead = 1;
+  c->next_dead = dead_list;
+  dead_list = c;
+}
+
+/*
+ * conn_expired - a connection's deadline passed: answer the client if
+ *     nothing has been sent to it yet, else just close
+ */
+static void conn_expired(deadline_t *d)
+{
+  conn_t *c = (conn_t *)((char *)d - offsetof(conn_t, deadline));
+
+  switch (d->kind)
+  {
+  case DEADLINE_HEADER:
+    reply_error(c, "request", "408", "Request Timeout",
+                "Proxy gave up waiting for the request headers");
+    break;
+  case DEADLINE_CONNECT:
+  case DEADLINE_FIRST_BYTE:
+    if (c->lookup)
+      resolver_cancel(c->lookup); /* Still resolving the origin */
+    c->lookup = NULL;
+    reply_error(c, "origin", "504", "Gateway Timeout",
+                "Origin server did not answer in time");
+    break;
+  default:
+    close_conn(c);
+    break;
+  }
+}
@@ -0,0 +1,9 @@
+/*
+ * event.h - epoll-based event-driven proxy engine
+ */
+#ifndef __EVENT_H__
+#define __EVENT_H__
+
+void event_loop(int listenfd);
+
+#endif /* __EVENT_H__ */
@@ -0,0 +1,238 @@
+/*
+ * flight.c - collapsed forwarding of concurrent misses on one URL
+ *
+ * The first worker to miss the cache on a key becomes the leader of a
+ * flight and fetches the object from the origin. Workers that miss on
+ * the same key while the flight is open join it as followers instead
+ * of opening connections of their own, which matters when the origin is
+ * the single-threaded Tiny.
+ *
+ * The leader builds the response copy meant for the cache in the
+ * flight's buffer (MAX_OBJECT_SIZE, like any cached object) and
+ * publishes its length as it grows; followers stream bytes to their
+ * clients as soon as they are published rather than waiting for the
+ * whole object.
+ *
+ * Once the leader has the response headers it either shares the flight
+ * (a 200 whose Content-Length fits in the buffer, so it will be cached
+ * whole) or abandons it. Followers of an abandoned flight have been sent
+ * nothing yet and fetch the object on their own, as if they had never
+ * joined. A flight is removed from the table when its leader finishes;
+ * by then a complete object is in the cache for later requests.
+ */
+#include "csapp.h"
+#include "proxy.h"
+#include "flight.h"
+
+#define NBUCKETS 256 /* Hash buckets of the flight table */
+
+typedef enum
+{
+  WAITING,   /* Leader has not seen the response headers yet */
+  SHARED,    /* buf[0, len) may be streamed to followers */
+  DONE,      /* The whole response is in buf */
+  FAILED,    /* The leader gave up partway; buf holds what came */
+  ABANDONED  /* Not shareable; followers fetch on their own */
+} flight_state_t;
+
+struct flight
+{
+  char *key;
+  flight_state_t state;
+  size_t len;   /* Bytes of buf published */
+  int refs;     /* Leader, followers, and the table while listed */
+  pthread_cond_t changed;
+  struct flight *next;
+  char buf[MAX_OBJECT_SIZE];
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static flight_t *buckets[NBUCKETS];
+static unsigned long nleaders, nfollowers, nfallbacks;
+
+static flight_t **find(const char *key);
+static void set_state(flight_t *f, flight_state_t state);
+
+/*
+ * flight_join - join the open flight for key, or open one and lead it
+ *     (*leader says which); the caller releases it with flight_put()
+ */
+flight_t *flight_join(const char *key, int *leader)
+{
+  flight_t **fp, *f;
+
+  pthread_mutex_lock(&lock);
+  if ((f = *(fp = find(key))) != NULL)
+  {
+    nfollowers++;
+    f->refs++;
+    *leader = 0;
+  }
+  else
+  {
+    nleaders++;
+    f = Malloc(sizeof(flight_t));
+    f->key = strdup(key);
+    f->state = WAITING;
+    f->len = 0;
+    f->refs = 2; /* The leader's and the table's */
+    pthread_cond_init(&f->changed, NULL);
+    f->next = NULL;
+    *fp = f;
+    *leader = 1;
+  }
+  pthread_mutex_unlock(&lock);
+  return f;
+}
+
+/*
+ * flight_buf - the leader's buffer for the response copy
+ */
+char *flight_buf(flight_t *f)
+{
+  return f->buf;
+}
+
+/*
+ * flight_share - leader: the response will be shared with followers
+ */
+void flight_share(flight_t *f)
+{
+  set_state(f, SHARED);
+}
+
+/*
+ * flight_publish - leader: the first len bytes of the buffer are final
+ */
+void flight_publish(flight_t *f, size_t len)
+{
+  pthread_mutex_lock(&lock);
+  f->len = len;
+  pthread_cond_broadcast(&f->changed);
+  pthread_mutex_unlock(&lock);
+}
+
+/*
+ * flight_finish - leader: close the flight. A shared flight ends DONE
+ *     if complete, else FAILED; one never shared is abandoned.
+ */
+void flight_finish(flight_t *f, int complete)
+{
+  flight_t **fp;
+
+  pthread_mutex_lock(&lock);
+  if (f->state == WAITING)
+    f->state = ABANDONED;
+  else if (f->state == SHARED)
+    f->state = complete ? DONE : FAILED;
+  pthread_cond_broadcast(&f->changed);
+  if (*(fp = find(f->key)) == f)
+  {
+    *fp = f->next;
+    f->refs--; /* The table's */
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+/*
+ * flight_follow - follower: stream the leader's response to fd as it
+ *     arrives. The first bytes published hold the whole header block,
+ *     which goes through send_stored() to get the client's Connection
+ *     header (keep-alive if keep is set).
+ *     return 1 if the client was served and its connection can take
+ *     another request, 0 if it was served (or has gone away) and must
+ *     be closed, or -1 if the flight was abandoned and nothing was sent
+ */
+int flight_follow(flight_t *f, int fd, int keep)
+{
+  size_t off = 0, n;
+  int rc;
+
+  pthread_mutex_lock(&lock);
+  while (1)
+  {
+    while (f->state == WAITING || (f->state == SHARED && off == f->len))
+      pthread_cond_wait(&f->changed, &lock);
+    if (f->state == ABANDONED)
+    {
+      nfallbacks++;
+      pthread_mutex_unlock(&lock);
+      return -1;
+    }
+    if (off == f->len)
+      break; /* DONE or FAILED, and all of it sent */
+
+    n = f->len - off;
+    pthread_mutex_unlock(&lock);
+    if (off == 0)
+      rc = keep = send_stored(fd, f->buf, n, keep, -1);
+    else
+      rc = rio_writen(fd, f->buf + off, n);
+    if (rc < 0)
+      return 0;
+    off += n;
+    pthread_mutex_lock(&lock);
+  }
+  rc = keep && f->state == DONE;
+  pthread_mutex_unlock(&lock);
+  return rc;
+}
+
+/*
+ * flight_put - drop the caller's reference to a flight
+ */
+void flight_put(flight_t *f)
+{
+  int refs;
+
+  pthread_mutex_lock(&lock);
+  refs = --f->refs;
+  pthread_mutex_unlock(&lock);
+  if (refs == 0)
+  {
+    pthread_cond_destroy(&f->changed);
+    free(f->key);
+    Free(f);
+  }
+}
+
+/*
+ * flight_print_stats - write the collapsing counters into buf
+ *     return the number of bytes written
+ */
+int flight_print_stats(char *buf, size_t size)
+{
+  int n;
+
+  pthread_mutex_lock(&lock);
+  n = snprintf(buf, size, "leaders %lu followers %lu fallbacks %lu\n",
+               nleaders, nfollowers, nfallbacks);
+  pthread_mutex_unlock(&lock);
+  return n < size ? n : size - 1;
+}
+
+/*
+ * find - the link that points at key's open flight, or at the NULL
+ *     where it would go (caller holds the lock)
+ */
+static flight_t **find(const char *key)
+{
+  unsigned long h = 14695981039346656037UL; /* FNV-1a, as in cache.c */
+  const char *p;
+  flight_t **fp;
+
+  for (p = key; *p; p++)
+    h = (h ^ (unsigned char)*p) * 1099511628211UL;
+  for (fp = &buckets[h % NBUCKETS]; *fp; fp = &(*fp)->next)
+    if (!strcmp((*fp)->key, key))
+      break;
+  return fp;
+}
+
+static void set_state(flight_t *f, flight_state_t state)
+{
+  pthread_mutex_lock(&lock);
+  f->state = state;
+  pthread_cond_broadcast(&f->changed);
+  pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,20 @@
+/*
+ * flight.h - collapsed forwarding of concurrent misses on one URL
+ */
+#ifndef __FLIGHT_H__
+#define __FLIGHT_H__
+
+#include <stddef.h>
+
+typedef struct flight flight_t;
+
+flight_t *flight_join(const char *key, int *leader);
+char *flight_buf(flight_t *f);
+void flight_share(flight_t *f);
+void flight_publish(flight_t *f, size_t len);
+void flight_finish(flight_t *f, int complete);
+int flight_follow(flight_t *f, int fd, int keep);
+void flight_put(flight_t *f);
+int flight_print_stats(char *buf, size_t size);
+
+#endif /* __FLIGHT_H__ */
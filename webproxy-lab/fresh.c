@@ -0,0 +1,219 @@
+/*
+ * fresh.c - HTTP freshness of cached responses
+ *
+ * fresh_scan() picks the headers that decide how long a response may be
+ * served from the cache out of a header block (or a single header line,
+ * so that a relay can feed it lines as they pass): Cache-Control
+ * (max-age, s-maxage, no-store, private, no-cache, must-revalidate,
+ * proxy-revalidate, stale-while-revalidate, stale-if-error), Expires,
+ * Date, Age, and whether there is an ETag or Last-Modified to
+ * revalidate with.
+ * Headers scanned later replace those scanned before, so scanning a
+ * stored response and then the 304 that revalidated it leaves the
+ * merged headers, as RFC 7234 has a cache update them.
+ *
+ * fresh_meta() turns them into the cache's metadata, following RFC 7234
+ * sections 4.2.1 to 4.2.3. The age the response had when it arrived is
+ * corrected for the Age header, the Date header and the time the
+ * request spent in flight; the entry's "born" time is the arrival time
+ * less that age, so a hit's Age is just now - born. The lifetime is
+ * s-maxage, else max-age, else Expires - Date, else 10% of the time
+ * since Last-Modified (at most FRESH_HEURISTIC_MAX), else
+ * CACHE_FRESH_SECS. no-cache gives a lifetime of 0 so every use is
+ * revalidated; no-store and private responses are not stored at all,
+ * the proxy being a shared cache.
+ *
+ * Past its lifetime a response may still be served for the
+ * stale-while-revalidate seconds (RFC 5861) while it is refreshed in
+ * the background, and for the stale-if-error seconds when the origin
+ * cannot be reached or fails. no-cache, must-revalidate,
+ * proxy-revalidate and s-maxage (which implies proxy-revalidate) rule
+ * both out.
+ */
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "http.h"
+#include "fresh.h"
+
+static const char *value_of(const char *line, const char **eol,
+                            const char *name);
+static void directives(fresh_t *f, const char *v, const char *eol);
+
+/*
+ * fresh_init - start with none of the headers seen
+ */
+void fresh_init(fresh_t *f)
+{
+  f->max_age = f->s_maxage = f->age = -1;
+  f->swr = f->sie = -1;
+  f->date = f->expires = f->last_modified = -1;
+  f->no_store = f->no_cache = f->must_revalidate = f->validator = 0;
+}
+
+/*
+ * fresh_scan - note the freshness headers in the len bytes at hdrs, up
+ *     to the blank line that ends a header block
+ */
+void fresh_scan(fresh_t *f, const char *hdrs, size_t len)
+{
+  const char *p, *nl, *eol, *end = hdrs + len, *v;
+  time_t t;
+
+  for (p = hdrs; p < end; p = nl + 1)
+  {
+    if ((nl = memchr(p, '\n', end - p)) == NULL)
+      nl = end;
+    if (p > hdrs && (nl == p || (nl == p + 1 && *p == '\r')))
+      break;
+    eol = nl;
+    if ((v = value_of(p, &eol, "Cache-Control")) != NULL)
+      directives(f, v, eol);
+    else if ((v = value_of(p, &eol, "Expires")) != NULL)
+    {
+      /* An invalid date, such as "0", means already expired */
+      t = http_parse_date(v, eol - v);
+      f->expires = t < 0 ? 0 : t;
+    }
+    else if ((v = value_of(p, &eol, "Date")) != NULL)
+      f->date = http_parse_date(v, eol - v);
+    else if ((v = value_of(p, &eol, "Age")) != NULL)
+      f->age = strtol(v, NULL, 10);
+    else if ((v = value_of(p, &eol, "Last-Modified")) != NULL)
+    {
+      f->last_modified = http_parse_date(v, eol - v);
+      f->validator = 1;
+    }
+    else if (value_of(p, &eol, "ETag") != NULL)
+      f->validator = 1;
+  }
+}
+
+/*
+ * fresh_meta - fill in meta for a response with the headers in f, whose
+ *     request was sent at request_time and which arrived at
+ *     response_time
+ *     return 0, or -1 if the response must not be stored
+ */
+int fresh_meta(const fresh_t *f, time_t request_time, time_t response_time,
+               cache_meta_t *meta)
+{
+  time_t apparent = 0, corrected, lifetime, date;
+
+  if (f->no_store)
+    return -1;
+
+  /* Age on arrival */
+  if (f->date >= 0 && response_time > f->date)
+    apparent = response_time - f->date;
+  corrected = (f->age > 0 ? f->age : 0) + (response_time - request_time);
+  if (corrected < apparent)
+    corrected = apparent;
+  meta->born = response_time - corrected;
+
+  /* Freshness lifetime */
+  date = f->date >= 0 ? f->date : response_time;
+  if (f->no_cache)
+    lifetime = 0;
+  else if (f->s_maxage >= 0)
+    lifetime = f->s_maxage;
+  else if (f->max_age >= 0)
+    lifetime = f->max_age;
+  else if (f->expires >= 0)
+    lifetime = f->expires - date;
+  else if (f->last_modified >= 0)
+  {
+    lifetime = (date - f->last_modified) / 10;
+    if (lifetime > FRESH_HEURISTIC_MAX)
+      lifetime = FRESH_HEURISTIC_MAX;
+  }
+  else
+    lifetime = CACHE_FRESH_SECS;
+  if (lifetime < 0)
+    lifetime = 0;
+
+  meta->expires = meta->born + lifetime;
+  meta->revalidate = f->validator;
+
+  /* Stale windows, 0 where there is none */
+  meta->stale_until = meta->error_until = 0;
+  if (!f->no_cache && !f->must_revalidate && f->s_maxage < 0)
+  {
+    if (f->swr > 0)
+      meta->stale_until = meta->expires + f->swr;
+    if (f->sie > 0)
+      meta->error_until = meta->expires + f->sie;
+  }
+  meta->hot = 0;
+  return 0;
+}
+
+/*
+ * value_of - the value of the header line from line to *eol if it is
+ *     called name, or NULL. Whitespace around the value is left out:
+ *     the value starts at the pointer returned and ends at the new *eol.
+ */
+static const char *value_of(const char *line, const char **eol,
+                            const char *name)
+{
+  size_t n = strlen(name);
+
+  if ((size_t)(*eol - line) <= n || line[n] != ':' ||
+      strncasecmp(line, name, n))
+    return NULL;
+  for (line += n + 1; line < *eol && (*line == ' ' || *line == '\t'); line++)
+    ;
+  while (*eol > line && isspace((unsigned char)(*eol)[-1]))
+    (*eol)--;
+  return line;
+}
+
+/*
+ * directives - note the Cache-Control directives in the value from v to
+ *     eol; a directive with an argument counts as if it had none
+ */
+static void directives(fresh_t *f, const char *v, const char *eol)
+{
+  const char *name, *arg;
+  size_t n;
+
+  while (v < eol)
+  {
+    while (v < eol && (*v == ' ' || *v == '\t' || *v == ','))
+      v++;
+    for (name = v; v < eol && *v != ',' && *v != '=' && *v != ' ' &&
+                   *v != '\t' && *v != '\r';
+         v++)
+      ;
+    n = v - name;
+    arg = v < eol && *v == '=' ? v + 1 : NULL;
+    if (arg && *arg == '"')
+      arg++;
+
+    if (n == 7 && !strncasecmp(name, "max-age", n) && arg)
+      f->max_age = strtol(arg, NULL, 10);
+    else if (n == 8 && !strncasecmp(name, "s-maxage", n) && arg)
+      f->s_maxage = strtol(arg, NULL, 10);
+    else if ((n == 8 && !strncasecmp(name, "no-store", n)) ||
+             (n == 7 && !strncasecmp(name, "private", n)))
+      f->no_store = 1;
+    else if (n == 8 && !strncasecmp(name, "no-cache", n))
+      f->no_cache = 1;
+    else if ((n == 15 && !strncasecmp(name, "must-revalidate", n)) ||
+             (n == 16 && !strncasecmp(name, "proxy-revalidate", n)))
+      f->must_revalidate = 1;
+    else if (n == 22 && !strncasecmp(name, "stale-while-revalidate", n) &&
+             arg)
+      f->swr = strtol(arg, NULL, 10);
+    else if (n == 14 && !strncasecmp(name, "stale-if-error", n) && arg)
+      f->sie = strtol(arg, NULL, 10);
+
+    /* Past the argument, which may be a quoted list of field names */
+    if (arg && arg[-1] == '"')
+      for (v = arg; v < eol && *v != '"'; v++)
+        ;
+    while (v < eol && *v != ',')
+      v++;
+  }
+}
@@ -0,0 +1,30 @@
+/*
+ * fresh.h - HTTP freshness of cached responses
+ */
+#ifndef __FRESH_H__
+#define __FRESH_H__
+
+#include <stddef.h>
+#include <time.h>
+#include "cache.h"
+
+#define FRESH_HEURISTIC_MAX 86400 /* Longest lifetime guessed from Last-Modified */
+
+/* The response headers freshness depends on; -1 where absent */
+typedef struct
+{
+  long max_age, s_maxage, age;
+  long swr, sie;  /* stale-while-revalidate and stale-if-error seconds */
+  time_t date, expires, last_modified;
+  int no_store;   /* no-store or private: not for a shared cache */
+  int no_cache;   /* Revalidate before every use */
+  int must_revalidate; /* must- or proxy-revalidate: never serve stale */
+  int validator;  /* Has an ETag or Last-Modified */
+} fresh_t;
+
+void fresh_init(fresh_t *f);
+void fresh_scan(fresh_t *f, const char *hdrs, size_t len);
+int fresh_meta(const fresh_t *f, time_t request_time, time_t response_time,
+               cache_meta_t *meta);
+
+#endif /* __FRESH_H__ */
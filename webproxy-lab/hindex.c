@@ -0,0 +1,233 @@
+/*
+ * hindex.c - open-addressing hash index with SIMD-probed control bytes
+ *
+ * A Swiss-table style map from a 64-bit fingerprint to a pointer. Slots
+ * come in groups of 16. Alongside the slots is an array of one control
+ * byte per slot: EMPTY, DELETED, or for a full slot the top 7 bits of
+ * its fingerprint. A lookup loads the 16 control bytes of a group into
+ * one SSE2 register, compares all of them against the wanted 7-bit tag
+ * at once and only looks at the (fingerprint, pointer) slots that
+ * matched, so most lookups touch one control line and one slot line.
+ * Groups are probed triangularly until a group with an EMPTY byte shows
+ * the key cannot be further along.
+ *
+ * Lookups run without locks, inside an epoch (epoch.c), while one writer
+ * at a time (serialized by the caller) inserts and removes. A writer
+ * fills a slot before publishing its control byte, and never turns a
+ * full or deleted slot back to EMPTY in place: when tombstones and
+ * entries fill 7/8 of the table it builds a new table, publishes it
+ * and retires the old one. A fingerprint match is only a filter: the
+ * caller's match() confirms the value really is the one wanted, which
+ * also covers a slot that was reused while a reader looked at it.
+ */
+#include "csapp.h"
+#include "epoch.h"
+#include "hindex.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define GROUP 16
+#define CTRL_EMPTY ((signed char)-128)  /* 0x80 */
+#define CTRL_DELETED ((signed char)-2)  /* 0xFE */
+
+typedef struct
+{
+  unsigned long fp;
+  void *val;
+} hslot_t;
+
+struct hindex_table
+{
+  size_t ngroups; /* Power of two */
+  size_t used;    /* Full plus deleted slots */
+  signed char *ctrl;
+  hslot_t *slots;
+};
+
+static hindex_table_t *table_new(size_t ngroups);
+static void table_free(void *t);
+static void table_put(hindex_table_t *t, unsigned long fp, void *val);
+static unsigned match_byte(const signed char *ctrl, signed char b);
+
+#define H1(fp) ((fp) >> 7)                 /* Picks the first group */
+#define H2(fp) ((signed char)((fp) >> 57)) /* 7-bit tag in the ctrl byte */
+
+/*
+ * hindex_init - create an empty index sized for about capacity values
+ */
+void hindex_init(hindex_t *ix, size_t capacity)
+{
+  size_t ngroups = 1;
+
+  while (ngroups * GROUP * 7 / 8 < capacity)
+    ngroups *= 2;
+  ix->table = table_new(ngroups);
+  ix->live = 0;
+}
+
+/*
+ * hindex_find - return the first value stored under fp for which
+ *     match(val, arg) is true, or NULL. Call inside an epoch.
+ */
+void *hindex_find(hindex_t *ix, unsigned long fp,
+                  int (*match)(void *val, void *arg), void *arg)
+{
+  hindex_table_t *t = __atomic_load_n(&ix->table, __ATOMIC_ACQUIRE);
+  size_t mask = t->ngroups - 1, g = H1(fp) & mask, step = 0;
+  signed char tag = H2(fp);
+
+  while (1)
+  {
+    const signed char *ctrl = t->ctrl + g * GROUP;
+    unsigned bits = match_byte(ctrl, tag);
+
+    while (bits)
+    {
+      hslot_t *slot = &t->slots[g * GROUP + __builtin_ctz(bits)];
+      void *val = __atomic_load_n(&slot->val, __ATOMIC_ACQUIRE);
+      if (__atomic_load_n(&slot->fp, __ATOMIC_RELAXED) == fp && val &&
+          match(val, arg))
+        return val;
+      bits &= bits - 1;
+    }
+    if (match_byte(ctrl, CTRL_EMPTY))
+      return NULL;
+    if (++step > mask)
+      return NULL; /* Probed every group */
+    g = (g + step) & mask;
+  }
+}
+
+/*
+ * hindex_insert - add (fp, val); the caller serializes writers
+ */
+void hindex_insert(hindex_t *ix, unsigned long fp, void *val)
+{
+  hindex_table_t *t = ix->table, *nt;
+  size_t cap = t->ngroups * GROUP, ngroups, i;
+
+  if ((t->used + 1) * 8 > cap * 7)
+  {
+    /* Rebuild: grow if live values need it, else just drop tombstones */
+    ngroups = t->ngroups;
+    if ((ix->live + 1) * 2 > cap)
+      ngroups *= 2;
+    nt = table_new(ngroups);
+    for (i = 0; i < cap; i++)
+      if (t->ctrl[i] >= 0)
+        table_put(nt, t->slots[i].fp, t->slots[i].val);
+    __atomic_store_n(&ix->table, nt, __ATOMIC_RELEASE);
+    epoch_retire(t, table_free);
+    t = nt;
+  }
+  table_put(t, fp, val);
+  ix->live++;
+}
+
+/*
+ * hindex_remove - remove the slot holding (fp, val); the caller
+ *     serializes writers
+ *     return 1 if it was found, 0 otherwise
+ */
+int hindex_remove(hindex_t *ix, unsigned long fp, void *val)
+{
+  hindex_table_t *t = ix->table;
+  size_t mask = t->ngroups - 1, g = H1(fp) & mask, step = 0;
+  signed char tag = H2(fp);
+
+  while (1)
+  {
+    signed char *ctrl = t->ctrl + g * GROUP;
+    unsigned bits = match_byte(ctrl, tag);
+
+    while (bits)
+    {
+      size_t i = g * GROUP + __builtin_ctz(bits);
+      if (t->slots[i].val == val)
+      {
+        __atomic_store_n(&t->ctrl[i], CTRL_DELETED, __ATOMIC_RELEASE);
+        __atomic_store_n(&t->slots[i].val, NULL, __ATOMIC_RELEASE);
+        ix->live--;
+        return 1;
+      }
+      bits &= bits - 1;
+    }
+    if (match_byte(ctrl, CTRL_EMPTY) || ++step > mask)
+      return 0;
+    g = (g + step) & mask;
+  }
+}
+
+static hindex_table_t *table_new(size_t ngroups)
+{
+  hindex_table_t *t = Malloc(sizeof(hindex_table_t));
+  int rc;
+
+  t->ngroups = ngroups;
+  t->used = 0;
+  if ((rc = posix_memalign((void **)&t->ctrl, 64, ngroups * GROUP)))
+    posix_error(rc, "posix_memalign error");
+  memset(t->ctrl, CTRL_EMPTY, ngroups * GROUP);
+  if ((rc = posix_memalign((void **)&t->slots, 64,
+                           ngroups * GROUP * sizeof(hslot_t))))
+    posix_error(rc, "posix_memalign error");
+  return t;
+}
+
+static void table_free(void *p)
+{
+  hindex_table_t *t = p;
+
+  free(t->ctrl);
+  free(t->slots);
+  Free(t);
+}
+
+/*
+ * table_put - store into the first EMPTY or DELETED slot on fp's probe
+ *     sequence; the slot is written before its control byte
+ */
+static void table_put(hindex_table_t *t, unsigned long fp, void *val)
+{
+  size_t mask = t->ngroups - 1, g = H1(fp) & mask, step = 0;
+
+  while (1)
+  {
+    signed char *ctrl = t->ctrl + g * GROUP;
+    unsigned bits = match_byte(ctrl, CTRL_EMPTY) |
+                    match_byte(ctrl, CTRL_DELETED);
+    if (bits)
+    {
+      size_t i = g * GROUP + __builtin_ctz(bits);
+      if (ctrl[i - g * GROUP] == CTRL_EMPTY)
+        t->used++;
+      __atomic_store_n(&t->slots[i].fp, fp, __ATOMIC_RELAXED);
+      __atomic_store_n(&t->slots[i].val, val, __ATOMIC_RELEASE);
+      __atomic_store_n(&t->ctrl[i], H2(fp), __ATOMIC_RELEASE);
+      return;
+    }
+    g = (g + ++step) & mask;
+  }
+}
+
+/*
+ * match_byte - bitmask of the bytes of a 16-byte group equal to b. The
+ *     group load races with writers' ctrl stores; every byte it sees was
+ *     stored by some writer, and hindex_find rechecks the slot itself.
+ */
+static unsigned match_byte(const signed char *ctrl, signed char b)
+{
+#ifdef __SSE2__
+  __m128i group = _mm_load_si128((const __m128i *)ctrl);
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(b)));
+#else
+  unsigned bits = 0;
+  int i;
+
+  for (i = 0; i < GROUP; i++)
+    if (ctrl[i] == b)
+      bits |= 1u << i;
+  return bits;
+#endif
+}
@@ -0,0 +1,23 @@
+/*
+ * hindex.h - open-addressing hash index with SIMD-probed control bytes
+ */
+#ifndef __HINDEX_H__
+#define __HINDEX_H__
+
+#include <stddef.h>
+
+typedef struct hindex_table hindex_table_t;
+
+typedef struct
+{
+  hindex_table_t *table; /* Current table, swapped on resize */
+  size_t live;           /* Values stored */
+} hindex_t;
+
+void hindex_init(hindex_t *ix, size_t capacity);
+void *hindex_find(hindex_t *ix, unsigned long fp,
+                  int (*match)(void *val, void *arg), void *arg);
+void hindex_insert(hindex_t *ix, unsigned long fp, void *val);
+int hindex_remove(hindex_t *ix, unsigned long fp, void *val);
+
+#endif /* __HINDEX_H__ */
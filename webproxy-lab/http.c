@@ -0,0 +1,388 @@
+/*
+ * http.c - incremental zero-copy HTTP/1.x request parser
+ *
+ * http_parse() scans a request header block in a buffer that grows as
+ * bytes arrive and records the method, URI, version and each header's
+ * name and value as spans pointing into that buffer; nothing is copied
+ * or NUL-terminated. It works a line at a time: the end of each line
+ * is found with the SIMD newline scanner (rio_scan.c), and the line is
+ * then split with memchr(), so only header names are looked at a byte
+ * at a time. When the block is incomplete it returns HTTP_MORE and
+ * keeps its place, the lines parsed and how far the partial one has
+ * been searched, so the next call on the longer buffer resumes where
+ * the last one stopped instead of rescanning, whatever the read
+ * boundaries were. The bytes may also move between calls (a reader
+ * compacting its buffer); the spans found so far are moved with them.
+ *
+ * http_readb() drives the parser from a rio-style buffer (fd, buffer,
+ * read pointer, count) and is shared by the proxy and the Tiny servers:
+ * it parses what is already buffered, reads more into the free tail
+ * when that is not a whole block, and moves a partial block to the
+ * front only when it has reached the end of the buffer. On success the
+ * header block is consumed from the buffer, leaving any body or
+ * pipelined request behind it for the caller's next read; the spans
+ * stay valid until then. A block larger than the buffer is rejected.
+ * A thread that has set a wait hook with http_setwait() never blocks in
+ * read(): it reads only what is there and waits in the hook, as the
+ * proxy's rio does (csapp.c), so the hook can give up on a slow client.
+ *
+ * Bare LF line endings are accepted like CRLF, as rio_readlineb()
+ * callers did, and empty lines before a request line are skipped.
+ * Folded header lines and headers beyond HTTP_MAX_HEADERS are rejected.
+ *
+ * http_parse_date() and http_format_date() convert between time_t and
+ * the IMF-fixdate form of HTTP dates ("Sun, 06 Nov 1994 08:49:37 GMT")
+ * used by Last-Modified and If-Modified-Since.
+ *
+ * The file uses the system headers alone so that the Tiny servers, which
+ * have their own rio, can build it too, with rio_scan.c.
+ */
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include "rio_scan.h"
+#include "http.h"
+
+typedef enum
+{
+  S_START,   /* Before the request line, skipping blank lines */
+  S_REQUEST, /* At the start of the request line */
+  S_HEADER,  /* At the start of a header line, or the blank one */
+  S_DONE
+} http_state_t;
+
+static __thread http_wait_t waitfn; /* See http_setwait() */
+
+static int request_line(http_req_t *req, const char *p, const char *end);
+static int header_line(http_header_t *h, const char *p, const char *end);
+static void rebase(http_req_t *req, const char *buf);
+static void shift(http_span_t *s, ptrdiff_t d);
+static ssize_t read_some(int fd, char *buf, size_t n);
+
+/*
+ * http_init - prepare req for a new request
+ */
+void http_init(http_req_t *req)
+{
+  req->method.p = req->uri.p = req->version.p = NULL;
+  req->nheaders = 0;
+  req->base = NULL;
+  req->pos = 0;
+  req->scan = 0;
+  req->state = S_START;
+}
+
+/*
+ * http_parse - carry on parsing the request header block at the start
+ *     of buf, which holds len bytes: the bytes of the previous call on
+ *     req, possibly moved, and any that have arrived since
+ *     return the length of the header block once it is complete,
+ *     HTTP_MORE if it is not yet, or HTTP_BAD if it is malformed
+ */
+ssize_t http_parse(http_req_t *req, const char *buf, size_t len)
+{
+  const char *p, *end = buf + len, *nl, *eol;
+
+  if (req->state == S_DONE)
+    return req->pos;
+  if (req->base && req->base != buf)
+    rebase(req, buf);
+  req->base = buf;
+  p = buf + req->pos;
+
+  while (p < end)
+  {
+    if (req->state == S_START)
+    {
+      if (*p == '\r' || *p == '\n')
+      {
+        p++;
+        continue;
+      }
+      req->state = S_REQUEST;
+    }
+
+    /* Find the end of the line, past what earlier calls searched */
+    if ((nl = rio_scan_nl(p + req->scan, end - p - req->scan)) == NULL)
+    {
+      req->scan = end - p;
+      break;
+    }
+    req->scan = 0;
+    eol = nl > p && nl[-1] == '\r' ? nl - 1 : nl;
+    if (memchr(p, '\r', eol - p))
+      return HTTP_BAD; /* A CR that does not end the line */
+
+    if (req->state == S_REQUEST)
+    {
+      if (request_line(req, p, eol) < 0)
+        return HTTP_BAD;
+      req->state = S_HEADER;
+    }
+    else if (eol == p)
+    {
+      req->state = S_DONE;
+      req->pos = nl + 1 - buf;
+      return req->pos;
+    }
+    else if (req->nheaders == HTTP_MAX_HEADERS ||
+             header_line(&req->headers[req->nheaders], p, eol) < 0)
+      return HTTP_BAD; /* One too many, folded, nameless or malformed */
+    else
+      req->nheaders++;
+    p = nl + 1;
+  }
+
+  req->pos = p - buf;
+  return HTTP_MORE;
+}
+
+/*
+ * http_readb - parse the next request header block from a rio-style
+ *     buffer of size bytes: *cnt unread bytes start at *bufptr, and more
+ *     are read from fd as needed. The block is consumed on success.
+ *     return the block's length, 0 on EOF before a whole block, -1 on a
+ *     read error, or HTTP_BAD if the block is malformed or larger than
+ *     the buffer
+ */
+ssize_t http_readb(int fd, char *buf, size_t size, char **bufptr, int *cnt,
+                   http_req_t *req)
+{
+  ssize_t rc, n;
+  char *tail;
+
+  http_init(req);
+  while ((rc = http_parse(req, *bufptr, *cnt)) == HTTP_MORE)
+  {
+    /* Read into the free tail; compact only when there is none */
+    if (*cnt == 0)
+      *bufptr = buf;
+    else if (*bufptr + *cnt == buf + size && *bufptr != buf)
+    {
+      memmove(buf, *bufptr, *cnt);
+      *bufptr = buf;
+    }
+    tail = *bufptr + *cnt;
+    if (tail == buf + size)
+      return HTTP_BAD; /* The block does not fit */
+    while ((n = read_some(fd, tail, buf + size - tail)) < 0)
+      if (errno != EINTR)
+        return -1;
+    if (n == 0)
+      return 0;
+    *cnt += n;
+  }
+  if (rc > 0)
+  {
+    *bufptr += rc;
+    *cnt -= rc;
+  }
+  return rc;
+}
+
+/*
+ * http_setwait - make the calling thread's http_readb() calls wait for
+ *     input in fn, which returns -1 to give up; NULL to block in read()
+ */
+void http_setwait(http_wait_t fn)
+{
+  waitfn = fn;
+}
+
+/*
+ * http_span_is - whether s is str, ignoring case
+ */
+int http_span_is(const http_span_t *s, const char *str)
+{
+  return strlen(str) == s->len && !strncasecmp(s->p, str, s->len);
+}
+
+/*
+ * http_span_copy - copy s into dst as a string
+ *     return 0, or -1 if it does not fit in size bytes
+ */
+int http_span_copy(char *dst, size_t size, const http_span_t *s)
+{
+  if (s->len >= size)
+    return -1;
+  memcpy(dst, s->p, s->len);
+  dst[s->len] = '\0';
+  return 0;
+}
+
+/*
+ * http_has_token - whether a comma-separated header value lists token,
+ *     ignoring case
+ */
+int http_has_token(const http_span_t *value, const char *token)
+{
+  const char *p = value->p, *end = value->p + value->len, *elem;
+  size_t n = strlen(token);
+
+  while (p < end)
+  {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+      p++;
+    for (elem = p; p < end && *p != ','; p++)
+      ;
+    while (p > elem && (p[-1] == ' ' || p[-1] == '\t'))
+      p--;
+    if ((size_t)(p - elem) == n && !strncasecmp(elem, token, n))
+      return 1;
+    while (p < end && *p != ',')
+      p++;
+  }
+  return 0;
+}
+
+/*
+ * http_header - the value of req's first header called name, or NULL
+ */
+const http_span_t *http_header(const http_req_t *req, const char *name)
+{
+  int i;
+
+  for (i = 0; i < req->nheaders; i++)
+    if (http_span_is(&req->headers[i].name, name))
+      return &req->headers[i].value;
+  return NULL;
+}
+
+/*
+ * http_parse_date - the time of an IMF-fixdate HTTP date of len bytes
+ *     at s (not NUL-terminated)
+ *     return the time, or -1 if s is not such a date
+ */
+time_t http_parse_date(const char *s, size_t len)
+{
+  static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+  char buf[64], mon[4];
+  const char *m;
+  struct tm tm;
+  int n = 0;
+
+  if (len >= sizeof(buf))
+    return -1;
+  memcpy(buf, s, len);
+  buf[len] = '\0';
+  memset(&tm, 0, sizeof(tm));
+  if (sscanf(buf, "%*3s, %2d %3s %4d %2d:%2d:%2d GMT%n", &tm.tm_mday, mon,
+             &tm.tm_year, &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &n) != 6 ||
+      (size_t)n != len || strlen(mon) != 3 ||
+      (m = strstr(months, mon)) == NULL || (m - months) % 3)
+    return -1;
+  tm.tm_mon = (m - months) / 3;
+  tm.tm_year -= 1900;
+  return timegm(&tm);
+}
+
+/*
+ * http_format_date - write t into buf as an IMF-fixdate HTTP date
+ *     return its length, or 0 if it does not fit in size bytes
+ */
+size_t http_format_date(char *buf, size_t size, time_t t)
+{
+  struct tm tm;
+
+  return strftime(buf, size, "%a, %d %b %Y %H:%M:%S GMT", gmtime_r(&t, &tm));
+}
+
+/*
+ * rebase - move the spans found so far from req->base to buf, where
+ *     the same bytes now are
+ */
+/*
+ * request_line - split the request line in [p, end) into the method,
+ *     URI and version, each separated by one space
+ *     return 0, or -1 if it is malformed
+ */
+static int request_line(http_req_t *req, const char *p, const char *end)
+{
+  const char *sp;
+
+  if ((sp = memchr(p, ' ', end - p)) == NULL || sp == p)
+    return -1;
+  req->method.p = p;
+  req->method.len = sp - p;
+  p = sp + 1;
+  if ((sp = memchr(p, ' ', end - p)) == NULL || sp == p)
+    return -1;
+  req->uri.p = p;
+  req->uri.len = sp - p;
+  p = sp + 1;
+  if (p == end || memchr(p, ' ', end - p))
+    return -1;
+  req->version.p = p;
+  req->version.len = end - p;
+  return 0;
+}
+
+/*
+ * header_line - split the header line in [p, end) into its name and
+ *     its value without surrounding whitespace
+ *     return 0, or -1 if it is folded, nameless or has no colon
+ */
+static int header_line(http_header_t *h, const char *p, const char *end)
+{
+  const char *colon, *q;
+
+  if (*p == ' ' || *p == '\t' || (colon = memchr(p, ':', end - p)) == NULL ||
+      colon == p)
+    return -1;
+  for (q = p; q < colon; q++)
+    if (*q == ' ' || *q == '\t')
+      return -1;
+  h->name.p = p;
+  h->name.len = colon - p;
+  for (p = colon + 1; p < end && (*p == ' ' || *p == '\t'); p++)
+    ;
+  for (q = end; q > p && (q[-1] == ' ' || q[-1] == '\t'); q--)
+    ;
+  h->value.p = p;
+  h->value.len = q - p;
+  return 0;
+}
+
+static void rebase(http_req_t *req, const char *buf)
+{
+  ptrdiff_t d = buf - req->base;
+  int i;
+
+  shift(&req->method, d);
+  shift(&req->uri, d);
+  shift(&req->version, d);
+  for (i = 0; i < req->nheaders; i++)
+  {
+    shift(&req->headers[i].name, d);
+    shift(&req->headers[i].value, d);
+  }
+}
+
+static void shift(http_span_t *s, ptrdiff_t d)
+{
+  if (s->p)
+    s->p += d;
+}
+
+/*
+ * read_some - read() that waits in the thread's wait hook, if it has one
+ */
+static ssize_t read_some(int fd, char *buf, size_t n)
+{
+  ssize_t rc;
+
+  if (waitfn == NULL)
+    return read(fd, buf, n);
+  while ((rc = recv(fd, buf, n, MSG_DONTWAIT)) < 0 &&
+         (errno == EAGAIN || errno == EWOULDBLOCK))
+    if (waitfn(fd, POLLIN) < 0)
+      return -1;
+  if (rc < 0 && errno == ENOTSOCK)
+    rc = read(fd, buf, n);
+  return rc;
+}
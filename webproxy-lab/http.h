@@ -0,0 +1,62 @@
+/*
+ * http.h - incremental zero-copy HTTP/1.x request parser
+ */
+#ifndef __HTTP_H__
+#define __HTTP_H__
+
+#include <sys/types.h>
+#include <time.h>
+
+#define HTTP_MAX_HEADERS 64 /* Header lines accepted per request */
+
+/* Results of http_parse() and http_readb() besides a length */
+#define HTTP_MORE 0  /* http_parse(): the header block is incomplete */
+#define HTTP_BAD -2  /* Malformed, or too large for the buffer */
+
+/* Bytes of a request, left where they were read */
+typedef struct
+{
+  const char *p;
+  size_t len;
+} http_span_t;
+
+typedef struct
+{
+  http_span_t name, value; /* Value without surrounding whitespace */
+} http_header_t;
+
+typedef struct
+{
+  http_span_t method, uri, version;
+  int nheaders;
+  http_header_t headers[HTTP_MAX_HEADERS];
+
+  /* Parser state, kept between calls on a growing buffer */
+  const char *base; /* Buffer of the previous call */
+  size_t pos;       /* Bytes of it already parsed: whole lines */
+  size_t scan;      /* Bytes after those searched for a line's end */
+  int state;
+} http_req_t;
+
+/* Waits for fd to be ready for events; returns 0, or -1 to give up */
+typedef int (*http_wait_t)(int fd, int events);
+
+void http_init(http_req_t *req);
+ssize_t http_parse(http_req_t *req, const char *buf, size_t len);
+ssize_t http_readb(int fd, char *buf, size_t size, char **bufptr, int *cnt,
+                   http_req_t *req);
+void http_setwait(http_wait_t fn);
+
+int http_span_is(const http_span_t *s, const char *str);
+int http_span_copy(char *dst, size_t size, const http_span_t *s);
+int http_has_token(const http_span_t *value, const char *token);
+const http_span_t *http_header(const http_req_t *req, const char *name);
+time_t http_parse_date(const char *s, size_t len);
+size_t http_format_date(char *buf, size_t size, time_t t);
+
+/* Read a request header block through a csapp rio_t's own buffer */
+#define http_read_request(rp, req)                                      \
+  http_readb((rp)->rio_fd, (rp)->rio_buf, sizeof((rp)->rio_buf),         \
+             &(rp)->rio_bufptr, &(rp)->rio_cnt, (req))
+
+#endif /* __HTTP_H__ */
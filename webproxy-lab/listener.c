@@ -0,0 +1,108 @@
+/*
+ * listener.c - SO_REUSEPORT listening sockets and batched accepts
+ *
+ * With one listening socket, every acceptor takes connections from the
+ * same accept queue under the same socket lock, and whichever thread
+ * the kernel wakes first gets them. listener_open() instead binds one
+ * socket per acceptor to the same port with SO_REUSEPORT: the kernel
+ * hashes each new connection's addresses and ports to one of them, so
+ * each acceptor drains a queue of its own and the load spreads evenly.
+ * Proxy processes started on the same port share it the same way.
+ *
+ * The sockets are non-blocking. listener_accept() takes what is queued
+ * with accept4(), up to a batch, until EAGAIN, setting the new sockets'
+ * flags in the same call; listener_wait() sleeps until there is more.
+ *
+ * accept4() is only declared with _GNU_SOURCE, which csapp.h does not
+ * compile under, so this file uses the system headers alone.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include "listener.h"
+
+/*
+ * listener_open - open a non-blocking socket listening on port that
+ *     shares the port with the other SO_REUSEPORT sockets on it
+ *     return the socket, or -1 on error
+ */
+int listener_open(const char *port)
+{
+  struct addrinfo hints, *listp, *p;
+  int listenfd = -1, rc, one = 1;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG | AI_NUMERICSERV;
+  if ((rc = getaddrinfo(NULL, port, &hints, &listp)) != 0)
+  {
+    fprintf(stderr, "getaddrinfo failed (port %s): %s\n", port,
+            gai_strerror(rc));
+    return -1;
+  }
+  for (p = listp; p; p = p->ai_next)
+  {
+    listenfd = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK,
+                      p->ai_protocol);
+    if (listenfd < 0)
+      continue;
+    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &one,
+                   sizeof(one)) == 0 &&
+        bind(listenfd, p->ai_addr, p->ai_addrlen) == 0 &&
+        listen(listenfd, LISTENER_BACKLOG) == 0)
+      break;
+    close(listenfd);
+    listenfd = -1;
+  }
+  freeaddrinfo(listp);
+  return listenfd;
+}
+
+/*
+ * listener_accept - accept up to max queued connections into fds
+ *     without blocking, with accept4() flags (SOCK_NONBLOCK,
+ *     SOCK_CLOEXEC) set on each
+ *     return the number accepted, 0 if none was queued, or -1 on an
+ *     error before the first
+ */
+int listener_accept(int listenfd, int *fds, int max, int flags)
+{
+  int n = 0, fd;
+
+  while (n < max)
+  {
+    if ((fd = accept4(listenfd, NULL, NULL, flags)) >= 0)
+    {
+      fds[n++] = fd;
+      continue;
+    }
+    if (errno == EINTR || errno == ECONNABORTED)
+      continue; /* The client gave up while queued; take the next */
+    if (errno == EAGAIN || errno == EWOULDBLOCK || n > 0)
+      break;
+    return -1;
+  }
+  return n;
+}
+
+/*
+ * listener_wait - block until listenfd has a connection queued
+ *     return 0, or -1 on error
+ */
+int listener_wait(int listenfd)
+{
+  struct pollfd pfd;
+
+  pfd.fd = listenfd;
+  pfd.events = POLLIN;
+  while (poll(&pfd, 1, -1) < 0)
+    if (errno != EINTR)
+      return -1;
+  return 0;
+}
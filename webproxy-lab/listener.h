@@ -0,0 +1,14 @@
+/*
+ * listener.h - SO_REUSEPORT listening sockets and batched accepts
+ */
+#ifndef __LISTENER_H__
+#define __LISTENER_H__
+
+#define LISTENER_BACKLOG 1024 /* Second argument to listen(), per socket */
+#define LISTENER_BATCH 64     /* Connections taken per listener_accept() */
+
+int listener_open(const char *port);
+int listener_accept(int listenfd, int *fds, int max, int flags);
+int listener_wait(int listenfd);
+
+#endif /* __LISTENER_H__ */
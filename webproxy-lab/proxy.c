@@ -1,16 +1,1467 @@
-#include <stdio.h>
+/*
+ * proxy.c - A concurrent HTTP/1.1 Web proxy
+ *
+ * The main thread accepts connections and pushes the connected
+ * descriptors into a bounded queue (sbuf). A fixed pool of worker
+ * threads, created once at startup, drains the queue and serves each
+ * connection's requests in turn. A client stuck on a slow origin
+ * therefore only ties up its own worker, and a burst of connections
+ * parks in the queue (or the listen backlog) instead of spawning more
+ * threads.
+ *
+ * With -a n, n acceptor threads take the main thread's place, each on
+ * its own SO_REUSEPORT listening socket (listener.c), so the kernel
+ * spreads new connections over n accept queues instead of one. Each
+ * drains its queue with accept4() a batch at a time until it is empty.
+ * The single-threaded engines take -a 1 alone: one such socket, which
+ * lets several proxy processes share the port, one per core.
+ *
+ * Client connections persist (keep-alive, with pipelined requests read
+ * from the same rio buffer) while each response is delimited by
+ * Content-Length or chunked encoding, for up to CLIENT_MAX_REQUESTS
+ * requests. A worker waits at most DEADLINE_KEEPALIVE_SECS seconds for
+ * the next request, and gives an idle connection up at once when other
+ * connections are queued, so idle clients cannot starve the pool.
+ *
+ * Every blocking wait of a worker is bounded by a deadline on the
+ * worker's own timing wheel (deadline.c): for the client to send its
+ * request headers, for the origin to accept the connection, to send the
+ * first byte of its response and then each next one, and for the client
+ * to send its next request. A worker whose deadline passes drops that
+ * connection (with a 408 or 504 if nothing was sent yet) and moves on.
+ *
+ * With -m event the proxy instead runs a single-threaded epoll loop
+ * (event.c) that multiplexes every client and origin socket. When built
+ * with "make URING=1", -m uring runs the io_uring engine (uring.c);
+ * the blocking pool stays the read()/write() baseline to compare with.
+ *
+ * Pool workers talk HTTP/1.1 to origin servers and, when a response's
+ * framing leaves the connection in sync, park the connection in the
+ * upstream pool (upstream.c) for the next request to the same origin.
+ * Concurrent misses on one URL share a single origin fetch (flight.c).
+ *
+ * With -d dir, objects evicted from the memory cache spill to a disk
+ * tier in dir (disk.c). A pool worker that misses in memory looks there
+ * before going to the origin.
+ *
+ * A cached copy is served as it is, with an Age header, for the
+ * freshness lifetime its Cache-Control, Expires and Date headers give
+ * it (fresh.c); no-store and private responses are not cached. After
+ * that a pool worker revalidates it: the request goes to the origin
+ * with If-None-Match and If-Modified-Since built from the copy's ETag
+ * and Last-Modified, and a 304 Not Modified makes the copy fresh again
+ * and serves it without the body crossing the network. A stale copy
+ * with neither validator is fetched again like a miss.
+ *
+ * Within its stale-while-revalidate window a stale copy is served at
+ * once, and so is a fresh one that is hot just before it expires (see
+ * cache.c); either way the key is queued for a background refresh
+ * (refresh.c), one per key at a time, which leads a flight so that
+ * misses meanwhile wait for it. Within its stale-if-error window a
+ * stale copy is served when the origin cannot be reached, closes the
+ * connection without a response or answers 5xx.
+ *
+ * With -w file, the memory cache is saved to file on SIGTERM or on a
+ * request for /cache-snapshot, and a proxy started with the same file
+ * faults the saved objects back in as they are asked for (snapshot.c).
+ * Only the pool and event engines use the cache, so -w is refused with
+ * -m uring, whose SIGTERM save would replace the file with an empty one.
+ */
+#include <poll.h>
+#include <sys/uio.h>
+#include <netinet/tcp.h>
+#include "csapp.h"
+#include "proxy.h"
+#include "sbuf.h"
+#include "cache.h"
+#include "fresh.h"
+#include "event.h"
+#include "relay.h"
+#include "upstream.h"
+#include "dns.h"
+#include "flight.h"
+#include "disk.h"
+#include "snapshot.h"
+#include "refresh.h"
+#include "deadline.h"
+#include "listener.h"
+#include "resolver.h"
+#include "epoch.h"
+#ifdef USE_IO_URING
+#include "uring.h"
+#endif
 
-/* Recommended max cache and object sizes */
-#define MAX_CACHE_SIZE 1049000
-#define MAX_OBJECT_SIZE 102400
+#define NTHREADS 16 /* Default number of worker threads */
+#define SBUFSIZE 64 /* Default number of queued connections */
+
+/* Threads besides the workers and acceptors: main, the snapshot saver,
+   the disk writer, and the refresh and resolver threads. All of them
+   together must fit in the cache's EPOCH_MAX_THREADS reader slots. */
+#define HELPER_THREADS (3 + REFRESH_THREADS + RESOLVER_THREADS)
+
+#define CLIENT_MAX_REQUESTS 100 /* Requests served per client connection */
+#define IDLE_POLL_MS 100        /* How often an idle wait checks the queue */
+
+/* Outcome of relaying one origin response, see relay_response() */
+#define RESP_NONE -1  /* Nothing came back: the connection was dead */
+#define RESP_BROKEN 0 /* Failed partway; the client got a partial reply */
+#define RESP_DONE 1   /* Complete; the origin connection must be closed */
+#define RESP_KEEP 2   /* Complete; the origin connection can be reused */
+#define RESP_NOCONN -2 /* The origin could not be reached (forward()) */
+
+/* The copy of a response kept for the cache while it is relayed */
+typedef struct
+{
+  char *obj;
+  size_t len;
+  int cacheable;    /* Still a 200 that fits in MAX_OBJECT_SIZE */
+  flight_t *flight; /* Flight this request leads, or NULL */
+  int shared;       /* Followers are being streamed the copy */
+  int client_gone;  /* Our own client hung up */
+  int client_keep;  /* The client connection stays open afterwards */
+  int revalidating; /* The request is conditional on a stale copy */
+  int not_modified; /* ...and the origin answered 304 */
+  int stale_ok;     /* A stale copy may stand in if the origin fails */
+  int origin_failed; /* ...and the origin answered 5xx */
+  time_t sent;      /* When the request went to the origin */
+  fresh_t fresh;    /* Freshness headers of the response */
+  cache_meta_t meta; /* What they make of it, once the headers are in */
+  deadline_t deadline; /* The origin's: connect, first byte, then idle */
+} copy_t;
 
 /* You won't lose style points for including this long line in your code */
 static const char *user_agent_hdr =
     "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 "
     "Firefox/10.0.3\r\n";
+static const char *conn_hdr = "Connection: close\r\n";
+static const char *proxy_conn_hdr = "Proxy-Connection: close\r\n";
+static const char *keepalive_hdr = "Connection: keep-alive\r\n";
+
+void *thread(void *vargp);
+void serve(int fd);
+int doit(int fd, rio_t *rp, int last);
+int parse_uri(char *uri, char *host, char *port, char *path);
+int build_requesthdrs(http_req_t *req, char *hdrs, size_t size, char *host,
+                      char *port, int *keepalive);
+
+static void *save_on_term(void *vargp);
+static void *acceptor(void *vargp);
+static int wait_request(int fd, rio_t *rp);
+static int send_disk(int fd, char *key, disk_ref_t *ref, char *obj,
+                     int keep);
+static char *load_disk(char *key, disk_ref_t *ref, size_t *len);
+static int forward(char *host, char *port, char *hdrs, int fd, copy_t *cp);
+static int keep_response(char *key, copy_t *cp, int rc, int stale,
+                         char *cached, size_t len);
+static int refresh_fetch(char *key, char *host, char *port, char *path,
+                         char *obj, size_t len);
+static int add_validators(char *hdrs, size_t size, const char *obj,
+                          size_t len);
+static int header_value(const char *obj, size_t len, const char *name,
+                        char *value, size_t size);
+static size_t copy_requesthdrs(http_req_t *req, char *hdrs, size_t len,
+                               size_t size, int *has_host, int *keepalive);
+static int relay_response(rio_t *srio, int fd, copy_t *cp);
+static int relay_body(rio_t *srio, int fd, size_t len, copy_t *cp);
+static int to_client(int fd, char *buf, size_t n, copy_t *cp);
+static void keep_copy(copy_t *cp, const char *buf, size_t n);
+static int has_token(const char *value, const char *token);
+
+static sbuf_t sbuf; /* Shared buffer of connected descriptors */
+static char *snapfile; /* Cache snapshot file (-w), or NULL */
+
+int main(int argc, char **argv)
+{
+  int listenfd, connfd, fd, i, opt;
+  int nthreads = NTHREADS, sbufsize = SBUFSIZE, nacceptors = 0;
+  int nshards = CACHE_SHARDS;
+  char *mode = "pool", *policy = "tinylfu", *diskdir = NULL;
+  socklen_t clientlen;
+  struct sockaddr_storage clientaddr;
+  pthread_t tid;
+  sigset_t term;
+
+  while ((opt = getopt(argc, argv, "m:t:q:s:c:d:w:a:")) != -1)
+  {
+    switch (opt)
+    {
+    case 'm':
+      mode = optarg;
+      break;
+    case 't':
+      nthreads = atoi(optarg);
+      break;
+    case 'q':
+      sbufsize = atoi(optarg);
+      break;
+    case 's':
+      nshards = atoi(optarg);
+      break;
+    case 'c':
+      policy = optarg;
+      break;
+    case 'd':
+      diskdir = optarg;
+      break;
+    case 'w':
+      snapfile = optarg;
+      break;
+    case 'a':
+      nacceptors = atoi(optarg);
+      break;
+    default:
+      optind = argc; /* Force the usage message */
+      break;
+    }
+  }
+
+  /* Check command line args */
+  if (optind != argc - 1 || nthreads <= 0 || sbufsize <= 0 ||
+      nacceptors < 0 || (strcmp(mode, "pool") && nacceptors > 1) ||
+      (snapfile && !strcmp(mode, "uring")) ||
+      nthreads + nacceptors > EPOCH_MAX_THREADS - HELPER_THREADS ||
+      (strcmp(mode, "pool") && strcmp(mode, "event") &&
+       strcmp(mode, "uring")) ||
+      (strcmp(policy, "tinylfu") && strcmp(policy, "clock")))
+  {
+    fprintf(stderr,
+            "usage: %s [-m pool|event|uring] [-t nthreads] [-q queuelen] "
+            "[-s cacheshards] [-c tinylfu|clock] [-d diskdir] [-w snapfile] "
+            "[-a nacceptors] <port>\n",
+            argv[0]);
+    exit(1);
+  }
+
+  /* A client that hangs up mid-response must not kill the proxy */
+  Signal(SIGPIPE, SIG_IGN);
+  cache_init(nshards, !strcmp(policy, "tinylfu"));
+
+  /* Warm restart from the last snapshot, and save one on SIGTERM. The
+     signal is blocked before any thread starts, so that only the thread
+     waiting for it takes it. */
+  if (snapfile)
+  {
+    snapshot_load(snapfile);
+    sigemptyset(&term);
+    sigaddset(&term, SIGTERM);
+    if ((errno = pthread_sigmask(SIG_BLOCK, &term, NULL)) != 0)
+      unix_error("pthread_sigmask error");
+    Pthread_create(&tid, NULL, save_on_term, NULL);
+  }
+
+  if (nacceptors == 0)
+    listenfd = Open_listenfd(argv[optind]);
+  else if ((listenfd = listener_open(argv[optind])) < 0)
+    unix_error("listener_open error");
+  if (!strcmp(mode, "event"))
+  {
+    event_loop(listenfd); /* Single-threaded epoll engine */
+    exit(0);
+  }
+  if (!strcmp(mode, "uring"))
+  {
+#ifdef USE_IO_URING
+    uring_loop(listenfd); /* Single-threaded io_uring engine */
+    exit(0);
+#else
+    app_error("proxy was built without io_uring (make URING=1)");
+#endif
+  }
+
+  if (diskdir)
+    disk_init(diskdir); /* Only pool workers read the disk tier back */
+  refresh_init(REFRESH_THREADS, refresh_fetch);
+  sbuf_init(&sbuf, sbufsize);
+  for (i = 0; i < nthreads; i++) /* Create the worker threads */
+    Pthread_create(&tid, NULL, thread, NULL);
+
+  if (nacceptors > 0)
+  {
+    for (i = 1; i < nacceptors; i++)
+    {
+      if ((fd = listener_open(argv[optind])) < 0)
+        unix_error("listener_open error");
+      Pthread_create(&tid, NULL, acceptor, (void *)(long)fd);
+    }
+    acceptor((void *)(long)listenfd); /* The main thread is the first */
+  }
+
+  while (1)
+  {
+    clientlen = sizeof(clientaddr);
+    connfd = accept(listenfd, (SA *)&clientaddr, &clientlen);
+    if (connfd < 0)
+    {
+      fprintf(stderr, "accept error: %s\n", strerror(errno));
+      continue;
+    }
+    sbuf_insert(&sbuf, connfd); /* Blocks while the queue is full */
+  }
+}
+
+/*
+ * save_on_term - wait for SIGTERM, save the cache snapshot and exit
+ */
+static void *save_on_term(void *vargp)
+{
+  sigset_t term;
+  int sig;
+
+  Pthread_detach(pthread_self());
+  sigemptyset(&term);
+  sigaddset(&term, SIGTERM);
+  sigwait(&term, &sig);
+  if (snapshot_save(snapfile) < 0)
+    fprintf(stderr, "snapshot of the cache to %s failed\n", snapfile);
+  exit(0);
+}
+
+/*
+ * acceptor - acceptor routine for -a: move the connections queued on one
+ *     SO_REUSEPORT listening socket into the shared queue, a batch at a
+ *     time, and sleep when there are none
+ */
+static void *acceptor(void *vargp)
+{
+  int listenfd = (int)(long)vargp, fds[LISTENER_BATCH], i, n;
+
+  while (1)
+  {
+    if ((n = listener_accept(listenfd, fds, LISTENER_BATCH,
+                             SOCK_CLOEXEC)) < 0)
+      fprintf(stderr, "accept error: %s\n", strerror(errno));
+    for (i = 0; i < n; i++)
+      sbuf_insert(&sbuf, fds[i]); /* Blocks while the queue is full */
+    if (n == 0 && listener_wait(listenfd) < 0)
+      unix_error("listener_wait error");
+  }
+  return NULL;
+}
+
+/*
+ * thread - worker routine: serve connections taken from the queue
+ */
+void *thread(void *vargp)
+{
+  Pthread_detach(pthread_self());
+  while (1)
+  {
+    int connfd = sbuf_remove(&sbuf);
+    serve(connfd);
+    Close(connfd);
+  }
+  return NULL;
+}
+
+/*
+ * serve - serve one client connection's requests until it closes, asks
+ *     to close, goes idle, or reaches CLIENT_MAX_REQUESTS
+ */
+void serve(int fd)
+{
+  int nreq, one = 1;
+  rio_t rio;
+
+  /* Headers and body go out in separate writes; don't let Nagle hold
+     the second back for the client's delayed ACK */
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  relay_lowat(fd);
+  rio_readinitb(&rio, fd);
+  for (nreq = 1; doit(fd, &rio, nreq == CLIENT_MAX_REQUESTS); nreq++)
+    if (!wait_request(fd, &rio))
+      break;
+}
+
+/*
+ * wait_request - wait for the client's next request until the
+ *     keep-alive deadline, or less if other connections are queued for a
+ *     worker
+ *     return 1 if there is something to read, 0 to close the connection
+ */
+static int wait_request(int fd, rio_t *rp)
+{
+  deadline_t d;
+  int rc;
+
+  if (rp->rio_cnt > 0)
+    return 1; /* A pipelined request is already buffered */
+  deadline_init(&d);
+  deadline_arm(&d, DEADLINE_KEEPALIVE, NULL);
+  while ((rc = deadline_poll(fd, POLLIN, IDLE_POLL_MS)) == 0 &&
+         sbuf_waiting(&sbuf) == 0)
+    ;
+  deadline_cancel(&d);
+  return rc > 0;
+}
+
+/*
+ * doit - forward one HTTP request read from rp to the origin and relay
+ *     its response; last says the connection closes after it anyway
+ *     return 1 if the client connection can carry another request
+ */
+int doit(int fd, rio_t *rp, int last)
+{
+  int leader, stale, rc = RESP_NONE;
+  ssize_t n;
+  size_t objlen;
+  char method[MAXLINE], uri[MAXLINE];
+  char host[MAXLINE], port[MAXLINE], path[MAXLINE], key[MAXLINE];
+  char hdrs[MAXLINE + MAXBUF]; /* Request line plus headers */
+  char obj[MAX_OBJECT_SIZE];   /* Response copy kept for the cache */
+  char *cached = NULL;
+  cache_meta_t meta;
+  disk_ref_t dref;
+  http_req_t req;
+  copy_t copy = {.obj = obj};
+  deadline_t header;
+  time_t now;
+
+  deadline_init(&copy.deadline);
+
+  /* Parse the request line and headers in place in the rio buffer */
+  deadline_init(&header);
+  deadline_arm(&header, DEADLINE_HEADER, NULL);
+  n = http_read_request(rp, &req);
+  deadline_cancel(&header);
+  if (n <= 0)
+  {
+    if (n == HTTP_BAD)
+      clienterror(fd, "request", "400", "Bad Request",
+                  "Proxy could not parse the request");
+    else if (header.expired)
+      clienterror(fd, "request", "408", "Request Timeout",
+                  "Proxy gave up waiting for the request headers");
+    return 0;
+  }
+  if (!http_span_is(&req.method, "GET"))
+  {
+    http_span_copy(method, sizeof(method), &req.method);
+    clienterror(fd, method, "501", "Not Implemented",
+                "Proxy does not implement this method");
+    return 0;
+  }
+  if (http_span_copy(uri, sizeof(uri), &req.uri) < 0)
+  {
+    clienterror(fd, "request", "414", "URI Too Long",
+                "Proxy could not handle the request URI");
+    return 0;
+  }
+  if (parse_uri(uri, host, port, path) < 0)
+  {
+    if ((n = admin_response(uri, hdrs, sizeof(hdrs))) >= 0)
+      rio_writen(fd, hdrs, n);
+    else
+      clienterror(fd, uri, "400", "Bad Request",
+                  "Proxy only handles absolute http:// URIs");
+    return 0;
+  }
+
+  /* HTTP/1.1 clients keep the connection unless they ask to close it,
+     HTTP/1.0 ones only if they ask to keep it */
+  snprintf(hdrs, sizeof(hdrs), "GET %s HTTP/1.1\r\n", path);
+  copy.client_keep = http_span_is(&req.version, "HTTP/1.1");
+  if (build_requesthdrs(&req, hdrs, sizeof(hdrs), host, port,
+                        &copy.client_keep) < 0)
+  {
+    clienterror(fd, "request", "400", "Bad Request",
+                "Request headers are too large");
+    return 0;
+  }
+  if (last)
+    copy.client_keep = 0;
+
+  /* Serve a fresh copy without contacting the origin, from memory or
+     else from the disk tier, unless it cannot be read back there */
+  copy.cacheable = make_cache_key(key, sizeof(key), host, port, path) == 0;
+  now = time(NULL);
+  if (copy.cacheable && (cached = cache_lookup(key, &objlen, &meta)) != NULL)
+  {
+    if (meta.expires > now && !meta.hot)
+    {
+      rc = send_stored(fd, cached, objlen, copy.client_keep, now - meta.born);
+      Free(cached);
+      return rc > 0;
+    }
+  }
+  else if (copy.cacheable && disk_lookup(key, &dref))
+  {
+    meta = dref.meta;
+    if (meta.expires <= now)
+      cached = load_disk(key, &dref, &objlen);
+    else if ((rc = send_disk(fd, key, &dref, obj, copy.client_keep)) != -2)
+      return rc > 0;
+  }
+
+  /* A hot copy close to expiry, or a stale one within its
+     stale-while-revalidate window, is served at once and fetched again
+     in the background (refresh.c), which takes the copy over */
+  if (cached && (meta.expires > now || meta.stale_until > now))
+  {
+    rc = send_stored(fd, cached, objlen, copy.client_keep, now - meta.born);
+    refresh_submit(key, host, port, path, cached, objlen);
+    return rc > 0;
+  }
+
+  /* Ask the origin whether a stale copy is still good. A 304's headers
+     update the copy's, so its freshness headers are taken first. Within
+     its stale-if-error window the copy is kept, validator or not, to
+     stand in for an origin that cannot be reached or fails. */
+  if (cached)
+  {
+    copy.stale_ok = meta.error_until > now;
+    if ((copy.revalidating =
+             add_validators(hdrs, sizeof(hdrs), cached, objlen) > 0))
+    {
+      fresh_init(&copy.fresh);
+      fresh_scan(&copy.fresh, cached, objlen);
+    }
+    else if (!copy.stale_ok)
+    {
+      Free(cached);
+      cached = NULL;
+    }
+  }
+
+  /* Collapse concurrent misses on the key into one origin fetch: follow
+     the flight already under way, or lead a new one. A follower whose
+     leader found the response unshareable fetches it like any miss. */
+  if (copy.cacheable)
+  {
+    copy.flight = flight_join(key, &leader);
+    if (!leader)
+    {
+      rc = flight_follow(copy.flight, fd, copy.client_keep);
+      flight_put(copy.flight);
+      copy.flight = NULL;
+      if (rc >= 0)
+      {
+        free(cached);
+        return rc;
+      }
+    }
+    else
+      copy.obj = flight_buf(copy.flight);
+  }
+
+  rc = forward(host, port, hdrs, fd, &copy);
+  stale = copy.not_modified ||
+          (copy.stale_ok && (rc == RESP_NOCONN || rc == RESP_NONE ||
+                             copy.origin_failed));
+  if (!stale && rc < RESP_BROKEN && copy.deadline.expired)
+    clienterror(fd, host, "504", "Gateway Timeout",
+                "Origin server did not answer in time");
+  else if (!stale && rc == RESP_NOCONN)
+    clienterror(fd, host, "502", "Bad Gateway",
+                "Proxy could not connect to the origin server");
+  else if (!stale && rc == RESP_NONE)
+    clienterror(fd, host, "502", "Bad Gateway",
+                "Origin server closed the connection without a response");
+
+  /* The stale copy is served: fresh again after a 304, or in place of
+     the origin's failure */
+  keep_response(key, &copy, rc, stale, cached, objlen);
+  if (stale)
+  {
+    n = send_stored(fd, cached, objlen, copy.client_keep,
+                    time(NULL) -
+                        (copy.not_modified ? copy.meta.born : meta.born));
+    copy.client_keep = n > 0;
+    copy.client_gone = n < 0;
+  }
+  free(cached);
+  return (stale || rc >= RESP_DONE) && copy.client_keep && !copy.client_gone;
+}
+
+/*
+ * forward - send the request in hdrs to host:port and relay the response
+ *     to fd with relay_response(), over an idle connection from the
+ *     upstream pool when there is one. A reused connection the origin
+ *     has closed in the meantime answers with nothing, and the request
+ *     is sent again on another one, unless cp->deadline has passed.
+ *     return one of the RESP_* outcomes, or RESP_NOCONN
+ */
+static int forward(char *host, char *port, char *hdrs, int fd, copy_t *cp)
+{
+  int serverfd, reused, rc;
+  rio_t server_rio;
+
+  do
+  {
+    deadline_arm(&cp->deadline, DEADLINE_CONNECT, NULL);
+    if ((serverfd = upstream_get(host, port, &reused)) < 0)
+    {
+      deadline_cancel(&cp->deadline);
+      return RESP_NOCONN;
+    }
+    rio_readinitb(&server_rio, serverfd);
+    cp->sent = time(NULL);
+    deadline_arm(&cp->deadline, DEADLINE_FIRST_BYTE, NULL);
+    if (rio_writen(serverfd, hdrs, strlen(hdrs)) < 0)
+      rc = RESP_NONE;
+    else
+      rc = relay_response(&server_rio, fd, cp);
+    deadline_cancel(&cp->deadline);
+    if (rc != RESP_KEEP)
+      Close(serverfd);
+  } while (rc == RESP_NONE && reused && !cp->deadline.expired);
+
+  if (rc == RESP_KEEP)
+    upstream_put(host, port, serverfd);
+  return rc;
+}
+
+/*
+ * keep_response - cache what a fetch with outcome rc brought back, then
+ *     close the flight it led, if any. After a 304 the stale copy
+ *     cached (len bytes) is refreshed in place, or put back in memory if
+ *     it came from disk or was evicted; a complete new copy is inserted.
+ *     With stale set, followers are sent the stale copy. Caching comes
+ *     first so that requests arriving after the flight find the object.
+ *     return 1 if the cache now holds a fresh copy, 0 if not
+ */
+static int keep_response(char *key, copy_t *cp, int rc, int stale,
+                         char *cached, size_t len)
+{
+  int kept = 0;
+
+  if (cp->not_modified)
+    kept = cp->cacheable && (cache_refresh(key, &cp->meta) ||
+                             cache_insert(key, cached, len, &cp->meta));
+  else if (!stale && rc >= RESP_DONE && cp->cacheable)
+    kept = cache_insert(key, cp->obj, cp->len, &cp->meta);
+  if (cp->flight)
+  {
+    if (stale)
+    {
+      memcpy(cp->obj, cached, len);
+      cp->shared = 1;
+      flight_share(cp->flight);
+      flight_publish(cp->flight, len);
+    }
+    flight_finish(cp->flight, stale || rc >= RESP_DONE);
+    flight_put(cp->flight);
+    cp->flight = NULL;
+  }
+  return kept;
+}
+
+/*
+ * refresh_fetch - refresh thread callback: fetch key again from
+ *     host:port without a client, revalidating obj (len bytes), the copy
+ *     being served meanwhile, if it has a validator. The fetch leads a
+ *     flight, so that misses on the key wait for it instead of going to
+ *     the origin too; if a flight is already under way it is left to
+ *     refresh the key.
+ *     return 1 if the cache now holds a fresh copy, 0 if not
+ */
+static int refresh_fetch(char *key, char *host, char *port, char *path,
+                         char *obj, size_t len)
+{
+  char hdrs[MAXLINE + MAXBUF];
+  copy_t copy = {.cacheable = 1};
+  int leader, rc;
+
+  deadline_init(&copy.deadline);
+  copy.flight = flight_join(key, &leader);
+  if (!leader)
+  {
+    flight_put(copy.flight);
+    return 0;
+  }
+  copy.obj = flight_buf(copy.flight);
+  snprintf(hdrs, sizeof(hdrs), "GET %s HTTP/1.1\r\n", path);
+  finish_requesthdrs(hdrs, strlen(hdrs), sizeof(hdrs), host, port, 0, 1);
+  if ((copy.revalidating = add_validators(hdrs, sizeof(hdrs), obj, len) > 0))
+  {
+    fresh_init(&copy.fresh);
+    fresh_scan(&copy.fresh, obj, len);
+  }
+  rc = forward(host, port, hdrs, -1, &copy);
+  return keep_response(key, &copy, rc, copy.not_modified, obj, len);
+}
+
+/*
+ * send_disk - send an object found in the disk tier: the start of it,
+ *     holding the header block, through send_stored() and the rest with
+ *     sendfile(). An object hot enough to promote is read whole into obj
+ *     (MAX_OBJECT_SIZE bytes) and put back in the memory cache instead.
+ *     The reference is released either way.
+ *     return as send_stored(), or -2 if the object could not be read
+ */
+static int send_disk(int fd, char *key, disk_ref_t *ref, char *obj, int keep)
+{
+  size_t n = ref->promote || ref->size < MAXBUF ? ref->size : MAXBUF;
+  int rc, promoted = 0;
+
+  if (disk_read(ref, obj, n) < 0)
+    rc = -2;
+  else
+  {
+    if (ref->promote)
+      promoted = cache_insert(key, obj, n, &ref->meta);
+    rc = send_stored(fd, obj, n, keep, time(NULL) - ref->meta.born);
+    if (rc >= 0 && n < ref->size && disk_sendfile(fd, ref, n) < 0)
+      rc = -1;
+  }
+  disk_release(key, ref, promoted);
+  return rc;
+}
+
+/*
+ * load_disk - read a whole object from the disk tier into a malloc'd
+ *     buffer and release the reference; the disk copy stays
+ *     return the buffer, or NULL if the object could not be read
+ */
+static char *load_disk(char *key, disk_ref_t *ref, size_t *len)
+{
+  char *obj = Malloc(ref->size);
+
+  if (disk_read(ref, obj, ref->size) < 0)
+  {
+    Free(obj);
+    obj = NULL;
+  }
+  *len = ref->size;
+  disk_release(key, ref, 0);
+  return obj;
+}
+
+/*
+ * add_validators - make the origin request in hdrs conditional on the
+ *     stored response obj: the client's own If-None-Match and
+ *     If-Modified-Since are dropped and the copy's ETag and
+ *     Last-Modified sent in their place
+ *     return 1 if hdrs is now conditional, 0 if the copy has no
+ *     validator, or -1 if hdrs would overflow (hdrs is then unchanged)
+ */
+static int add_validators(char *hdrs, size_t size, const char *obj,
+                          size_t len)
+{
+  char etag[MAXLINE], date[MAXLINE], cond[2 * MAXLINE + 64];
+  char *p, *eol;
+  size_t n = 0, hlen;
+
+  if (header_value(obj, len, "ETag", etag, sizeof(etag)) == 0)
+    n += snprintf(cond + n, sizeof(cond) - n, "If-None-Match: %s\r\n", etag);
+  if (header_value(obj, len, "Last-Modified", date, sizeof(date)) == 0)
+    n += snprintf(cond + n, sizeof(cond) - n, "If-Modified-Since: %s\r\n",
+                  date);
+  if (n == 0)
+    return 0;
+  if ((hlen = strlen(hdrs)) + n >= size || hlen < 2)
+    return -1;
+
+  /* Past the request line, drop the client's conditional headers */
+  for (p = strchr(hdrs, '\n') + 1; *p; p = eol)
+  {
+    eol = strchr(p, '\n') + 1;
+    if (!strncasecmp(p, "If-None-Match:", 14) ||
+        !strncasecmp(p, "If-Modified-Since:", 18))
+    {
+      memmove(p, eol, hdrs + hlen + 1 - eol);
+      hlen -= eol - p;
+      eol = p;
+    }
+  }
+
+  /* Ours go just before the blank line that ends the block */
+  memcpy(hdrs + hlen - 2, cond, n);
+  memcpy(hdrs + hlen - 2 + n, "\r\n", 3);
+  return 1;
+}
+
+/*
+ * header_value - copy the value of the header called name from the
+ *     header block at the start of the stored response obj into value
+ *     return 0 if found, -1 if not (or too long for value)
+ */
+static int header_value(const char *obj, size_t len, const char *name,
+                        char *value, size_t size)
+{
+  const char *p, *eol, *end = obj + len, *v;
+  size_t nlen = strlen(name);
+
+  for (p = obj; (eol = memchr(p, '\n', end - p)) != NULL; p = eol + 1)
+  {
+    if (p > obj && (eol == p || (eol == p + 1 && *p == '\r')))
+      break;
+    if (strncasecmp(p, name, nlen) || p[nlen] != ':')
+      continue;
+    for (v = p + nlen + 1; v < eol && (*v == ' ' || *v == '\t'); v++)
+      ;
+    while (eol > v && isspace((unsigned char)eol[-1]))
+      eol--;
+    if (eol == v || eol - v >= size)
+      return -1;
+    memcpy(value, v, eol - v);
+    value[eol - v] = '\0';
+    return 0;
+  }
+  return -1;
+}
+
+/*
+ * relay_response - relay one response from the origin to the client.
+ *     The origin's hop-by-hop headers are replaced by the proxy's own
+ *     Connection header: keep-alive if cp->client_keep is set and the
+ *     framing lets the client find the end of the response, otherwise
+ *     close (and cp->client_keep is cleared). The body is delimited by
+ *     that framing (none, Content-Length, chunked, or the origin
+ *     closing) so the origin connection can be reused afterwards. The
+ *     copy leaves the Connection and Age headers out. While
+ *     cp->cacheable is set a copy of the response is kept in cp->obj;
+ *     it is cleared as soon as the response turns out not to be a 200,
+ *     not to be storable or not to fit, and the rest of the body is
+ *     then spliced without a copy. Its freshness goes in cp->meta. A
+ *     leader shares a flight once the headers show the copy will be
+ *     complete. A 304 to a revalidation is not relayed: it sets
+ *     cp->not_modified and the copy's new freshness in cp->meta. Nor is
+ *     a 5xx while cp->stale_ok is set: it sets cp->origin_failed. With
+ *     fd < 0 (a background refresh) nothing is relayed at all.
+ *     return one of the RESP_* outcomes
+ */
+static int relay_response(rio_t *srio, int fd, copy_t *cp)
+{
+  char buf[MAXLINE], out[MAXBUF];
+  size_t len = 0, clen = RELAY_EOF, chunk;
+  int minor, status, chunked = 0, close = 0, keepalive = 0, end, copied;
+  ssize_t n;
+
+  if ((n = rio_readlineb(srio, buf, MAXLINE)) <= 0)
+    return RESP_NONE;
+  if (sscanf(buf, "HTTP/1.%d %d", &minor, &status) != 2)
+    return RESP_BROKEN;
+  deadline_arm(&cp->deadline, DEADLINE_IDLE, NULL); /* It has started */
+
+  /* The stale copy is still good: the client is sent that instead */
+  if (status == 304 && cp->revalidating)
+  {
+    while ((n = rio_readlineb(srio, buf, MAXLINE)) > 0 &&
+           strcmp(buf, "\r\n") && strcmp(buf, "\n"))
+    {
+      fresh_scan(&cp->fresh, buf, n);
+      if (!strncasecmp(buf, "Connection:", 11))
+      {
+        close = has_token(buf + 11, "close");
+        keepalive = has_token(buf + 11, "keep-alive");
+      }
+    }
+    if (n <= 0)
+      return RESP_NONE;
+    cp->not_modified = 1;
+    if (fresh_meta(&cp->fresh, cp->sent, time(NULL), &cp->meta) < 0)
+      cp->cacheable = 0;
+    return close || (minor == 0 && !keepalive) ? RESP_DONE : RESP_KEEP;
+  }
+
+  /* A server error with a stale copy to fall back on: nothing is
+     relayed, and the rest of the response is left on a connection that
+     will be closed */
+  if (status >= 500 && cp->stale_ok)
+  {
+    cp->origin_failed = 1;
+    return RESP_DONE;
+  }
+
+  cp->len = 0;
+  if (status != 200)
+    cp->cacheable = 0;
+  fresh_init(&cp->fresh);
+
+  /* Status line and headers, batched into out for the client */
+  do
+  {
+    copied = 1;
+    if (cp->cacheable)
+      fresh_scan(&cp->fresh, buf, n);
+    if ((end = !strcmp(buf, "\r\n") || !strcmp(buf, "\n")))
+    {
+      if (status >= 200 && status != 204 && status != 304 && !chunked &&
+          clen == RELAY_EOF)
+        cp->client_keep = 0; /* Only the close will end the body */
+      n = snprintf(buf, sizeof(buf), "%s\r\n",
+                   cp->client_keep ? keepalive_hdr : conn_hdr);
+    }
+    else if (!strncasecmp(buf, "Content-Length:", 15))
+      clen = strtoul(buf + 15, NULL, 10);
+    else if (!strncasecmp(buf, "Transfer-Encoding:", 18))
+      chunked = has_token(buf + 18, "chunked");
+    else if (!strncasecmp(buf, "Connection:", 11))
+    {
+      close = has_token(buf + 11, "close");
+      keepalive = has_token(buf + 11, "keep-alive");
+      n = 0;
+    }
+    else if (!strncasecmp(buf, "Keep-Alive:", 11) ||
+             !strncasecmp(buf, "Proxy-Connection:", 17))
+      n = 0;
+    else if (!strncasecmp(buf, "Age:", 4))
+      copied = 0; /* A hit sends its own */
+
+    if (len + n > sizeof(out))
+    {
+      if (to_client(fd, out, len, cp) < 0)
+        return RESP_BROKEN;
+      len = 0;
+    }
+    memcpy(out + len, buf, n);
+    len += n;
+    if (end)
+      keep_copy(cp, "\r\n", 2);
+    else if (copied)
+      keep_copy(cp, buf, n);
+  } while (!end && (n = rio_readlineb(srio, buf, MAXLINE)) > 0);
+  if (n <= 0)
+    return RESP_BROKEN;
+  if (cp->cacheable && fresh_meta(&cp->fresh, cp->sent, time(NULL),
+                                  &cp->meta) < 0)
+    cp->cacheable = 0; /* no-store or private */
+
+  /* Followers get the copy only if it will be whole: a 200 of known
+     length that fits. Otherwise they are let go to fetch their own. */
+  if (cp->flight)
+  {
+    if (cp->cacheable && !chunked && clen != RELAY_EOF &&
+        cp->len + clen <= MAX_OBJECT_SIZE)
+    {
+      cp->shared = 1;
+      flight_share(cp->flight);
+      flight_publish(cp->flight, cp->len);
+    }
+    else
+      flight_finish(cp->flight, 0);
+  }
+  if (to_client(fd, out, len, cp) < 0)
+    return RESP_BROKEN;
+
+  /* Body */
+  if (status < 200 || status == 204 || status == 304)
+    ;
+  else if (chunked)
+  {
+    /* Size line, data and CRLF per chunk, then trailers to a blank line */
+    do
+    {
+      if ((n = rio_readlineb(srio, buf, MAXLINE)) <= 0 ||
+          to_client(fd, buf, n, cp) < 0)
+        return RESP_BROKEN;
+      keep_copy(cp, buf, n);
+      chunk = strtoul(buf, NULL, 16);
+      if (chunk > 0 && relay_body(srio, fd, chunk + 2, cp) < 0)
+        return RESP_BROKEN;
+    } while (chunk > 0);
+    do
+    {
+      if ((n = rio_readlineb(srio, buf, MAXLINE)) <= 0 ||
+          to_client(fd, buf, n, cp) < 0)
+        return RESP_BROKEN;
+      keep_copy(cp, buf, n);
+    } while (strcmp(buf, "\r\n") && strcmp(buf, "\n"));
+  }
+  else
+  {
+    if (clen != RELAY_EOF && cp->len + clen > MAX_OBJECT_SIZE)
+      cp->cacheable = 0; /* Known up front not to fit */
+    if (relay_body(srio, fd, clen, cp) < 0)
+      return RESP_BROKEN;
+    if (clen == RELAY_EOF)
+      return RESP_DONE; /* Delimited by the close */
+  }
+
+  if (status < 200 || close || (minor == 0 && !keepalive))
+    return RESP_DONE;
+  return RESP_KEEP;
+}
+
+/*
+ * relay_body - relay len body bytes (RELAY_EOF: up to the origin's
+ *     close), copying them into cp->obj while cp->cacheable holds
+ *     return 0 on success, -1 on error or a short body
+ */
+static int relay_body(rio_t *srio, int fd, size_t len, copy_t *cp)
+{
+  char buf[MAXLINE];
+  ssize_t n;
+
+  while (len > 0)
+  {
+    if (!cp->cacheable)
+    {
+      /* Hand rio's read-ahead to the client, then splice the rest */
+      if (srio->rio_cnt == 0)
+      {
+        n = relay_splice(srio->rio_fd, fd, len);
+        return n < 0 || (len != RELAY_EOF && n != len) ? -1 : 0;
+      }
+      n = srio->rio_cnt < len ? srio->rio_cnt : len;
+      if (rio_writen(fd, srio->rio_bufptr, n) < 0)
+        return -1;
+      srio->rio_bufptr += n;
+      srio->rio_cnt -= n;
+    }
+    else
+    {
+      if ((n = rio_readnb(srio, buf, len < MAXLINE ? len : MAXLINE)) <= 0)
+        return n == 0 && len == RELAY_EOF ? 0 : -1;
+      if (to_client(fd, buf, n, cp) < 0)
+        return -1;
+      keep_copy(cp, buf, n);
+    }
+    if (len != RELAY_EOF)
+      len -= n;
+  }
+  return 0;
+}
+
+/*
+ * to_client - write response bytes to the client. If the client has
+ *     gone, a leader carries on without it for the sake of followers.
+ *     A background refresh has no client (fd < 0) and only keeps the
+ *     copy; one that cannot be copied fails in relay_body().
+ *     return 0, or -1 if the relay should stop
+ */
+static int to_client(int fd, char *buf, size_t n, copy_t *cp)
+{
+  if (fd < 0)
+    return 0;
+  if (!cp->client_gone && rio_writen(fd, buf, n) < 0)
+    cp->client_gone = 1;
+  return cp->client_gone && !cp->shared ? -1 : 0;
+}
+
+/*
+ * keep_copy - append n bytes to the cached copy of a response, or give
+ *     up on caching it once it no longer fits
+ */
+static void keep_copy(copy_t *cp, const char *buf, size_t n)
+{
+  if (!cp->cacheable)
+    return;
+  if (cp->len + n > MAX_OBJECT_SIZE)
+  {
+    cp->cacheable = 0;
+    return;
+  }
+  memcpy(cp->obj + cp->len, buf, n);
+  cp->len += n;
+  if (cp->shared)
+    flight_publish(cp->flight, cp->len);
+}
+
+/*
+ * has_token - whether a comma-separated header value lists token
+ */
+static int has_token(const char *value, const char *token)
+{
+  size_t n = strlen(token);
+
+  while (*value)
+  {
+    value += strspn(value, " \t,");
+    if (!strncasecmp(value, token, n) && strchr(" \t,\r\n", value[n]))
+      return 1;
+    value += strcspn(value, ",");
+  }
+  return 0;
+}
+
+/*
+ * admin_response - build the reply to a request addressed to the proxy
+ *     itself (origin-form URI) rather than forwarded through it:
+ *       /cache-stats     per-shard cache counters and slab memory use
+ *       /upstream-stats  origin connection reuse counters
+ *       /dns-stats       resolver cache counters
+ *       /flight-stats    collapsed forwarding counters
+ *       /disk-stats      disk tier counters
+ *       /refresh-stats   background refresh counters
+ *       /deadline-stats  deadlines that passed, by kind
+ *       /cache-snapshot  save the cache to the -w file now
+ *     return the response length, or -1 if uri is not an admin path
+ */
+int admin_response(char *uri, char *out, size_t size)
+{
+  char body[MAXBUF];
+  int n, hlen;
+
+  if (!strcmp(uri, "/cache-stats"))
+    n = cache_print_stats(body, sizeof(body));
+  else if (!strcmp(uri, "/upstream-stats"))
+    n = upstream_print_stats(body, sizeof(body));
+  else if (!strcmp(uri, "/dns-stats"))
+    n = dns_print_stats(body, sizeof(body));
+  else if (!strcmp(uri, "/flight-stats"))
+    n = flight_print_stats(body, sizeof(body));
+  else if (!strcmp(uri, "/disk-stats"))
+    n = disk_print_stats(body, sizeof(body));
+  else if (!strcmp(uri, "/refresh-stats"))
+    n = refresh_print_stats(body, sizeof(body));
+  else if (!strcmp(uri, "/deadline-stats"))
+    n = deadline_print_stats(body, sizeof(body));
+  else if (!strcmp(uri, "/cache-snapshot"))
+  {
+    if (!snapfile)
+      n = snprintf(body, sizeof(body), "no snapshot file (-w file)\n");
+    else if ((n = snapshot_save(snapfile)) < 0)
+      n = snprintf(body, sizeof(body), "snapshot to %.*s failed\n",
+                   MAXLINE, snapfile);
+    else
+      n = snprintf(body, sizeof(body), "saved %d objects to %.*s\n", n,
+                   MAXLINE, snapfile);
+  }
+  else
+    return -1;
+  hlen = snprintf(out, size,
+                  "HTTP/1.0 200 OK\r\n"
+                  "Content-type: text/plain\r\n"
+                  "Content-length: %d\r\n\r\n",
+                  n);
+  if (hlen + n >= size)
+    return -1;
+  memcpy(out + hlen, body, n + 1);
+  return hlen + n;
+}
+
+/*
+ * make_cache_key - build the cache key for an origin URL; the explicit
+ *     port makes "host/" and "host:80/" the same object
+ *     return 0 on success, -1 if the key does not fit
+ */
+int make_cache_key(char *key, size_t size, char *host, char *port,
+                   char *path)
+{
+  size_t n = strlen(host) + strlen(port) + strlen(path) + 2;
+
+  if (n >= size)
+    return -1;
+  sprintf(key, "%s:%s%s", host, port, path);
+  return 0;
+}
+
+/*
+ * response_cacheable - whether a complete response may be cached; only
+ *     successful (200) responses are kept
+ */
+int response_cacheable(const char *obj, size_t size)
+{
+  return size > 12 && !strncmp(obj, "HTTP/1.", 7) &&
+         !strncmp(obj + 8, " 200", 4);
+}
+
+/*
+ * send_stored - send a stored response (a cached copy, or the start of
+ *     one being fetched) to the client. Copies carry no Connection
+ *     header, so one is added: keep-alive if keep is set and the headers
+ *     frame the body, otherwise close. So is an Age header of age
+ *     seconds, unless age is negative. A copy that has a Connection
+ *     header of its own or no end of headers is sent as it is.
+ *     return 1 if the connection can take another request, 0 if not, or
+ *     -1 if the client went away
+ */
+int send_stored(int fd, const char *obj, size_t len, int keep, long age)
+{
+  const char *p, *eol, *end = obj + len;
+  char hdr[64];
+  struct iovec iov[3];
+  ssize_t n;
+  int i, status = 0, framed;
+
+  if (len > 12 && !strncmp(obj, "HTTP/1.", 7))
+    status = atoi(obj + 9);
+  framed = status < 200 || status == 204 || status == 304;
+
+  /* Past the status line, one header per line up to the blank one */
+  for (p = obj; (eol = memchr(p, '\n', end - p)) != NULL; p = eol + 1)
+  {
+    if (p > obj && (eol == p || (eol == p + 1 && *p == '\r')))
+      break;
+    if (!strncasecmp(p, "Connection:", 11))
+    {
+      eol = NULL;
+      break;
+    }
+    if (!strncasecmp(p, "Content-Length:", 15) ||
+        !strncasecmp(p, "Transfer-Encoding:", 18))
+      framed = 1;
+  }
+  if (eol == NULL)
+    return rio_writen(fd, (void *)obj, len) < 0 ? -1 : 0;
 
-int main()
+  keep = keep && framed;
+  iov[1].iov_len = 0;
+  if (age >= 0)
+    iov[1].iov_len = snprintf(hdr, sizeof(hdr), "Age: %ld\r\n", age);
+  iov[1].iov_len += snprintf(hdr + iov[1].iov_len, sizeof(hdr) - iov[1].iov_len,
+                             "%s", keep ? keepalive_hdr : conn_hdr);
+  iov[0].iov_base = (void *)obj;
+  iov[0].iov_len = p - obj;
+  iov[1].iov_base = hdr;
+  iov[2].iov_base = (void *)p;
+  iov[2].iov_len = end - p;
+  if ((n = writev(fd, iov, 3)) < 0)
+    return -1;
+
+  /* Finish a short write piece by piece */
+  for (i = 0; i < 3; i++)
+  {
+    if ((size_t)n >= iov[i].iov_len)
+    {
+      n -= iov[i].iov_len;
+      continue;
+    }
+    if (rio_writen(fd, (char *)iov[i].iov_base + n, iov[i].iov_len - n) < 0)
+      return -1;
+    n = 0;
+  }
+  return keep;
+}
+
+/*
+ * parse_uri - split an absolute http:// URI into host, port and path
+ *             return 0 on success, -1 if the URI is not understood
+ */
+int parse_uri(char *uri, char *host, char *port, char *path)
 {
-  printf("%s", user_agent_hdr);
+  char *hostp, *portp, *pathp;
+  size_t len;
+
+  if (strncasecmp(uri, "http://", 7))
+    return -1;
+  hostp = uri + 7;
+
+  /* Path: everything from the first '/' after the authority */
+  pathp = strchr(hostp, '/');
+  if (pathp)
+  {
+    strcpy(path, pathp);
+    len = pathp - hostp;
+  }
+  else
+  {
+    strcpy(path, "/");
+    len = strlen(hostp);
+  }
+
+  /* Port: optional ":port" at the end of the authority */
+  portp = memchr(hostp, ':', len);
+  if (portp)
+  {
+    size_t plen = len - (portp - hostp) - 1;
+    if (plen == 0)
+      return -1;
+    memcpy(port, portp + 1, plen);
+    port[plen] = '\0';
+    len = portp - hostp;
+  }
+  else
+    strcpy(port, "80");
+
+  if (len == 0)
+    return -1;
+  memcpy(host, hostp, len);
+  host[len] = '\0';
   return 0;
 }
+
+/*
+ * rewrite_request - turn a complete request header block, parsed in
+ *     the engine's own buffer, into the request to send to the origin,
+ *     for engines that buffer the whole block before acting on it. The
+ *     origin's host, port and path are returned as well.
+ *     return the length of the request in out, or -1 with an error
+ *     response for the client in out
+ */
+int rewrite_request(http_req_t *req, char *out, size_t size, char *host,
+                    char *port, char *path)
+{
+  char method[MAXLINE], uri[MAXLINE];
+  size_t len;
+  int has_host = 0, keepalive = 0;
+
+  if (!http_span_is(&req->method, "GET"))
+  {
+    http_span_copy(method, sizeof(method), &req->method);
+    format_error(out, size, method, "501", "Not Implemented",
+                 "Proxy does not implement this method");
+    return -1;
+  }
+  if (http_span_copy(uri, sizeof(uri), &req->uri) < 0)
+  {
+    format_error(out, size, "request", "414", "URI Too Long",
+                 "Proxy could not handle the request URI");
+    return -1;
+  }
+  if (parse_uri(uri, host, port, path) < 0)
+  {
+    if (admin_response(uri, out, size) < 0)
+      format_error(out, size, uri, "400", "Bad Request",
+                   "Proxy only handles absolute http:// URIs");
+    return -1;
+  }
+
+  len = snprintf(out, size, "GET %s HTTP/1.0\r\n", path);
+  if (len >= size ||
+      (len = copy_requesthdrs(req, out, len, size, &has_host,
+                              &keepalive)) == (size_t)-1 ||
+      finish_requesthdrs(out, len, size, host, port, has_host, 0) < 0)
+  {
+    format_error(out, size, "request", "400", "Bad Request",
+                 "Request headers are too large");
+    return -1;
+  }
+  return strlen(out);
+}
+
+/*
+ * build_requesthdrs - append the headers to send to the origin over a
+ *     keep-alive connection for the client's request req onto hdrs.
+ *     *keepalive is updated from the client's Connection and
+ *     Proxy-Connection headers, and cleared if the request has a body.
+ *     return 0 on success, -1 if hdrs overflowed
+ */
+int build_requesthdrs(http_req_t *req, char *hdrs, size_t size, char *host,
+                      char *port, int *keepalive)
+{
+  size_t len;
+  int has_host = 0;
+
+  if ((len = copy_requesthdrs(req, hdrs, strlen(hdrs), size, &has_host,
+                              keepalive)) == (size_t)-1)
+    return -1;
+  return finish_requesthdrs(hdrs, len, size, host, port, has_host, 1);
+}
+
+/*
+ * copy_requesthdrs - append the client's headers that are forwarded to
+ *     the len bytes in hdrs, noting Host in *has_host, and update
+ *     *keepalive from the headers that decide whether the client
+ *     connection persists
+ *     return the new length, or (size_t)-1 if hdrs overflowed
+ */
+static size_t copy_requesthdrs(http_req_t *req, char *hdrs, size_t len,
+                               size_t size, int *has_host, int *keepalive)
+{
+  http_header_t *h;
+  int i;
+
+  for (i = 0; i < req->nheaders; i++)
+  {
+    h = &req->headers[i];
+    if (http_span_is(&h->name, "Connection") ||
+        http_span_is(&h->name, "Proxy-Connection"))
+    {
+      if (http_has_token(&h->value, "close"))
+        *keepalive = 0;
+      else if (http_has_token(&h->value, "keep-alive"))
+        *keepalive = 1;
+    }
+    /* A request body is not forwarded, so the stream cannot be resumed */
+    else if ((http_span_is(&h->name, "Content-Length") &&
+              !http_span_is(&h->value, "0")) ||
+             http_span_is(&h->name, "Transfer-Encoding"))
+      *keepalive = 0;
+    if (!keep_requesthdr(&h->name, has_host))
+      continue;
+    if (len + h->name.len + h->value.len + 4 >= size)
+      return (size_t)-1;
+    memcpy(hdrs + len, h->name.p, h->name.len);
+    len += h->name.len;
+    hdrs[len++] = ':';
+    hdrs[len++] = ' ';
+    memcpy(hdrs + len, h->value.p, h->value.len);
+    len += h->value.len;
+    hdrs[len++] = '\r';
+    hdrs[len++] = '\n';
+  }
+  hdrs[len] = '\0';
+  return len;
+}
+
+/*
+ * keep_requesthdr - decide whether the client header called name is
+ *     forwarded. Host is kept (and noted in *has_host); User-Agent,
+ *     Connection, Keep-Alive and Proxy-Connection are dropped because
+ *     the proxy sends its own.
+ */
+int keep_requesthdr(const http_span_t *name, int *has_host)
+{
+  if (http_span_is(name, "Host"))
+  {
+    *has_host = 1;
+    return 1;
+  }
+  return !http_span_is(name, "User-Agent") &&
+         !http_span_is(name, "Connection") &&
+         !http_span_is(name, "Keep-Alive") &&
+         !http_span_is(name, "Proxy-Connection");
+}
+
+/*
+ * finish_requesthdrs - append Host (if the client sent none), the
+ *     proxy's fixed headers and the terminating blank line to the len
+ *     bytes already in hdrs. With keepalive the origin is asked to keep
+ *     the connection open, otherwise to close it.
+ *     return 0 on success, -1 if hdrs overflowed
+ */
+int finish_requesthdrs(char *hdrs, size_t len, size_t size, char *host,
+                       char *port, int has_host, int keepalive)
+{
+  if (!has_host)
+  {
+    if (!strcmp(port, "80"))
+      len += snprintf(hdrs + len, size - len, "Host: %s\r\n", host);
+    else
+      len += snprintf(hdrs + len, size - len, "Host: %s:%s\r\n", host, port);
+  }
+  if (len >= size)
+    return -1;
+  if (keepalive)
+    len += snprintf(hdrs + len, size - len, "%s%s\r\n", user_agent_hdr,
+                    keepalive_hdr);
+  else
+    len += snprintf(hdrs + len, size - len, "%s%s%s\r\n", user_agent_hdr,
+                    conn_hdr, proxy_conn_hdr);
+  return len < size ? 0 : -1;
+}
+
+/*
+ * format_error - build a complete error response in buf
+ *     return the number of bytes in the response
+ */
+int format_error(char *buf, size_t size, char *cause, char *errnum,
+                 char *shortmsg, char *longmsg)
+{
+  char body[MAXLINE];
+  int n, hlen;
+
+  /* Build the HTTP response body */
+  n = snprintf(body, sizeof(body),
+               "<html><title>Proxy Error</title>"
+               "<body bgcolor=\"ffffff\">\r\n"
+               "%s: %s\r\n"
+               "<p>%s: %.512s\r\n"
+               "<hr><em>The Proxy Web server</em>\r\n",
+               errnum, shortmsg, longmsg, cause);
+
+  /* Prepend the HTTP response headers */
+  hlen = snprintf(buf, size,
+                  "HTTP/1.0 %s %s\r\n"
+                  "Content-type: text/html\r\n"
+                  "Content-length: %d\r\n\r\n",
+                  errnum, shortmsg, n);
+  if (hlen + n >= size)
+    return hlen < size ? hlen : 0;
+  memcpy(buf + hlen, body, n + 1);
+  return hlen + n;
+}
+
+/*
+ * clienterror - returns an error message to the client
+ */
+void clienterror(int fd, char *cause, char *errnum, char *shortmsg,
+                 char *longmsg)
+{
+  char buf[MAXBUF];
+  int n = format_error(buf, sizeof(buf), cause, errnum, shortmsg, longmsg);
+
+  rio_writen(fd, buf, n);
+}
@@ -0,0 +1,30 @@
+/*
+ * proxy.h - request helpers shared by the proxy's I/O engines
+ */
+#ifndef __PROXY_H__
+#define __PROXY_H__
+
+#include "csapp.h"
+#include "http.h"
+
+/* Recommended max cache and object sizes */
+#define MAX_CACHE_SIZE 1049000
+#define MAX_OBJECT_SIZE 102400
+
+int parse_uri(char *uri, char *host, char *port, char *path);
+int keep_requesthdr(const http_span_t *name, int *has_host);
+int rewrite_request(http_req_t *req, char *out, size_t size, char *host,
+                    char *port, char *path);
+int admin_response(char *uri, char *out, size_t size);
+int make_cache_key(char *key, size_t size, char *host, char *port,
+                   char *path);
+int response_cacheable(const char *obj, size_t size);
+int send_stored(int fd, const char *obj, size_t len, int keep, long age);
+int finish_requesthdrs(char *hdrs, size_t len, size_t size, char *host,
+                       char *port, int has_host, int keepalive);
+int format_error(char *buf, size_t size, char *cause, char *errnum,
+                 char *shortmsg, char *longmsg);
+void clienterror(int fd, char *cause, char *errnum, char *shortmsg,
+                 char *longmsg);
+
+#endif /* __PROXY_H__ */
@@ -0,0 +1,163 @@
+/*
+ * refresh.c - background refreshes of cached objects
+ *
+ * A pool worker that serves a copy it wants fetched again (stale, but
+ * within its stale-while-revalidate window, or still fresh but hot and
+ * about to expire) queues the key here rather than making its client
+ * wait for the origin. One of a few dedicated threads takes it and runs
+ * the fetch callback the proxy gave refresh_init(), which revalidates
+ * or replaces the cached copy.
+ *
+ * A key that is already queued or being fetched is not queued again,
+ * so a burst of hits on one stale object starts a single refresh. At
+ * most REFRESH_QUEUE refreshes wait; past that they are dropped, which
+ * costs nothing but freshness: the copy is served all the same and a
+ * later hit asks again. Both lists are short enough to search under the
+ * lock.
+ */
+#include "csapp.h"
+#include "refresh.h"
+
+typedef struct refresh_req
+{
+  char *key, *host, *port, *path;
+  char *obj; /* The copy being refreshed */
+  size_t len;
+  struct refresh_req *next;
+} refresh_req_t;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queued = PTHREAD_COND_INITIALIZER;
+static refresh_req_t *todo, **todo_tail = &todo; /* FIFO of refreshes */
+static refresh_req_t *running;                   /* Being fetched */
+static int ntodo;
+static refresh_fetch_t fetch_fn; /* NULL until refresh_init() */
+static unsigned long nqueued, nmerged, ndropped, nrefreshed, nfailed;
+
+static void *refresh_thread(void *vargp);
+static int listed(refresh_req_t *list, const char *key);
+static void free_req(refresh_req_t *r);
+
+/*
+ * refresh_init - start nthreads refresh threads, each running fetch
+ */
+void refresh_init(int nthreads, refresh_fetch_t fetch)
+{
+  pthread_t tid;
+  int i;
+
+  fetch_fn = fetch;
+  for (i = 0; i < nthreads; i++)
+    Pthread_create(&tid, NULL, refresh_thread, NULL);
+}
+
+/*
+ * refresh_submit - queue a refresh of key from host:port, unless one is
+ *     queued or running already. obj (len bytes, malloc'd) is the copy
+ *     the caller served; it is taken over and freed either way.
+ */
+void refresh_submit(char *key, char *host, char *port, char *path,
+                    char *obj, size_t len)
+{
+  refresh_req_t *r;
+
+  pthread_mutex_lock(&lock);
+  if (fetch_fn == NULL || ntodo >= REFRESH_QUEUE)
+    ndropped++;
+  else if (listed(todo, key) || listed(running, key))
+    nmerged++;
+  else
+  {
+    nqueued++;
+    ntodo++;
+    r = Malloc(sizeof(refresh_req_t));
+    r->key = strdup(key);
+    r->host = strdup(host);
+    r->port = strdup(port);
+    r->path = strdup(path);
+    r->obj = obj;
+    r->len = len;
+    r->next = NULL;
+    *todo_tail = r;
+    todo_tail = &r->next;
+    obj = NULL;
+    pthread_cond_signal(&queued);
+  }
+  pthread_mutex_unlock(&lock);
+  free(obj);
+}
+
+/*
+ * refresh_print_stats - write the refresh counters into buf
+ *     return the number of bytes written
+ */
+int refresh_print_stats(char *buf, size_t size)
+{
+  int n;
+
+  pthread_mutex_lock(&lock);
+  n = snprintf(buf, size,
+               "queued %lu merged %lu dropped %lu refreshed %lu failed %lu\n",
+               nqueued, nmerged, ndropped, nrefreshed, nfailed);
+  pthread_mutex_unlock(&lock);
+  return n < size ? n : size - 1;
+}
+
+/*
+ * refresh_thread - run queued refreshes
+ */
+static void *refresh_thread(void *vargp)
+{
+  refresh_req_t *r, **rp;
+  int ok;
+
+  Pthread_detach(pthread_self());
+  while (1)
+  {
+    pthread_mutex_lock(&lock);
+    while (todo == NULL)
+      pthread_cond_wait(&queued, &lock);
+    r = todo;
+    if ((todo = r->next) == NULL)
+      todo_tail = &todo;
+    ntodo--;
+    r->next = running;
+    running = r;
+    pthread_mutex_unlock(&lock);
+
+    ok = fetch_fn(r->key, r->host, r->port, r->path, r->obj, r->len);
+
+    pthread_mutex_lock(&lock);
+    for (rp = &running; *rp != r; rp = &(*rp)->next)
+      ;
+    *rp = r->next;
+    if (ok)
+      nrefreshed++;
+    else
+      nfailed++;
+    pthread_mutex_unlock(&lock);
+    free_req(r);
+  }
+  return NULL;
+}
+
+/*
+ * listed - whether a refresh of key is on list (caller holds the lock)
+ */
+static int listed(refresh_req_t *list, const char *key)
+{
+  for (; list; list = list->next)
+    if (!strcmp(list->key, key))
+      return 1;
+  return 0;
+}
+
+static void free_req(refresh_req_t *r)
+{
+  free(r->key);
+  free(r->host);
+  free(r->port);
+  free(r->path);
+  free(r->obj);
+  Free(r);
+}
@@ -0,0 +1,22 @@
+/*
+ * refresh.h - background refreshes of cached objects
+ */
+#ifndef __REFRESH_H__
+#define __REFRESH_H__
+
+#include <stddef.h>
+
+#define REFRESH_THREADS 2 /* Refreshes that can run at once */
+#define REFRESH_QUEUE 64  /* Refreshes that can wait; more are dropped */
+
+/* Called on a refresh thread to fetch key again; obj is the copy
+   served meanwhile. Returns 1 if the cache has a fresh copy after. */
+typedef int (*refresh_fetch_t)(char *key, char *host, char *port,
+                               char *path, char *obj, size_t len);
+
+void refresh_init(int nthreads, refresh_fetch_t fetch);
+void refresh_submit(char *key, char *host, char *port, char *path,
+                    char *obj, size_t len);
+int refresh_print_stats(char *buf, size_t size);
+
+#endif /* __REFRESH_H__ */
@@ -0,0 +1,177 @@
+/*
+ * relay.c - zero-copy socket-to-socket relay
+ *
+ * relay_splice() moves len bytes, or everything until EOF, from one
+ * descriptor to another through a pipe with splice(2): origin socket ->
+ * pipe -> client socket. The payload stays in kernel pages instead of
+ * being copied out to a user buffer by read() and back in by write().
+ *
+ * Each thread keeps one pipe and reuses it for every relay. A pipe that
+ * may still hold bytes after an error is closed rather than reused. If
+ * the kernel cannot splice between the two descriptors, the relay falls
+ * back to read()/write() through a stack buffer.
+ *
+ * Both sockets are switched to non-blocking for the relay. A read that
+ * finds nothing, or a write that finds the client's socket full, waits
+ * in deadline_wait(), so an origin that goes quiet or a client that
+ * stops reading runs into the thread's idle deadline (deadline.c)
+ * instead of holding the thread forever.
+ *
+ * Flow control: a chunk is read from the origin only once the last one
+ * has gone out to the client, so the proxy holds at most one pipe (or
+ * stack buffer) of a response whatever the two speeds. relay_lowat()
+ * bounds what the kernel queues for a client with TCP_NOTSENT_LOWAT:
+ * its socket only takes more, and only polls writable, while less than
+ * RELAY_NOTSENT_LOWAT bytes are waiting to be sent, instead of as many
+ * as fit in a send buffer the kernel may have grown to megabytes.
+ *
+ * splice() is only declared with _GNU_SOURCE, which csapp.h does not
+ * compile under, so this file uses the system headers alone.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "deadline.h"
+#include "relay.h"
+
+#define CHUNK 65536 /* Bytes per splice; the default pipe capacity */
+
+static __thread int pipefd[2] = {-1, -1};
+
+static ssize_t splice_all(int from, int to, size_t len);
+static ssize_t copy_fallback(int from, int to, size_t len);
+static ssize_t drain(int to, size_t n);
+static void close_pipe(void);
+
+/*
+ * relay_splice - copy from -> to until len bytes (or with RELAY_EOF, all
+ *     of them) have gone or from reaches EOF
+ *     return the bytes relayed, or -1 on error (errno set)
+ */
+ssize_t relay_splice(int from, int to, size_t len)
+{
+  int from_flags = fcntl(from, F_GETFL), to_flags = fcntl(to, F_GETFL);
+  ssize_t n;
+
+  fcntl(from, F_SETFL, from_flags | O_NONBLOCK);
+  fcntl(to, F_SETFL, to_flags | O_NONBLOCK);
+  n = splice_all(from, to, len);
+  fcntl(from, F_SETFL, from_flags);
+  fcntl(to, F_SETFL, to_flags);
+  return n;
+}
+
+/*
+ * relay_lowat - let at most RELAY_NOTSENT_LOWAT unsent bytes queue up in
+ *     the kernel for the client socket fd
+ */
+void relay_lowat(int fd)
+{
+  int lowat = RELAY_NOTSENT_LOWAT;
+
+  setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat));
+}
+
+/*
+ * splice_all - relay_splice() once both sockets are non-blocking
+ */
+static ssize_t splice_all(int from, int to, size_t len)
+{
+  ssize_t n, total = 0;
+
+  if (pipefd[0] < 0 && pipe(pipefd) < 0)
+    return copy_fallback(from, to, len);
+
+  while (len > 0)
+  {
+    n = splice(from, NULL, pipefd[1], NULL, len < CHUNK ? len : CHUNK,
+               SPLICE_F_MOVE | SPLICE_F_MORE);
+    if (n == 0)
+      return total;
+    if (n < 0)
+    {
+      if (errno == EINTR ||
+          (errno == EAGAIN && deadline_wait(from, POLLIN) == 0))
+        continue;
+      if (errno == EINVAL && total == 0)
+        return copy_fallback(from, to, len); /* Cannot splice these fds */
+      return -1;
+    }
+    if (drain(to, n) < 0)
+    {
+      close_pipe(); /* May still hold part of the chunk */
+      return -1;
+    }
+    total += n;
+    if (len != RELAY_EOF)
+      len -= n;
+  }
+  return total;
+}
+
+/*
+ * drain - splice n bytes that are in the pipe out to fd to
+ */
+static ssize_t drain(int to, size_t n)
+{
+  ssize_t m;
+
+  while (n > 0)
+  {
+    m = splice(pipefd[0], NULL, to, NULL, n, SPLICE_F_MOVE | SPLICE_F_MORE);
+    if (m <= 0)
+    {
+      if (m < 0 && (errno == EINTR ||
+                    (errno == EAGAIN && deadline_wait(to, POLLOUT) == 0)))
+        continue;
+      return -1;
+    }
+    n -= m;
+  }
+  return 0;
+}
+
+/*
+ * copy_fallback - the same relay with read()/write()
+ */
+static ssize_t copy_fallback(int from, int to, size_t len)
+{
+  char buf[8192];
+  ssize_t n, m, off, total = 0;
+
+  while (len > 0 &&
+         (n = read(from, buf, len < sizeof(buf) ? len : sizeof(buf))) != 0)
+  {
+    if (n < 0)
+    {
+      if (errno == EINTR ||
+          (errno == EAGAIN && deadline_wait(from, POLLIN) == 0))
+        continue;
+      return -1;
+    }
+    for (off = 0; off < n; off += m)
+      if ((m = write(to, buf + off, n - off)) < 0)
+      {
+        if (errno != EINTR &&
+            (errno != EAGAIN || deadline_wait(to, POLLOUT) < 0))
+          return -1;
+        m = 0;
+      }
+    total += n;
+    if (len != RELAY_EOF)
+      len -= n;
+  }
+  return total;
+}
+
+static void close_pipe(void)
+{
+  close(pipefd[0]);
+  close(pipefd[1]);
+  pipefd[0] = pipefd[1] = -1;
+}
@@ -0,0 +1,15 @@
+/*
+ * relay.h - zero-copy socket-to-socket relay
+ */
+#ifndef __RELAY_H__
+#define __RELAY_H__
+
+#include <sys/types.h>
+
+#define RELAY_EOF ((size_t)-1) /* Relay until the sender closes */
+#define RELAY_NOTSENT_LOWAT 65536 /* Unsent bytes a client socket queues */
+
+ssize_t relay_splice(int from, int to, size_t len);
+void relay_lowat(int fd);
+
+#endif /* __RELAY_H__ */
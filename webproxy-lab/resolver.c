@@ -0,0 +1,154 @@
+/*
+ * resolver.c - asynchronous name resolution on a pool of threads
+ *
+ * The event loops cannot call getaddrinfo() on a DNS cache miss without
+ * stalling every connection they serve. Instead they queue the lookup
+ * here and carry on: one of a few dedicated threads runs it through
+ * dns_getaddrinfo(), so the result lands in the DNS cache and
+ * concurrent misses on one name still resolve once, then moves the
+ * request to a completion list and bumps an eventfd. The loop watches
+ * that eventfd like any socket and, when it fires, calls
+ * resolver_complete() to run its callback for every finished lookup on
+ * its own thread.
+ *
+ * Requests are submitted, cancelled and completed by one thread, the
+ * event loop; only the lookup itself happens elsewhere. A cancelled
+ * request (its connection went away) is still resolved, which warms the
+ * cache, but its callback is not run.
+ */
+#include <sys/eventfd.h>
+#include "csapp.h"
+#include "dns.h"
+#include "resolver.h"
+
+struct resolver_req
+{
+  char *host, *port;
+  void *arg; /* Callback argument, or NULL once cancelled */
+  int err;
+  struct addrinfo *res;
+  struct resolver_req *next;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queued = PTHREAD_COND_INITIALIZER;
+static resolver_req_t *todo, **todo_tail = &todo; /* FIFO of lookups */
+static resolver_req_t *done_list; /* Finished, newest first */
+static int efd = -1;
+
+static void *resolver_thread(void *vargp);
+
+/*
+ * resolver_init - start nthreads resolver threads
+ *     return the eventfd that becomes readable when lookups finish
+ */
+int resolver_init(int nthreads)
+{
+  pthread_t tid;
+  int i;
+
+  if ((efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+    unix_error("eventfd error");
+  for (i = 0; i < nthreads; i++)
+    Pthread_create(&tid, NULL, resolver_thread, NULL);
+  return efd;
+}
+
+/*
+ * resolver_submit - queue a lookup of host:port; its callback gets arg
+ *     return a handle for resolver_cancel()
+ */
+resolver_req_t *resolver_submit(const char *host, const char *port,
+                                void *arg)
+{
+  resolver_req_t *r = Malloc(sizeof(resolver_req_t));
+
+  r->host = strdup(host);
+  r->port = strdup(port);
+  r->arg = arg;
+  r->res = NULL;
+  r->next = NULL;
+
+  pthread_mutex_lock(&lock);
+  *todo_tail = r;
+  todo_tail = &r->next;
+  pthread_cond_signal(&queued);
+  pthread_mutex_unlock(&lock);
+  return r;
+}
+
+/*
+ * resolver_cancel - make sure a submitted lookup's callback never runs
+ */
+void resolver_cancel(resolver_req_t *req)
+{
+  req->arg = NULL; /* Only the submitting thread reads it */
+}
+
+/*
+ * resolver_complete - run done for every lookup that has finished since
+ *     the last call; call it when the eventfd is readable
+ */
+void resolver_complete(resolver_done_t done)
+{
+  resolver_req_t *r, *list = NULL, *next;
+  uint64_t count;
+
+  if (read(efd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+    unix_error("eventfd read error");
+
+  /* Take the whole list and put it back in completion order */
+  pthread_mutex_lock(&lock);
+  r = done_list;
+  done_list = NULL;
+  pthread_mutex_unlock(&lock);
+  for (; r; r = next)
+  {
+    next = r->next;
+    r->next = list;
+    list = r;
+  }
+
+  for (r = list; r; r = next)
+  {
+    next = r->next;
+    if (r->arg)
+      done(r->arg, r->err, r->res);
+    else if (r->err == 0)
+      dns_freeaddrinfo(r->res);
+    free(r->host);
+    free(r->port);
+    Free(r);
+  }
+}
+
+/*
+ * resolver_thread - run queued lookups and post their results
+ */
+static void *resolver_thread(void *vargp)
+{
+  uint64_t one = 1;
+  resolver_req_t *r;
+
+  Pthread_detach(pthread_self());
+  while (1)
+  {
+    pthread_mutex_lock(&lock);
+    while (todo == NULL)
+      pthread_cond_wait(&queued, &lock);
+    r = todo;
+    if ((todo = r->next) == NULL)
+      todo_tail = &todo;
+    pthread_mutex_unlock(&lock);
+
+    r->err = dns_getaddrinfo(r->host, r->port, &r->res);
+
+    pthread_mutex_lock(&lock);
+    r->next = done_list;
+    done_list = r;
+    pthread_mutex_unlock(&lock);
+    if (write(efd, &one, sizeof(one)) < 0)
+      unix_error("eventfd write error");
+  }
+  return NULL;
+}
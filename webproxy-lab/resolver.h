@@ -0,0 +1,22 @@
+/*
+ * resolver.h - asynchronous name resolution on a pool of threads
+ */
+#ifndef __RESOLVER_H__
+#define __RESOLVER_H__
+
+#include <netdb.h>
+
+#define RESOLVER_THREADS 4 /* Lookups that can block at once */
+
+typedef struct resolver_req resolver_req_t;
+
+/* Called by resolver_complete() with the outcome of dns_getaddrinfo() */
+typedef void (*resolver_done_t)(void *arg, int err, struct addrinfo *res);
+
+int resolver_init(int nthreads);
+resolver_req_t *resolver_submit(const char *host, const char *port,
+                                void *arg);
+void resolver_cancel(resolver_req_t *req);
+void resolver_complete(resolver_done_t done);
+
+#endif /* __RESOLVER_H__ */
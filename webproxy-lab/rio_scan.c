@@ -0,0 +1,180 @@
+/*
+ * rio_scan.c - SIMD scanners for the end of a line or a header block
+ *
+ * rio_scan_nl finds the end of a line ("\n") in a buffer and
+ * rio_scan_eoh the end of a header block ("\r\n\r\n"). Each has a
+ * byte-at-a-time version and SSE2 and AVX2 versions that compare 16 or
+ * 32 bytes per instruction; the best one the CPU and OS support is
+ * chosen once at startup with cpuid. Each returns a pointer to the
+ * match in p[0, n), or NULL.
+ *
+ * Shared by the rio package in csapp.c and the one in robust-io, so
+ * this file uses the system headers alone.
+ */
+#include <stddef.h>
+#include "rio_scan.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define RIO_X86
+#endif
+
+static char *scan_nl_scalar(const char *p, size_t n)
+{
+    const char *end = p + n;
+
+    for (; p < end; p++)
+	if (*p == '\n')
+	    return (char *)p;
+    return NULL;
+}
+
+static char *scan_eoh_scalar(const char *p, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i + 3 < n; i++)
+	if (p[i] == '\r' && p[i+1] == '\n' && p[i+2] == '\r' && p[i+3] == '\n')
+	    return (char *)p + i;
+    return NULL;
+}
+
+#ifdef RIO_X86
+__attribute__((target("sse2")))
+static char *scan_nl_sse2(const char *p, size_t n)
+{
+    const __m128i nl = _mm_set1_epi8('\n');
+    unsigned mask;
+    size_t i;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+	mask = _mm_movemask_epi8(
+	    _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i)), nl));
+	if (mask)
+	    return (char *)p + i + __builtin_ctz(mask);
+    }
+    return scan_nl_scalar(p + i, n - i);
+}
+
+/* A match at i needs CR at i, LF at i+1, CR at i+2 and LF at i+3: four
+   overlapping loads compared and ANDed give every i in the block */
+__attribute__((target("sse2")))
+static char *scan_eoh_sse2(const char *p, size_t n)
+{
+    const __m128i cr = _mm_set1_epi8('\r'), lf = _mm_set1_epi8('\n');
+    __m128i m;
+    unsigned mask;
+    size_t i;
+
+    for (i = 0; i + 19 <= n; i += 16) {
+	m = _mm_and_si128(
+	    _mm_and_si128(
+		_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i)), cr),
+		_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i + 1)), lf)),
+	    _mm_and_si128(
+		_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i + 2)), cr),
+		_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i + 3)), lf)));
+	if ((mask = _mm_movemask_epi8(m)))
+	    return (char *)p + i + __builtin_ctz(mask);
+    }
+    return scan_eoh_scalar(p + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static char *scan_nl_avx2(const char *p, size_t n)
+{
+    const __m256i nl = _mm256_set1_epi8('\n');
+    unsigned mask;
+    size_t i;
+
+    for (i = 0; i + 32 <= n; i += 32) {
+	mask = _mm256_movemask_epi8(
+	    _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + i)), nl));
+	if (mask)
+	    return (char *)p + i + __builtin_ctz(mask);
+    }
+    /* Leave the upper halves clean for the non-VEX SSE2 code */
+    _mm256_zeroupper();
+    return scan_nl_sse2(p + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static char *scan_eoh_avx2(const char *p, size_t n)
+{
+    const __m256i cr = _mm256_set1_epi8('\r'), lf = _mm256_set1_epi8('\n');
+    __m256i m;
+    unsigned mask;
+    size_t i;
+
+    for (i = 0; i + 35 <= n; i += 32) {
+	m = _mm256_and_si256(
+	    _mm256_and_si256(
+		_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + i)), cr),
+		_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + i + 1)), lf)),
+	    _mm256_and_si256(
+		_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + i + 2)), cr),
+		_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + i + 3)), lf)));
+	if ((mask = _mm256_movemask_epi8(m)))
+	    return (char *)p + i + __builtin_ctz(mask);
+    }
+    _mm256_zeroupper();
+    return scan_eoh_sse2(p + i, n - i);
+}
+#endif /* RIO_X86 */
+
+rio_scan_t rio_scan_nl = scan_nl_scalar, rio_scan_eoh = scan_eoh_scalar;
+
+/*
+ * rio_scan_cpu - the widest scanner the CPU, and the OS's saving of its
+ *     registers, allow
+ */
+static int rio_scan_cpu(void)
+{
+#ifdef RIO_X86
+    unsigned int a, b, c, d, xcr0, xcr0_hi;
+
+    if (!__get_cpuid(1, &a, &b, &c, &d) || !(d & bit_SSE2))
+	return RIO_SCAN_SCALAR;
+    if (!(c & bit_OSXSAVE) || !(c & bit_AVX) || __get_cpuid_max(0, NULL) < 7)
+	return RIO_SCAN_SSE2;
+    __asm__ ("xgetbv" : "=a" (xcr0), "=d" (xcr0_hi) : "c" (0));
+    if ((xcr0 & 6) != 6)        /* XMM and YMM state not enabled */
+	return RIO_SCAN_SSE2;
+    __cpuid_count(7, 0, a, b, c, d);
+    return (b & bit_AVX2) ? RIO_SCAN_AVX2 : RIO_SCAN_SSE2;
+#else
+    return RIO_SCAN_SCALAR;
+#endif
+}
+
+/*
+ * rio_scan_select - use the given scanner, or the widest one supported
+ *     if that is narrower; called at startup with RIO_SCAN_AVX2
+ *     return the scanner now in use
+ */
+int rio_scan_select(int level)
+{
+    int cpu = rio_scan_cpu();
+
+    if (level > cpu)
+	level = cpu;
+    rio_scan_nl = scan_nl_scalar;
+    rio_scan_eoh = scan_eoh_scalar;
+#ifdef RIO_X86
+    if (level == RIO_SCAN_SSE2) {
+	rio_scan_nl = scan_nl_sse2;
+	rio_scan_eoh = scan_eoh_sse2;
+    }
+    else if (level == RIO_SCAN_AVX2) {
+	rio_scan_nl = scan_nl_avx2;
+	rio_scan_eoh = scan_eoh_avx2;
+    }
+#endif
+    return level;
+}
+
+__attribute__((constructor))
+static void rio_scan_init(void)
+{
+    rio_scan_select(RIO_SCAN_AVX2);
+}
@@ -0,0 +1,19 @@
+/*
+ * rio_scan.h - SIMD scanners for the end of a line or a header block
+ */
+#ifndef __RIO_SCAN_H__
+#define __RIO_SCAN_H__
+
+#include <stddef.h>
+
+#define RIO_SCAN_SCALAR 0
+#define RIO_SCAN_SSE2   1
+#define RIO_SCAN_AVX2   2
+
+typedef char *(*rio_scan_t)(const char *p, size_t n);
+
+extern rio_scan_t rio_scan_nl;  /* First '\n' in p[0, n), or NULL */
+extern rio_scan_t rio_scan_eoh; /* First "\r\n\r\n" in p[0, n), or NULL */
+int rio_scan_select(int level);
+
+#endif /* __RIO_SCAN_H__ */
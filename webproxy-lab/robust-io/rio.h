@@ -7,6 +7,8 @@
 #include <string.h>     // memcpy, memset
 #include <stdio.h>      // printf, fprintf, perror (optional)
 #include <stdlib.h>
+#include <time.h>       // time_t
+#include "rio_scan.h"   // 버퍼 스캐너 (../rio_scan.c, rio_readlineb와 rio_readhdrsb가 사용)
 
 #define RIO_BUF_SIZE 8192
 
@@ -19,6 +21,8 @@ typedef struct {
 
 typedef struct {
     int content_length;
+    time_t if_modified_since;   // If-Modified-Since 시각 (없거나 못 읽으면 -1)
+    char if_none_match[256];    // If-None-Match 값 (없으면 빈 문자열)
 } request_header_info;
 
 // 초기화 함수
@@ -36,4 +40,7 @@ ssize_t rio_writen(int fd, const void *usr_buf, size_t n);
 // 한 줄 단위 robust read 함수
 ssize_t rio_readlineb(rio_t *rp, void *usr_buf, size_t max_len);
 
+// "\r\n\r\n"으로 끝나는 헤더 블록 단위 robust read 함수
+ssize_t rio_readhdrsb(rio_t *rp, void *usr_buf, size_t max_len);
+
 #endif // RIO_H
\ No newline at end of file
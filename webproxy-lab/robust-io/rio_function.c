@@ -107,6 +107,29 @@ ssize_t rio_read(rio_t *rp, void *usr_buf, size_t n) {
     return (n - bytes_left);
 }
 
+// 내부 버퍼가 비어 있으면 채운다. 남은 바이트 수, EOF면 0, 에러면 -1 반환
+static ssize_t rio_fill(rio_t *rp) {
+    while (rp->bytes_in_buf <= 0) {
+        rp->bytes_in_buf = read(rp->fd, rp->internal_buf, RIO_BUF_SIZE);
+        if (rp->bytes_in_buf < 0) {
+            if (errno == EINTR)
+                continue;       // 시그널로 인한 중단 -> 재시도
+            return -1;
+        } else if (rp->bytes_in_buf == 0) {
+            return 0;           // EOF
+        }
+        rp->read_ptr = rp->internal_buf;
+    }
+    return rp->bytes_in_buf;
+}
+
+// 내부 버퍼에서 cnt 바이트를 사용자 버퍼로 옮기고 상태 갱신
+static void rio_take(rio_t *rp, char *dst, size_t cnt) {
+    memcpy(dst, rp->read_ptr, cnt);
+    rp->read_ptr += cnt;
+    rp->bytes_in_buf -= cnt;
+}
+
 ssize_t rio_readlineb(rio_t *rp, void *usr_buf, size_t max_len) {
     // 최소한 '\0'을 담을 공간은 있어야 함
     if (max_len < 2) {
@@ -116,27 +139,61 @@ ssize_t rio_readlineb(rio_t *rp, void *usr_buf, size_t max_len) {
     }
 
     char *p = usr_buf;  // 사용자 버퍼 포인터
-    char c;             // 한 글자씩 임시 저장할 변수
-    ssize_t rc;         // rio_read의 반환값
-
-    // 최대 max_len - 1까지만 반복 (마지막은 '\0'용 공간)
-    while (p < (char *)usr_buf + max_len - 1) {
-        rc = rio_read(rp, &c, 1);  // 내부 버퍼에서 1바이트 읽기
-
-        if (rc == 1) {
-            *p++ = c;              // 사용자 버퍼에 복사 후 포인터 증가
-            if (c == '\n')         // 줄 끝이면 반복 종료
-                break;
-        } else if (rc == 0) {
-            // EOF: 아무것도 못 읽은 경우
-            if (p == (char *)usr_buf)
-                return 0;
-            break;  // 일부라도 읽었으면 종료
-        } else {
-            return -1;  // read 에러
-        }
+    char *nl = NULL;    // 찾은 '\n' 위치
+    size_t n = 0, cnt;
+    ssize_t rc;
+
+    // 한 바이트씩이 아니라, 버퍼에 있는 만큼 한 번에 스캔해서 '\n'까지 복사
+    while (nl == NULL && n < max_len - 1) {
+        if ((rc = rio_fill(rp)) < 0)
+            return -1;          // read 에러
+        if (rc == 0)
+            break;              // EOF
+        cnt = rp->bytes_in_buf;
+        if (cnt > max_len - 1 - n)
+            cnt = max_len - 1 - n;
+        if ((nl = rio_scan_nl(rp->read_ptr, cnt)) != NULL)
+            cnt = nl - rp->read_ptr + 1;
+        rio_take(rp, p + n, cnt);
+        n += cnt;
     }
-    *p = '\0';  // 문자열 종료 처리
-    
-    return p - (char *)usr_buf;  // 총 읽은 바이트 수 반환 (\0 제외)
-}
\ No newline at end of file
+    p[n] = '\0';  // 문자열 종료 처리
+
+    return n;  // 총 읽은 바이트 수 반환 (\0 제외), EOF에서 아무것도 못 읽었으면 0
+}
+
+// 헤더 블록 전체를 끝의 "\r\n\r\n"까지 한 번에 읽는 함수.
+// rio_readlineb처럼 max_len - 1바이트보다 길면 잘라서 반환하고 나머지는 버퍼에 남긴다.
+ssize_t rio_readhdrsb(rio_t *rp, void *usr_buf, size_t max_len) {
+    static const char eoh[] = "\r\n\r\n";
+    char *p = usr_buf, *end = NULL;
+    size_t n = 0, cnt, k;
+    ssize_t rc;
+
+    if (max_len == 0)
+        return 0;
+    while (end == NULL && n < max_len - 1) {
+        if ((rc = rio_fill(rp)) < 0)
+            return -1;
+        if (rc == 0)
+            break;
+        cnt = rp->bytes_in_buf;
+        if (cnt > max_len - 1 - n)
+            cnt = max_len - 1 - n;
+
+        // 끝 표시가 이미 복사한 부분과 새 바이트에 걸쳐 있을 수 있음
+        for (k = 1; k <= 3 && end == NULL; k++)
+            if (n >= 4 - k && k <= cnt &&
+                memcmp(p + n - (4 - k), eoh, 4 - k) == 0 &&
+                memcmp(rp->read_ptr, eoh + 4 - k, k) == 0)
+                end = rp->read_ptr + k;
+        if (end == NULL && (end = rio_scan_eoh(rp->read_ptr, cnt)) != NULL)
+            end += 4;
+        if (end != NULL)
+            cnt = end - rp->read_ptr;
+        rio_take(rp, p + n, cnt);
+        n += cnt;
+    }
+    p[n] = '\0';
+    return n;
+}
@@ -4,6 +4,7 @@
 #include <fcntl.h>          // open() 함수 플래그 정의 (O_RDONLY 등)
 #include <sys/stat.h>       // stat(), fstat(), struct stat
 #include "rio.h"            // Robust I/O 함수 정의
+#include "http.h"           // 증분 HTTP 요청 파서 (webproxy-lab/http.c)
 
 
 #define PORT 8000
@@ -13,20 +14,28 @@
 
 // ======================= 유틸리티 함수 ==========================
 
-// 클라이언트가 보낸 HTTP 요청의 헤더 부분을 모두 읽어 들이는 함수
-void read_reqeusthdrs(rio_t *rp, request_header_info *hdr_info) {
-    char buf[MAXLINE];
-
-    while (rio_readlineb(rp, buf, MAXLINE) > 0) {
-        if (strcmp(buf, "\r\n") == 0)   // 헤더 끝은 빈 줄("\r\n")
-            break;
+// 파싱된 요청 헤더에서 필요한 정보를 꺼내는 함수 (헤더는 이미 rio 버퍼 안에 있음)
+void read_reqeusthdrs(const http_req_t *req, request_header_info *hdr_info) {
+    const http_span_t *clen, *ims, *inm;
+    int i;
 
-        if (strncasecmp(buf, "Content-Length:", 15) == 0) {
-            printf("[DEBUG] Found Content-Length line: %s", buf);
-            sscanf(buf + 15, " %d", &hdr_info->content_length);
-        }
-        printf("%s", buf);  // 디버깅용 출력
+    hdr_info->content_length = 0;
+    if ((clen = http_header(req, "Content-Length")) != NULL) {
+        printf("[DEBUG] Found Content-Length: %.*s\n", (int)clen->len, clen->p);
+        hdr_info->content_length = atoi(clen->p);   // 값 뒤에는 항상 줄바꿈이 있음
     }
+
+    // 조건부 GET 헤더 (serve_static이 304 여부를 판단할 때 씀)
+    hdr_info->if_modified_since = -1;
+    if ((ims = http_header(req, "If-Modified-Since")) != NULL)
+        hdr_info->if_modified_since = http_parse_date(ims->p, ims->len);
+    hdr_info->if_none_match[0] = '\0';
+    if ((inm = http_header(req, "If-None-Match")) != NULL)
+        http_span_copy(hdr_info->if_none_match, sizeof(hdr_info->if_none_match), inm);
+    for (i = 0; i < req->nheaders; i++)     // 디버깅용 출력
+        printf("%.*s: %.*s\n",
+               (int)req->headers[i].name.len, req->headers[i].name.p,
+               (int)req->headers[i].value.len, req->headers[i].value.p);
 }
 
 void read_post_body(rio_t *rp, int write_fd, int content_length) {
@@ -94,21 +103,51 @@ void get_filetype(char *filename, char *filetype) {
         strcpy(filetype, "text/plain");  // 기본값
 }
 
+// 클라이언트가 가진 사본이 아직 유효한지 (조건부 GET)
+// If-None-Match가 있으면 ETag로만 판단하고, 없을 때만 If-Modified-Since를 본다
+int not_modified(request_header_info *hdr_info, const char *etag, time_t mtime) {
+    http_span_t inm = { hdr_info->if_none_match, strlen(hdr_info->if_none_match) };
+
+    if (inm.len > 0)
+        return http_has_token(&inm, etag) || http_has_token(&inm, "*");
+    return hdr_info->if_modified_since != -1 && mtime <= hdr_info->if_modified_since;
+}
+
 // 정적 파일 요청 처리 (파일을 열고 내용 전송)
-void serve_static(int connfd, char *filename, int filesize) {
-    int srcfd;
-    char *srcp, filetype[MAXLINE], buf[MAXBUF];
+// 검증자(Last-Modified, ETag)를 함께 보내고, 조건부 GET에 맞으면 304만 보낸다
+void serve_static(int connfd, char *filename, struct stat *sbuf, request_header_info *hdr_info) {
+    int srcfd, filesize = sbuf->st_size;
+    char *srcp, filetype[MAXLINE], buf[MAXBUF], etag[64], lastmod[64];
 
     // MIME 타입 추출 (예: html, png, gif 등)
     get_filetype(filename, filetype);
 
+    // 검증자: 파일 수정 시각과, 크기+수정 시각으로 만든 ETag
+    http_format_date(lastmod, sizeof(lastmod), sbuf->st_mtime);
+    snprintf(etag, sizeof(etag), "\"%lx-%lx\"",
+             (unsigned long)sbuf->st_size, (unsigned long)sbuf->st_mtime);
+
+    // 사본이 최신이면 본문 없이 304 Not Modified
+    if (not_modified(hdr_info, etag, sbuf->st_mtime)) {
+        snprintf(buf, sizeof(buf),
+                "HTTP/1.0 304 Not Modified\r\n"
+                "Server: Tiny Web Server\r\n"
+                "Last-Modified: %s\r\n"
+                "ETag: %s\r\n\r\n",
+                lastmod, etag);
+        write(connfd, buf, strlen(buf));
+        return;
+    }
+
     // 응답 헤더 작성
     snprintf(buf, sizeof(buf),
             "HTTP/1.0 200 OK\r\n"
             "Server: Tiny Web Server\r\n"
             "Content-length: %d\r\n"
-            "Content-type: %s\r\n\r\n",
-            filesize, filetype);
+            "Content-type: %s\r\n"
+            "Last-Modified: %s\r\n"
+            "ETag: %s\r\n\r\n",
+            filesize, filetype, lastmod, etag);
 
     // 헤더 전송
     write(connfd, buf, strlen(buf));
@@ -199,17 +238,30 @@ void parse_uri(char *uri, char *filename, char *cgiargs) {
 
 // 클라이언트 하나의 요청을 처리하는 핵심 함수
 void doit(int connfd) {
-    char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
+    char method[MAXLINE], uri[MAXLINE], version[MAXLINE];
     char filename[MAXLINE], cgiargs[MAXLINE];
     struct stat sbuf;
     rio_t rio;
+    http_req_t req;
     request_header_info hdr_info;
 
     rio_init(&rio, connfd);
 
-    // 1. 요청 줄을 Robust I/O로 읽기
-    rio_readlineb(&rio, buf, MAXLINE);
-    sscanf(buf, "%s %s %s", method, uri, version);
+    // 1. 요청 줄과 헤더를 rio 내부 버퍼 안에서 복사 없이 파싱
+    //    (여러 번의 read로 나뉘어 와도 이어서 파싱한다)
+    if (http_readb(rio.fd, rio.internal_buf, sizeof(rio.internal_buf),
+                   &rio.read_ptr, &rio.bytes_in_buf, &req) <= 0) {
+        client_error(connfd, "request", "400", "Bad Request", "Tiny could not parse the request");
+        close(connfd);
+        return;
+    }
+    if (http_span_copy(method, MAXLINE, &req.method) < 0 ||
+        http_span_copy(uri, MAXLINE, &req.uri) < 0 ||
+        http_span_copy(version, MAXLINE, &req.version) < 0) {
+        client_error(connfd, "request", "414", "URI Too Long", "Tiny could not handle the request line");
+        close(connfd);
+        return;
+    }
 
     // 2. GET 외의 메서드 요청은 에러 처리
     if (strcasecmp(method, "GET") != 0 && strcasecmp(method, "POST") != 0) {
@@ -217,8 +269,8 @@ void doit(int connfd) {
         return;
     }
 
-    // 3. 요청 헤더 읽기 (필요 정보는 hdr_info에 저장)
-    read_reqeusthdrs(&rio, &hdr_info);
+    // 3. 요청 헤더 확인 (필요 정보는 hdr_info에 저장)
+    read_reqeusthdrs(&req, &hdr_info);
 
     // 4. URI 파싱 -> filename, cgiargs 분리
     parse_uri(uri, filename, cgiargs);
@@ -236,7 +288,7 @@ void doit(int connfd) {
             client_error(connfd, filename, "403", "Forbidden", "No permission to read file");
             return;
         }
-        serve_static(connfd, filename, sbuf.st_size);
+        serve_static(connfd, filename, &sbuf, &hdr_info);
     } else {
         // 동적 콘텐츠: 정규 파일이고 실행 권한 있어야 함
         if (!(S_ISREG(sbuf.st_mode)) || !(S_IXUSR & sbuf.st_mode)) {
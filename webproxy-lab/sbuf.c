@@ -0,0 +1,66 @@
+/*
+ * sbuf.c - bounded producer/consumer queue built on the csapp
+ *     semaphore wrappers. The acceptor blocks in sbuf_insert() once
+ *     every slot is taken, which caps the number of connections the
+ *     proxy holds while all workers are busy.
+ */
+#include "sbuf.h"
+
+/*
+ * sbuf_init - create an empty, bounded, shared FIFO buffer with n slots
+ */
+void sbuf_init(sbuf_t *sp, int n)
+{
+  sp->buf = Calloc(n, sizeof(int));
+  sp->n = n;
+  sp->front = sp->rear = 0;
+  Sem_init(&sp->mutex, 0, 1);
+  Sem_init(&sp->slots, 0, n);
+  Sem_init(&sp->items, 0, 0);
+}
+
+/*
+ * sbuf_deinit - clean up buffer sp
+ */
+void sbuf_deinit(sbuf_t *sp)
+{
+  Free(sp->buf);
+}
+
+/*
+ * sbuf_insert - insert item onto the rear of shared buffer sp
+ */
+void sbuf_insert(sbuf_t *sp, int item)
+{
+  P(&sp->slots);
+  P(&sp->mutex);
+  sp->buf[(++sp->rear) % (sp->n)] = item;
+  V(&sp->mutex);
+  V(&sp->items);
+}
+
+/*
+ * sbuf_remove - remove and return the first item from buffer sp
+ */
+int sbuf_remove(sbuf_t *sp)
+{
+  int item;
+
+  P(&sp->items);
+  P(&sp->mutex);
+  item = sp->buf[(++sp->front) % (sp->n)];
+  V(&sp->mutex);
+  V(&sp->slots);
+  return item;
+}
+
+/*
+ * sbuf_waiting - number of items waiting to be removed from sp
+ */
+int sbuf_waiting(sbuf_t *sp)
+{
+  int n;
+
+  sem_getvalue(&sp->items, &n);
+  return n > 0 ? n : 0;
+}
@@ -0,0 +1,401 @@
+/*
+ * slab.c - size-class slab allocator for cache entries
+ *
+ * One anonymous mapping (the arena) is reserved up front and managed in
+ * 4 KB pages. Free pages form runs of consecutive pages; a run is split
+ * to satisfy a request and merged with free neighbours when it comes
+ * back. Returned runs stay resident (dirty) until they add up to a
+ * quarter of the budget, and are then all dropped from the resident set
+ * with MADV_DONTNEED, so a steady stream of evictions does not cost a
+ * system call each. A request of up to SMALL_MAX bytes is served from a
+ * size class: each class carves SLAB_PAGES-page slabs into equal chunks
+ * (sizes grow by 1.25 from MIN_CHUNK) and keeps the slabs that have a
+ * free chunk on a list, with a free list per slab. A larger request,
+ * which is most cached objects, gets a run of its own rounded up to
+ * whole pages, so it wastes less than a page.
+ *
+ * A slab whose last chunk is freed goes back to the page pool, except
+ * that each class keeps one empty slab back so that a class that
+ * allocates and frees in turn does not churn the pool. Pages therefore
+ * move between classes and large objects as the mix of sizes changes,
+ * and the resident set is the pages holding live chunks rather than
+ * the history of the heap. Each class has its own lock and the page
+ * pool has another, so allocating never takes malloc's lock.
+ *
+ * The arena holds twice the budget plus one slab per class, which
+ * leaves room for fragmentation and for entries waiting out their
+ * epoch; slab_alloc returns NULL if it still runs out.
+ */
+#include "csapp.h"
+#include "slab.h"
+
+#define PAGE 4096         /* Arena allocation unit */
+#define SLAB_PAGES 4      /* Pages in a small class slab */
+#define MIN_CHUNK 128     /* Smallest chunk: an entry with a short key */
+#define SMALL_MAX PAGE    /* Largest request served from a class */
+#define GROWTH 1.25       /* Ratio between consecutive class sizes */
+#define MAX_CLASSES 32
+#define NONE ((size_t)-1) /* End of a page list */
+
+/* Owner of a run, kept in its first page */
+#define RUN_FREE (-1)
+#define RUN_LARGE (-2)
+
+typedef struct chunk
+{
+  struct chunk *next; /* Next free chunk of the same slab */
+} chunk_t;
+
+/* One per arena page; the fields live in the first page of a run */
+typedef struct
+{
+  int owner;        /* RUN_FREE, RUN_LARGE or a class index */
+  int dirty;        /* Free runs: may still be resident */
+  size_t len;       /* Pages in the run */
+  size_t head;      /* First page of the run (set in its last page, and
+                       in every page of a slab) */
+  size_t prev;      /* Neighbours on the free run list or */
+  size_t next;      /* on the class's partial slab list */
+  size_t live;      /* Slabs: chunks handed out */
+  size_t carved;    /* Slabs: chunks ever handed out (bump pointer) */
+  chunk_t *free;    /* Slabs: freed chunks */
+} slab_page_t;
+
+typedef struct
+{
+  pthread_mutex_t lock;
+  size_t size;       /* Chunk size */
+  size_t perslab;    /* Chunks per slab */
+  size_t partial;    /* Slabs with a free chunk, or NONE */
+  size_t spare;      /* Empty slab kept back, or NONE */
+  size_t nslabs;     /* Slabs owned, spare included */
+  size_t live;       /* Chunks handed out */
+} __attribute__((aligned(64))) slab_class_t;
+
+static char *arena;
+static size_t npages;
+static slab_page_t *pages;
+static slab_class_t classes[MAX_CLASSES];
+static int nclasses;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t pool = NONE; /* Free runs */
+static size_t pool_free;   /* Pages in free runs */
+static size_t pool_dirty;  /* Pages in dirty free runs */
+static size_t dirty_max;   /* pool_dirty that triggers a purge */
+static size_t large_runs;  /* Runs handed out for large requests */
+
+static slab_class_t *class_of(size_t size);
+static size_t run_get(size_t len, int owner);
+static void run_put(size_t pg);
+static void purge(void);
+static void set_run(size_t pg, size_t len, int owner);
+static void list_add(size_t *head, size_t pg);
+static void list_del(size_t *head, size_t pg);
+
+/*
+ * slab_init - reserve an arena for about budget bytes of entries
+ */
+void slab_init(size_t budget)
+{
+  double size = MIN_CHUNK;
+  int i, rc;
+
+  /* Size classes, 16-byte aligned, ending at SMALL_MAX */
+  while (nclasses < MAX_CLASSES - 1 && size < SMALL_MAX)
+  {
+    classes[nclasses++].size = ((size_t)size + 15) & ~(size_t)15;
+    size *= GROWTH;
+  }
+  classes[nclasses++].size = SMALL_MAX;
+  for (i = 0; i < nclasses; i++)
+  {
+    if ((rc = pthread_mutex_init(&classes[i].lock, NULL)) != 0)
+      posix_error(rc, "pthread_mutex_init error");
+    classes[i].perslab = SLAB_PAGES * PAGE / classes[i].size;
+    classes[i].partial = classes[i].spare = NONE;
+  }
+
+  npages = 2 * ((budget + PAGE - 1) / PAGE) + nclasses * SLAB_PAGES;
+  arena = Mmap(NULL, npages * PAGE, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  pages = Calloc(npages, sizeof(slab_page_t));
+  set_run(0, npages, RUN_FREE);
+  list_add(&pool, 0);
+  pool_free = npages;
+  dirty_max = budget / PAGE / 4;
+}
+
+/*
+ * slab_alloc - return a chunk of at least size bytes, or NULL if the
+ *     arena is exhausted
+ */
+void *slab_alloc(size_t size)
+{
+  slab_class_t *c;
+  slab_page_t *p;
+  size_t pg;
+  void *chunk;
+
+  if (size > SMALL_MAX)
+  {
+    if ((pg = run_get((size + PAGE - 1) / PAGE, RUN_LARGE)) == NONE)
+      return NULL;
+    return arena + pg * PAGE;
+  }
+
+  c = class_of(size);
+  pthread_mutex_lock(&c->lock);
+  if ((pg = c->partial) == NONE)
+  {
+    if ((pg = c->spare) != NONE)
+      c->spare = NONE;
+    else if ((pg = run_get(SLAB_PAGES, c - classes)) != NONE)
+      c->nslabs++;
+    else
+    {
+      pthread_mutex_unlock(&c->lock);
+      return NULL;
+    }
+    list_add(&c->partial, pg);
+  }
+
+  p = &pages[pg];
+  if (p->free)
+  {
+    chunk = p->free;
+    p->free = p->free->next;
+  }
+  else
+    chunk = arena + pg * PAGE + p->carved++ * c->size;
+  if (++p->live == c->perslab)
+    list_del(&c->partial, pg);
+  c->live++;
+  pthread_mutex_unlock(&c->lock);
+  return chunk;
+}
+
+/*
+ * slab_free - give a chunk from slab_alloc back
+ */
+void slab_free(void *ptr)
+{
+  size_t pg = pages[((char *)ptr - arena) / PAGE].head;
+  slab_page_t *p = &pages[pg];
+  slab_class_t *c;
+  chunk_t *chunk = ptr;
+
+  if (p->owner == RUN_LARGE)
+  {
+    run_put(pg);
+    return;
+  }
+
+  c = &classes[p->owner];
+  pthread_mutex_lock(&c->lock);
+  if (p->live-- == c->perslab)
+    list_add(&c->partial, pg); /* Was full */
+  chunk->next = p->free;
+  p->free = chunk;
+  c->live--;
+
+  if (p->live == 0)
+  {
+    /* Empty: keep it as the spare, or give its pages back */
+    list_del(&c->partial, pg);
+    p->free = NULL;
+    p->carved = 0;
+    if (c->spare == NONE)
+      c->spare = pg;
+    else
+    {
+      c->nslabs--;
+      run_put(pg);
+    }
+  }
+  pthread_mutex_unlock(&c->lock);
+}
+
+/*
+ * slab_print_stats - write page use and per-class counts into buf
+ *     return the number of bytes written
+ */
+int slab_print_stats(char *buf, size_t size)
+{
+  size_t len = 0, used, dirty, large;
+  int i;
+
+  pthread_mutex_lock(&pool_lock);
+  used = npages - pool_free;
+  dirty = pool_dirty;
+  large = large_runs;
+  pthread_mutex_unlock(&pool_lock);
+  len += snprintf(buf, size,
+                  "slab pages %zu/%zu (%zu bytes), dirty %zu, large %zu\n",
+                  used, npages, used * PAGE, dirty, large);
+  if (len < size)
+    len += snprintf(buf + len, size - len, "class chunk slabs live\n");
+  for (i = 0; i < nclasses && len < size; i++)
+  {
+    slab_class_t *c = &classes[i];
+
+    pthread_mutex_lock(&c->lock);
+    if (c->nslabs)
+      len += snprintf(buf + len, size - len, "%d %zu %zu %zu\n", i, c->size,
+                      c->nslabs, c->live);
+    pthread_mutex_unlock(&c->lock);
+  }
+  return len < size ? len : size - 1;
+}
+
+/*
+ * class_of - the smallest class whose chunks hold size bytes
+ */
+static slab_class_t *class_of(size_t size)
+{
+  int lo = 0, hi = nclasses - 1, mid;
+
+  while (lo < hi)
+  {
+    mid = (lo + hi) / 2;
+    if (classes[mid].size < size)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return &classes[lo];
+}
+
+/*
+ * run_get - take len pages from the first free run big enough
+ *     return the first page, or NONE if no run is
+ */
+static size_t run_get(size_t len, int owner)
+{
+  size_t pg, rest;
+
+  pthread_mutex_lock(&pool_lock);
+  for (pg = pool; pg != NONE && pages[pg].len < len; pg = pages[pg].next)
+    ;
+  if (pg == NONE)
+  {
+    pthread_mutex_unlock(&pool_lock);
+    return NONE;
+  }
+
+  list_del(&pool, pg);
+  if (pages[pg].dirty)
+    pool_dirty -= pages[pg].len;
+  if ((rest = pages[pg].len - len) > 0)
+  {
+    set_run(pg + len, rest, RUN_FREE);
+    if ((pages[pg + len].dirty = pages[pg].dirty))
+      pool_dirty += rest;
+    list_add(&pool, pg + len);
+  }
+  set_run(pg, len, owner);
+  pool_free -= len;
+  if (owner == RUN_LARGE)
+    large_runs++;
+  pthread_mutex_unlock(&pool_lock);
+  return pg;
+}
+
+/*
+ * run_put - return the run starting at page pg to the pool, merging it
+ *     with free neighbours. The merged run counts as dirty.
+ */
+static void run_put(size_t pg)
+{
+  size_t len = pages[pg].len, n;
+
+  pthread_mutex_lock(&pool_lock);
+  if (pages[pg].owner == RUN_LARGE)
+    large_runs--;
+  pool_free += len;
+  n = pg + len;
+  if (n < npages && pages[n].owner == RUN_FREE)
+  {
+    list_del(&pool, n);
+    if (pages[n].dirty)
+      pool_dirty -= pages[n].len;
+    len += pages[n].len;
+  }
+  if (pg > 0 && pages[pages[pg - 1].head].owner == RUN_FREE)
+  {
+    n = pages[pg - 1].head;
+    list_del(&pool, n);
+    if (pages[n].dirty)
+      pool_dirty -= pages[n].len;
+    len += pages[n].len;
+    pg = n;
+  }
+  set_run(pg, len, RUN_FREE);
+  pages[pg].dirty = 1;
+  pool_dirty += len;
+  list_add(&pool, pg);
+  if (pool_dirty > dirty_max)
+    purge();
+  pthread_mutex_unlock(&pool_lock);
+}
+
+/*
+ * purge - drop every dirty free run from the resident set (caller
+ *     holds the pool lock)
+ */
+static void purge(void)
+{
+  size_t pg;
+
+  for (pg = pool; pg != NONE; pg = pages[pg].next)
+    if (pages[pg].dirty)
+    {
+      if (madvise(arena + pg * PAGE, pages[pg].len * PAGE, MADV_DONTNEED) < 0)
+        unix_error("madvise error");
+      pages[pg].dirty = 0;
+    }
+  pool_dirty = 0;
+}
+
+/*
+ * set_run - write the boundary tags of a run of len pages at pg. A
+ *     slab's pages all point at its first page, since chunks may lie in
+ *     any of them.
+ */
+static void set_run(size_t pg, size_t len, int owner)
+{
+  size_t i;
+
+  pages[pg].owner = owner;
+  pages[pg].len = len;
+  pages[pg].head = pg;
+  pages[pg + len - 1].head = pg;
+  if (owner >= 0)
+    for (i = 1; i < len; i++)
+      pages[pg + i].head = pg;
+}
+
+/*
+ * list_add - push page pg on the front of a page list
+ */
+static void list_add(size_t *head, size_t pg)
+{
+  pages[pg].prev = NONE;
+  pages[pg].next = *head;
+  if (*head != NONE)
+    pages[*head].prev = pg;
+  *head = pg;
+}
+
+/*
+ * list_del - unlink page pg from the page list it is on
+ */
+static void list_del(size_t *head, size_t pg)
+{
+  if (pages[pg].prev != NONE)
+    pages[pages[pg].prev].next = pages[pg].next;
+  else
+    *head = pages[pg].next;
+  if (pages[pg].next != NONE)
+    pages[pages[pg].next].prev = pages[pg].prev;
+}
@@ -0,0 +1,14 @@
+/*
+ * slab.h - size-class slab allocator for cache entries
+ */
+#ifndef __SLAB_H__
+#define __SLAB_H__
+
+#include <stddef.h>
+
+void slab_init(size_t budget);
+void *slab_alloc(size_t size);
+void slab_free(void *p);
+int slab_print_stats(char *buf, size_t size);
+
+#endif /* __SLAB_H__ */
@@ -0,0 +1,282 @@
+/*
+ * snapshot.c - memory cache snapshots for warm restarts
+ *
+ * snapshot_save() writes every object in the memory cache (cache.c) to
+ * a file: a header, then each key (with its NUL) followed by its object,
+ * then a table of fixed-size records sorted by key hash, each giving
+ * where its key and object are, the object's size, its cache_meta_t
+ * (age and expiry) and whether its CLOCK referenced bit was set. The
+ * file is written beside the old one and renamed over it, so a snapshot
+ * is either whole or absent.
+ *
+ * snapshot_load() maps a snapshot read-only at startup and only checks
+ * the record table, so it returns at once however large the snapshot.
+ * Objects are faulted in lazily: a cache lookup that misses asks
+ * snapshot_find(), which binary-searches the records and hands out each
+ * object once, for the cache to insert with its metadata and referenced
+ * bit. Pages of objects nobody asks for are not read until the next
+ * save, which copies those records from the mapping along with the
+ * cache's objects, so restarting again before they are asked for loses
+ * nothing. Only the pool and event engines look objects up in the
+ * cache, so only they fault snapshots in; the io_uring engine is a pure
+ * relay.
+ */
+#include <sys/mman.h>
+#include "csapp.h"
+#include "cache.h"
+#include "snapshot.h"
+
+#define SNAPSHOT_MAGIC "PXSNAP4" /* With its NUL, the first 8 bytes */
+
+typedef struct
+{
+  char magic[8];
+  unsigned long count;     /* Records */
+  unsigned long index_off; /* Of the record table */
+} snap_header_t;
+
+typedef struct
+{
+  unsigned long hash;
+  unsigned long off; /* Of the key; the object follows its NUL */
+  cache_meta_t meta;
+  unsigned int klen; /* With the NUL */
+  unsigned int size;
+  unsigned int referenced;
+  unsigned int pad;
+} snap_rec_t;
+
+/* State of a snapshot_save() in progress */
+typedef struct
+{
+  FILE *fp;
+  snap_rec_t *recs;
+  size_t n, cap;
+  unsigned long off; /* Bytes written so far */
+} saver_t;
+
+/* One save at a time */
+static pthread_mutex_t save_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* The snapshot loaded at startup */
+static const char *map;
+static size_t map_len;
+static const snap_rec_t *recs;
+static unsigned long nrecs;
+static char *taken; /* Per record: already handed to the cache */
+static unsigned long nfaulted, nsaved;
+
+static void save_one(void *arg, const char *key, unsigned long hash,
+                     const char *obj, size_t size, const cache_meta_t *meta,
+                     int referenced);
+static void save_untaken(saver_t *sv);
+static int by_hash(const void *a, const void *b);
+
+/*
+ * snapshot_save - write the memory cache's objects to path, replacing
+ *     the snapshot there
+ *     return the number of objects saved, or -1 on error
+ */
+int snapshot_save(const char *path)
+{
+  char tmp[MAXLINE], pad[sizeof(long)] = {0};
+  snap_header_t hdr;
+  saver_t sv = {NULL, NULL, 0, 0, sizeof(hdr)};
+  int ok;
+
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  pthread_mutex_lock(&save_lock);
+  if ((sv.fp = fopen(tmp, "w")) == NULL)
+  {
+    pthread_mutex_unlock(&save_lock);
+    return -1;
+  }
+  memset(&hdr, 0, sizeof(hdr));
+  ok = fwrite(&hdr, sizeof(hdr), 1, sv.fp) == 1;
+  save_untaken(&sv);
+  cache_walk(save_one, &sv);
+
+  /* The record table, aligned for reading in place */
+  qsort(sv.recs, sv.n, sizeof(snap_rec_t), by_hash);
+  memcpy(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic));
+  hdr.count = sv.n;
+  hdr.index_off = (sv.off + sizeof(long) - 1) & ~(sizeof(long) - 1);
+  ok = ok && fwrite(pad, 1, hdr.index_off - sv.off, sv.fp) ==
+                 hdr.index_off - sv.off &&
+       fwrite(sv.recs, sizeof(snap_rec_t), sv.n, sv.fp) == sv.n &&
+       fseek(sv.fp, 0, SEEK_SET) == 0 &&
+       fwrite(&hdr, sizeof(hdr), 1, sv.fp) == 1 && fflush(sv.fp) == 0 &&
+       fsync(fileno(sv.fp)) == 0 && !ferror(sv.fp);
+  ok = fclose(sv.fp) == 0 && ok;
+  free(sv.recs);
+  if (!ok || rename(tmp, path) < 0)
+  {
+    unlink(tmp);
+    pthread_mutex_unlock(&save_lock);
+    return -1;
+  }
+  __atomic_store_n(&nsaved, sv.n, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&save_lock);
+  return sv.n;
+}
+
+/*
+ * snapshot_load - map the snapshot at path for snapshot_find()
+ *     return the number of objects in it, or -1 if there is no valid
+ *     snapshot there
+ */
+int snapshot_load(const char *path)
+{
+  const snap_header_t *hdr;
+  struct stat st;
+  unsigned long i;
+  int fd;
+
+  if ((fd = open(path, O_RDONLY)) < 0)
+    return -1;
+  if (fstat(fd, &st) < 0 || st.st_size < sizeof(snap_header_t) ||
+      (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) ==
+          MAP_FAILED)
+  {
+    map = NULL;
+    close(fd);
+    return -1;
+  }
+  close(fd); /* The mapping keeps the file */
+  map_len = st.st_size;
+
+  /* Check the header and records, not the objects */
+  hdr = (const snap_header_t *)map;
+  if (memcmp(hdr->magic, SNAPSHOT_MAGIC, sizeof(hdr->magic)) ||
+      hdr->index_off > map_len || hdr->index_off % sizeof(long) ||
+      hdr->count > (map_len - hdr->index_off) / sizeof(snap_rec_t))
+    goto bad;
+  recs = (const snap_rec_t *)(map + hdr->index_off);
+  for (i = 0; i < hdr->count; i++)
+    if (recs[i].klen == 0 || recs[i].off < sizeof(snap_header_t) ||
+        recs[i].off > hdr->index_off ||
+        recs[i].off + recs[i].klen + recs[i].size > hdr->index_off ||
+        (i > 0 && recs[i].hash < recs[i - 1].hash))
+      goto bad;
+  nrecs = hdr->count;
+  taken = Calloc(nrecs ? nrecs : 1, 1);
+  return nrecs;
+
+bad:
+  munmap((void *)map, map_len);
+  map = NULL;
+  recs = NULL;
+  return -1;
+}
+
+/*
+ * snapshot_find - hand out key's object from the loaded snapshot, if it
+ *     is there and has not been handed out before. *obj points into the
+ *     mapping, which stays for the life of the process.
+ *     return 1 if found, 0 if not
+ */
+int snapshot_find(const char *key, unsigned long h, const char **obj,
+                  size_t *size, cache_meta_t *meta, int *referenced)
+{
+  unsigned long lo = 0, hi = nrecs, mid;
+  const char *k;
+
+  if (nrecs == 0)
+    return 0;
+  while (lo < hi) /* First record with a hash >= h */
+  {
+    mid = lo + (hi - lo) / 2;
+    if (recs[mid].hash < h)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  for (; lo < nrecs && recs[lo].hash == h; lo++)
+  {
+    k = map + recs[lo].off;
+    if (k[recs[lo].klen - 1] != '\0' || strcmp(k, key))
+      continue;
+    if (__atomic_exchange_n(&taken[lo], 1, __ATOMIC_RELAXED))
+      return 0; /* Another lookup has it */
+    *obj = k + recs[lo].klen;
+    *size = recs[lo].size;
+    *meta = recs[lo].meta;
+    *referenced = recs[lo].referenced;
+    __atomic_add_fetch(&nfaulted, 1, __ATOMIC_RELAXED);
+    return 1;
+  }
+  return 0;
+}
+
+/*
+ * snapshot_print_stats - write the snapshot counters into buf
+ *     return the number of bytes written
+ */
+int snapshot_print_stats(char *buf, size_t size)
+{
+  int n = snprintf(buf, size, "snapshot loaded %lu faulted %lu saved %lu\n",
+                   nrecs, __atomic_load_n(&nfaulted, __ATOMIC_RELAXED),
+                   __atomic_load_n(&nsaved, __ATOMIC_RELAXED));
+
+  return n < size ? n : size - 1;
+}
+
+/*
+ * save_one - cache_walk() callback: append one object and its record
+ */
+static void save_one(void *arg, const char *key, unsigned long hash,
+                     const char *obj, size_t size, const cache_meta_t *meta,
+                     int referenced)
+{
+  saver_t *sv = arg;
+  size_t klen = strlen(key) + 1;
+  snap_rec_t *r;
+
+  if (fwrite(key, 1, klen, sv->fp) != klen ||
+      fwrite(obj, 1, size, sv->fp) != size)
+    return; /* ferror() fails the save */
+  if (sv->n == sv->cap)
+  {
+    sv->cap = sv->cap ? 2 * sv->cap : 256;
+    sv->recs = Realloc(sv->recs, sv->cap * sizeof(snap_rec_t));
+  }
+  r = &sv->recs[sv->n++];
+  r->hash = hash;
+  r->off = sv->off;
+  r->meta = *meta;
+  r->klen = klen;
+  r->size = size;
+  r->referenced = referenced;
+  r->pad = 0;
+  sv->off += klen + size;
+}
+
+/*
+ * save_untaken - append the records of the loaded snapshot that no
+ *     lookup has asked for yet, from the mapping. They go first: one
+ *     taken meanwhile is then written again from the cache rather than
+ *     not at all, and snapshot_find() hands out only the first copy.
+ */
+static void save_untaken(saver_t *sv)
+{
+  unsigned long i;
+  const char *k;
+
+  for (i = 0; i < nrecs; i++)
+  {
+    k = map + recs[i].off;
+    if (__atomic_load_n(&taken[i], __ATOMIC_RELAXED) ||
+        k[recs[i].klen - 1] != '\0')
+      continue;
+    save_one(sv, k, recs[i].hash, k + recs[i].klen, recs[i].size,
+             &recs[i].meta, recs[i].referenced);
+  }
+}
+
+static int by_hash(const void *a, const void *b)
+{
+  unsigned long x = ((const snap_rec_t *)a)->hash;
+  unsigned long y = ((const snap_rec_t *)b)->hash;
+
+  return x < y ? -1 : x > y;
+}
@@ -0,0 +1,16 @@
+/*
+ * snapshot.h - memory cache snapshots for warm restarts
+ */
+#ifndef __SNAPSHOT_H__
+#define __SNAPSHOT_H__
+
+#include <stddef.h>
+#include "cache.h"
+
+int snapshot_save(const char *path);
+int snapshot_load(const char *path);
+int snapshot_find(const char *key, unsigned long h, const char **obj,
+                  size_t *size, cache_meta_t *meta, int *referenced);
+int snapshot_print_stats(char *buf, size_t size);
+
+#endif /* __SNAPSHOT_H__ */
@@ -0,0 +1,284 @@
+/*
+ * test_parse.c - the incremental request parser (http.c) on requests
+ *     split at every possible read boundary
+ *
+ * usage: ./test_parse
+ *
+ * Each sample request is described as "method|uri|version|name=value|..."
+ * from the spans the parser returns, and the description must be the
+ * same however the bytes arrive. Checks:
+ *
+ *   - a whole request parses in one call to the expected spans
+ *   - split in two at every offset, and fed one byte at a time, the
+ *     parser asks for more until the end and then gives the same spans
+ *   - bytes moved to another buffer between calls keep their spans
+ *   - http_readb() over a pipe returns pipelined requests in order for
+ *     every buffer size from the largest request up, compacting the
+ *     buffer as it fills, and the bytes behind each header block stay
+ *     buffered for the caller
+ *   - malformed and oversized header blocks are rejected
+ */
+#include "csapp.h"
+#include "http.h"
+
+typedef struct
+{
+  const char *raw;
+  const char *want; /* Description of the parsed spans */
+} sample_t;
+
+static const sample_t samples[] = {
+    {"GET http://localhost:15213/home.html HTTP/1.1\r\n"
+     "Host: localhost:15213\r\n"
+     "User-Agent: curl/8.0\r\n"
+     "Accept: */*\r\n"
+     "Proxy-Connection: Keep-Alive\r\n"
+     "\r\n",
+     "GET|http://localhost:15213/home.html|HTTP/1.1|Host=localhost:15213|"
+     "User-Agent=curl/8.0|Accept=*/*|Proxy-Connection=Keep-Alive"},
+    {"GET /cgi-bin/adder?1&2 HTTP/1.0\n"
+     "Host: tiny\n"
+     "X-Padded: \t value with spaces \t\n"
+     "\n",
+     "GET|/cgi-bin/adder?1&2|HTTP/1.0|Host=tiny|X-Padded=value with spaces"},
+    {"\r\n"
+     "POST /form HTTP/1.1\r\n"
+     "Connection: keep-alive, Upgrade\r\n"
+     "Empty:\r\n"
+     "Content-Length: 0\r\n"
+     "\r\n",
+     "POST|/form|HTTP/1.1|Connection=keep-alive, Upgrade|Empty=|"
+     "Content-Length=0"},
+};
+#define NSAMPLES (sizeof(samples) / sizeof(samples[0]))
+
+static int failures;
+
+static void describe(const http_req_t *req, char *out, size_t size);
+static int parses_to(http_req_t *req, const char *buf, size_t len,
+                     const char *want);
+static void check_splits(const sample_t *s);
+static void check_readb(void);
+static void check_bad(void);
+static void check_dates(void);
+static void check(int ok, char *what);
+
+int main(void)
+{
+  http_req_t req;
+  http_span_t v = {"keep-alive, Upgrade", 19};
+  size_t i;
+  int ok;
+
+  for (ok = 1, i = 0; i < NSAMPLES; i++)
+  {
+    http_init(&req);
+    ok &= parses_to(&req, samples[i].raw, strlen(samples[i].raw),
+                    samples[i].want);
+  }
+  check(ok, "whole requests parse to the expected spans");
+
+  for (i = 0; i < NSAMPLES; i++)
+    check_splits(&samples[i]);
+  check_readb();
+  check_bad();
+
+  check(http_has_token(&v, "upgrade") && http_has_token(&v, "KEEP-ALIVE") &&
+            !http_has_token(&v, "keep"),
+        "header tokens match whole, ignoring case");
+  check_dates();
+
+  printf(failures ? "FAILED %d\n" : "PASSED\n", failures);
+  return failures != 0;
+}
+
+/*
+ * check_splits - feed s in two parts split at every offset, one byte at
+ *     a time, and moved to another buffer partway
+ */
+static void check_splits(const sample_t *s)
+{
+  size_t len = strlen(s->raw), k;
+  char moved[MAXBUF + 1], what[MAXLINE];
+  http_req_t req;
+  int ok = 1, bytewise = 1, rebased = 1;
+
+  for (k = 0; k < len; k++)
+  {
+    http_init(&req);
+    ok &= http_parse(&req, s->raw, k) == HTTP_MORE;
+    ok &= parses_to(&req, s->raw, len, s->want);
+
+    /* The first k bytes parsed in place, the rest after moving them all
+       one byte along */
+    http_init(&req);
+    memcpy(moved, s->raw, len);
+    rebased &= http_parse(&req, moved, k) == HTTP_MORE;
+    memmove(moved + 1, moved, len);
+    rebased &= parses_to(&req, moved + 1, len, s->want);
+  }
+  http_init(&req);
+  for (k = 1; k < len; k++)
+    bytewise &= http_parse(&req, s->raw, k) == HTTP_MORE;
+  bytewise &= parses_to(&req, s->raw, len, s->want);
+
+  snprintf(what, sizeof(what), "split at every offset: %.*s", 24,
+           s->want);
+  check(ok, what);
+  check(bytewise, "  fed one byte at a time");
+  check(rebased, "  moved between calls");
+}
+
+/*
+ * check_readb - all the samples pipelined through a pipe, read with
+ *     buffers from the largest request's size up
+ */
+static void check_readb(void)
+{
+  char buf[256], all[MAXBUF], *bufptr, desc[MAXLINE];
+  size_t size, total = 0, max = 0, len, i;
+  int fds[2], cnt, ok = 1, body = 1;
+  http_req_t req;
+  ssize_t n;
+
+  for (i = 0; i < NSAMPLES; i++)
+  {
+    len = strlen(samples[i].raw);
+    memcpy(all + total, samples[i].raw, len);
+    total += len;
+    max = len > max ? len : max;
+    all[total++] = '#'; /* A one-byte "body" after each request */
+  }
+
+  for (size = max; size <= sizeof(buf); size++)
+  {
+    if (pipe(fds) < 0)
+      unix_error("pipe error");
+    Rio_writen(fds[1], all, total);
+    Close(fds[1]);
+    bufptr = buf;
+    cnt = 0;
+    for (i = 0; i < NSAMPLES; i++)
+    {
+      if ((n = http_readb(fds[0], buf, size, &bufptr, &cnt, &req)) <= 0)
+      {
+        ok = body = 0;
+        break;
+      }
+      describe(&req, desc, sizeof(desc));
+      ok &= n == (ssize_t)strlen(samples[i].raw) &&
+            !strcmp(desc, samples[i].want);
+
+      /* Consume the body byte as a rio reader would */
+      if (cnt == 0)
+      {
+        bufptr = buf;
+        cnt = read(fds[0], buf, size);
+      }
+      body &= cnt > 0 && *bufptr == '#';
+      bufptr++;
+      cnt--;
+    }
+    ok &= http_readb(fds[0], buf, size, &bufptr, &cnt, &req) == 0;
+    Close(fds[0]);
+  }
+  check(ok, "http_readb() returns pipelined requests at any buffer size");
+  check(body, "  and leaves what follows each header block buffered");
+}
+
+/*
+ * check_bad - malformed header blocks, too many headers, and a block
+ *     larger than the read buffer
+ */
+static void check_bad(void)
+{
+  static const char *bad[] = {
+      "GET /\r\n\r\n",                        /* Two tokens */
+      "GET  / HTTP/1.1\r\n\r\n",              /* Empty URI */
+      "GET / HTTP/1.1 x\r\n\r\n",             /* Four tokens */
+      "GET / HTTP/1.1\rHost: x\r\n\r\n",      /* Bare CR */
+      "GET / HTTP/1.1\r\nHost x\r\n\r\n",     /* No colon */
+      "GET / HTTP/1.1\r\nHost : x\r\n\r\n",   /* Space before the colon */
+      "GET / HTTP/1.1\r\nA: 1\r\n folded\r\n\r\n",
+      "GET / HTTP/1.1\r\n: x\r\n\r\n",        /* No name */
+  };
+  char many[MAXBUF], buf[64], *bufptr = buf;
+  http_req_t req;
+  size_t i, len;
+  int ok = 1, fds[2], cnt = 0;
+
+  for (i = 0; i < sizeof(bad) / sizeof(bad[0]); i++)
+  {
+    http_init(&req);
+    ok &= http_parse(&req, bad[i], strlen(bad[i])) == HTTP_BAD;
+  }
+  check(ok, "malformed header blocks are rejected");
+
+  len = sprintf(many, "GET / HTTP/1.1\r\n");
+  for (i = 0; i <= HTTP_MAX_HEADERS; i++)
+    len += sprintf(many + len, "X-%zu: %zu\r\n", i, i);
+  len += sprintf(many + len, "\r\n");
+  http_init(&req);
+  check(http_parse(&req, many, len) == HTTP_BAD,
+        "more than HTTP_MAX_HEADERS headers are rejected");
+
+  if (pipe(fds) < 0)
+    unix_error("pipe error");
+  Rio_writen(fds[1], many, len);
+  Close(fds[1]);
+  check(http_readb(fds[0], buf, sizeof(buf), &bufptr, &cnt, &req) ==
+            HTTP_BAD,
+        "a header block larger than the buffer is rejected");
+  Close(fds[0]);
+}
+
+/*
+ * check_dates - HTTP dates round-trip, and other forms are refused
+ */
+static void check_dates(void)
+{
+  const char *d = "Sun, 06 Nov 1994 08:49:37 GMT";
+  char buf[64];
+
+  check(http_parse_date(d, strlen(d)) == 784111777 &&
+            http_format_date(buf, sizeof(buf), 784111777) == strlen(d) &&
+            !strcmp(buf, d),
+        "IMF-fixdate dates parse and format");
+  check(http_parse_date(d, strlen(d) - 4) == -1 &&
+            http_parse_date("Sunday, 06-Nov-94 08:49:37 GMT", 30) == -1 &&
+            http_parse_date("Sun, 06 Xyz 1994 08:49:37 GMT", 29) == -1,
+        "  truncated, obsolete and misspelt dates are refused");
+}
+
+/*
+ * parses_to - carry on parsing buf and compare the result with want
+ */
+static int parses_to(http_req_t *req, const char *buf, size_t len,
+                     const char *want)
+{
+  char desc[MAXLINE];
+
+  if (http_parse(req, buf, len) != (ssize_t)len)
+    return 0;
+  describe(req, desc, sizeof(desc));
+  return !strcmp(desc, want);
+}
+
+static void describe(const http_req_t *req, char *out, size_t size)
+{
+  int i, n;
+
+  n = snprintf(out, size, "%.*s|%.*s|%.*s", (int)req->method.len,
+               req->method.p, (int)req->uri.len, req->uri.p,
+               (int)req->version.len, req->version.p);
+  for (i = 0; i < req->nheaders && n < size; i++)
+    n += snprintf(out + n, size - n, "|%.*s=%.*s",
+                  (int)req->headers[i].name.len, req->headers[i].name.p,
+                  (int)req->headers[i].value.len, req->headers[i].value.p);
+}
+
+static void check(int ok, char *what)
+{
+  printf("%s %s\n", ok ? "ok  " : "FAIL", what);
+  failures += !ok;
+}
@@ -0,0 +1,192 @@
+/*
+ * test_resolver.c - the asynchronous resolver against /etc/hosts, with
+ *     a delay injected into every lookup
+ *
+ * usage: ./test_resolver
+ *
+ * getaddrinfo() is wrapped at link time (-Wl,--wrap=getaddrinfo) to
+ * count calls and sleep DELAY_MS first, standing in for a slow DNS
+ * server; the names themselves come from the IPv4 entries of
+ * /etc/hosts, so the answers are known without any network. Checks:
+ *
+ *   - submitting never waits for a lookup
+ *   - each name is submitted twice but looked up once, and distinct
+ *     names are looked up in parallel on the resolver threads
+ *   - results arrive through the eventfd with the address listed in
+ *     /etc/hosts; a name under .invalid fails
+ *   - a cancelled request's callback never runs
+ *   - afterwards dns_peek() answers every name without a lookup
+ */
+#include <poll.h>
+#include "csapp.h"
+#include "dns.h"
+#include "resolver.h"
+
+#define DELAY_MS 100 /* Injected into every getaddrinfo() */
+#define MAXNAMES 16  /* Names taken from /etc/hosts */
+#define BADNAME "nosuch.invalid"
+
+typedef struct
+{
+  char name[MAXLINE];
+  struct in_addr addr; /* Listed address; unused for BADNAME */
+  int ncalls;          /* Callbacks received */
+  int err;             /* From the last callback */
+  int found;           /* The listed address was in the result */
+} expect_t;
+
+int __real_getaddrinfo(const char *node, const char *service,
+                       const struct addrinfo *hints, struct addrinfo **res);
+
+static expect_t names[MAXNAMES + 1];
+static int nnames, lookups, failures;
+
+static void load_hosts(void);
+static void resolved(void *arg, int err, struct addrinfo *res);
+static void check(int ok, char *what);
+static double now_ms(void);
+
+int __wrap_getaddrinfo(const char *node, const char *service,
+                       const struct addrinfo *hints, struct addrinfo **res)
+{
+  __atomic_add_fetch(&lookups, 1, __ATOMIC_RELAXED);
+  usleep(DELAY_MS * 1000);
+  return __real_getaddrinfo(node, service, hints, res);
+}
+
+int main(void)
+{
+  struct pollfd pfd;
+  struct addrinfo *res;
+  expect_t cancelled;
+  resolver_req_t *req;
+  double start, submitted, elapsed;
+  int i, pending, rc, ok;
+
+  load_hosts();
+  strcpy(names[nnames].name, BADNAME);
+  nnames++;
+  printf("%d names from /etc/hosts, %d ms per lookup, %d threads\n",
+         nnames - 1, DELAY_MS, RESOLVER_THREADS);
+
+  pfd.fd = resolver_init(RESOLVER_THREADS);
+  pfd.events = POLLIN;
+
+  /* Every name twice, plus one request that is cancelled at once */
+  start = now_ms();
+  for (i = 0; i < 2 * nnames; i++)
+    resolver_submit(names[i % nnames].name, "80", &names[i % nnames]);
+  memset(&cancelled, 0, sizeof(cancelled));
+  req = resolver_submit(names[0].name, "80", &cancelled);
+  resolver_cancel(req);
+  submitted = now_ms() - start;
+  check(submitted < DELAY_MS / 10, "submitting does not wait for lookups");
+
+  for (pending = 2 * nnames; pending > 0;)
+  {
+    if (poll(&pfd, 1, 10 * DELAY_MS * nnames) <= 0)
+      break;
+    resolver_complete(resolved);
+    for (pending = 2 * nnames, i = 0; i < nnames; i++)
+      pending -= names[i].ncalls;
+  }
+  elapsed = now_ms() - start;
+  printf("all callbacks after %.0f ms, %d lookups\n", elapsed, lookups);
+  check(pending == 0, "every request completes through the eventfd");
+  check(lookups == nnames, "concurrent requests for a name share a lookup");
+  check(elapsed < DELAY_MS * ((nnames + RESOLVER_THREADS - 1) /
+                                  RESOLVER_THREADS + 1),
+        "distinct names resolve in parallel");
+
+  for (ok = 1, i = 0; i < nnames - 1; i++)
+    ok &= names[i].ncalls == 2 && names[i].err == 0 && names[i].found;
+  check(ok, "results carry the addresses listed in /etc/hosts");
+  check(names[nnames - 1].err != 0, "a name under .invalid fails");
+
+  /* The cancelled request may finish after the others; wait it out */
+  poll(&pfd, 1, 2 * DELAY_MS);
+  resolver_complete(resolved);
+  check(cancelled.ncalls == 0, "a cancelled request gets no callback");
+
+  for (ok = 1, i = 0; i < nnames; i++)
+  {
+    rc = dns_peek(names[i].name, "80", &res);
+    if (i == nnames - 1)
+      ok &= rc != 0 && rc != DNS_MISS;
+    else
+    {
+      ok &= rc == 0;
+      if (rc == 0)
+        dns_freeaddrinfo(res);
+    }
+  }
+  check(ok && lookups == nnames, "the cache answers afterwards");
+
+  printf(failures ? "FAILED %d\n" : "PASSED\n", failures);
+  return failures != 0;
+}
+
+/*
+ * resolved - callback: record the outcome for the expected name
+ */
+static void resolved(void *arg, int err, struct addrinfo *res)
+{
+  expect_t *e = arg;
+  struct addrinfo *p;
+
+  e->ncalls++;
+  if ((e->err = err) != 0)
+    return;
+  for (p = res; p; p = p->ai_next)
+    if (p->ai_family == AF_INET &&
+        ((struct sockaddr_in *)p->ai_addr)->sin_addr.s_addr ==
+            e->addr.s_addr)
+      e->found = 1;
+  dns_freeaddrinfo(res);
+}
+
+/*
+ * load_hosts - take up to MAXNAMES distinct names with an IPv4 address
+ *     from /etc/hosts
+ */
+static void load_hosts(void)
+{
+  FILE *fp = Fopen("/etc/hosts", "r");
+  char line[MAXLINE], *tok, *save;
+  struct in_addr addr;
+  int i;
+
+  while (nnames < MAXNAMES && Fgets(line, sizeof(line), fp))
+  {
+    line[strcspn(line, "#")] = '\0';
+    if ((tok = strtok_r(line, " \t\n", &save)) == NULL ||
+        inet_pton(AF_INET, tok, &addr) != 1)
+      continue;
+    while (nnames < MAXNAMES && (tok = strtok_r(NULL, " \t\n", &save)))
+    {
+      for (i = 0; i < nnames && strcasecmp(names[i].name, tok); i++)
+        ;
+      if (i < nnames || strlen(tok) >= MAXLINE)
+        continue;
+      strcpy(names[nnames].name, tok);
+      names[nnames++].addr = addr;
+    }
+  }
+  Fclose(fp);
+  if (nnames == 0)
+    app_error("no IPv4 names in /etc/hosts");
+}
+
+static void check(int ok, char *what)
+{
+  printf("%s %s\n", ok ? "ok  " : "FAIL", what);
+  failures += !ok;
+}
+
+static double now_ms(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
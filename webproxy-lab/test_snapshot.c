@@ -0,0 +1,98 @@
+/*
+ * test_snapshot.c - warm restarts from cache snapshots (snapshot.c)
+ *
+ * usage: ./test_snapshot
+ *
+ * Each "run" of the proxy is a fresh child process that starts a cache,
+ * loads the snapshot file if asked, optionally looks the object up,
+ * and saves the snapshot again the way SIGTERM does. Checks:
+ *
+ *   - a cached object is saved and served after a restart
+ *   - a restart with no traffic saves the loaded object again, so it
+ *     is still served after a second restart
+ *   - an object faulted in before a save is written once, not twice
+ */
+#include "csapp.h"
+#include "proxy.h"
+#include "cache.h"
+#include "snapshot.h"
+
+#define KEY "http://origin:15213/warm.html"
+#define OBJ_SIZE 11184
+#define TTL 3600 /* Fresh for the whole test */
+
+/* What a run does before saving */
+#define RUN_INSERT 1 /* Cache the object */
+#define RUN_LOAD 2   /* Warm-start from the snapshot */
+#define RUN_LOOKUP 4 /* Ask for the object; exit 255 unless served intact */
+
+static char obj[OBJ_SIZE];
+static cache_meta_t meta; /* Saved and restored with obj */
+static char path[MAXLINE];
+static int failures;
+
+static int run(int what);
+static void check(int ok, char *what);
+
+int main(void)
+{
+  int i;
+
+  for (i = 0; i < OBJ_SIZE; i++)
+    obj[i] = 'a' + i % 26;
+  meta.born = time(NULL);
+  meta.expires = meta.born + TTL;
+  snprintf(path, sizeof(path), "/tmp/test_snapshot.%d", (int)getpid());
+
+  check(run(RUN_INSERT) == 1, "a cached object is saved");
+  check(run(RUN_LOAD | RUN_LOOKUP) == 1,
+        "  served after a restart, and saved again once");
+  check(run(RUN_LOAD) == 1, "a restart with no traffic keeps it");
+  check(run(RUN_LOAD) == 1, "  and so does another");
+  check(run(RUN_LOAD | RUN_LOOKUP) == 1,
+        "  after which it is still served");
+
+  unlink(path);
+  printf("%s\n", failures ? "FAILED" : "PASSED");
+  return failures != 0;
+}
+
+/*
+ * run - one proxy lifetime in a child process
+ *     return the number of objects it saved, or 255 if a lookup failed
+ */
+static int run(int what)
+{
+  cache_meta_t got;
+  size_t size;
+  char *copy;
+  int status;
+  pid_t pid;
+
+  fflush(stdout); /* Or the child's exit() prints it again */
+  if ((pid = Fork()) == 0)
+  {
+    cache_init(1, 0);
+    if (what & RUN_LOAD)
+      snapshot_load(path);
+    if (what & RUN_INSERT)
+      cache_insert(KEY, obj, OBJ_SIZE, &meta);
+    if (what & RUN_LOOKUP)
+    {
+      copy = cache_lookup(KEY, &size, &got);
+      if (!copy || size != OBJ_SIZE || memcmp(copy, obj, size) ||
+          got.expires != meta.expires)
+        exit(255);
+      Free(copy);
+    }
+    exit(snapshot_save(path));
+  }
+  Waitpid(pid, &status, 0);
+  return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+static void check(int ok, char *what)
+{
+  printf("%s %s\n", ok ? "ok  " : "FAIL", what);
+  failures += !ok;
+}
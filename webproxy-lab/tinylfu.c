@@ -0,0 +1,184 @@
+/*
+ * tinylfu.c - TinyLFU frequency sketch for cache admission
+ *
+ * Estimates how often each key hash has been requested recently, so the
+ * cache can refuse a new object that is requested less often than the
+ * entry it would evict. A crawler that fetches every URL once then
+ * leaves the hot set alone.
+ *
+ * The estimate comes from two structures. A doorkeeper Bloom filter
+ * absorbs the first request for a key, so the many keys seen only once
+ * never reach the counters. Later requests go to a Count-Min sketch of
+ * DEPTH rows of 4-bit saturating counters, and a key's estimate is its
+ * smallest counter (plus one if the doorkeeper has it). After SAMPLE
+ * recorded requests every counter is halved and the doorkeeper is
+ * cleared, so the sketch follows changes in popularity.
+ *
+ * Lookups must not write memory shared with other cores, so requests
+ * are first appended to a small per-thread buffer. A full buffer is
+ * applied to the sketch if its lock is free and dropped if it is not:
+ * the sketch is only a sample. tinylfu_admit() runs on the insert path
+ * and applies the caller's buffer first, so the candidate's own miss is
+ * counted.
+ */
+#include "csapp.h"
+#include "epoch.h"
+#include "tinylfu.h"
+
+#define WIDTH_BITS 13              /* Counters per row: 8192 */
+#define WIDTH (1UL << WIDTH_BITS)
+#define DEPTH 4                    /* Rows of the Count-Min sketch */
+#define DOOR_BITS (WIDTH * 8)      /* Bits in the doorkeeper */
+#define SAMPLE (WIDTH * 10)        /* Recorded requests between agings */
+#define BUFSIZE 16                 /* Requests buffered per thread */
+
+typedef struct
+{
+  unsigned long h[BUFSIZE];
+  int n;
+} __attribute__((aligned(64))) tinylfu_buf_t;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned char counters[DEPTH][WIDTH / 2]; /* Two 4-bit counters */
+static unsigned long door[DOOR_BITS / 64];
+static unsigned long additions; /* Requests recorded since the last aging */
+static tinylfu_buf_t bufs[EPOCH_MAX_THREADS];
+
+/* Odd multipliers that spread a hash differently for each row */
+static const unsigned long seeds[DEPTH] = {
+    0x9E3779B97F4A7C15UL, 0xC2B2AE3D27D4EB4FUL, 0x165667B19E3779F9UL,
+    0xD6E8FEB86659FD93UL};
+
+static void drain(tinylfu_buf_t *b);
+static void increment(unsigned long h);
+static int estimate(unsigned long h);
+static int door_test(unsigned long h, int set);
+static void age(void);
+
+/*
+ * tinylfu_init - start with an empty sketch
+ */
+void tinylfu_init(void)
+{
+  memset(counters, 0, sizeof(counters));
+  memset(door, 0, sizeof(door));
+  memset(bufs, 0, sizeof(bufs));
+  additions = 0;
+}
+
+/*
+ * tinylfu_record - note one request for key hash h
+ */
+void tinylfu_record(unsigned long h)
+{
+  tinylfu_buf_t *b = &bufs[epoch_thread_id()];
+
+  b->h[b->n++] = h;
+  if (b->n < BUFSIZE)
+    return;
+  if (pthread_mutex_trylock(&lock) == 0)
+  {
+    drain(b);
+    pthread_mutex_unlock(&lock);
+  }
+  b->n = 0; /* Applied, or dropped because the sketch was busy */
+}
+
+/*
+ * tinylfu_admit - true if key hash candidate is requested more often
+ *     than the victim it would replace
+ */
+int tinylfu_admit(unsigned long candidate, unsigned long victim)
+{
+  int c, v;
+
+  pthread_mutex_lock(&lock);
+  drain(&bufs[epoch_thread_id()]);
+  c = estimate(candidate);
+  v = estimate(victim);
+  pthread_mutex_unlock(&lock);
+  return c > v;
+}
+
+/*
+ * drain - apply a thread's buffered requests (caller holds the lock)
+ */
+static void drain(tinylfu_buf_t *b)
+{
+  int i;
+
+  for (i = 0; i < b->n; i++)
+    increment(b->h[i]);
+  b->n = 0;
+}
+
+static void increment(unsigned long h)
+{
+  int i;
+
+  if (++additions >= SAMPLE)
+    age();
+  if (!door_test(h, 1))
+    return; /* First sighting: only the doorkeeper learns it */
+
+  for (i = 0; i < DEPTH; i++)
+  {
+    unsigned long j = (h * seeds[i]) >> (64 - WIDTH_BITS);
+    unsigned char *c = &counters[i][j / 2];
+    int shift = (j & 1) * 4;
+
+    if (((*c >> shift) & 0xF) < 0xF)
+      *c += 1 << shift;
+  }
+}
+
+/*
+ * estimate - approximate recent request count of hash h
+ */
+static int estimate(unsigned long h)
+{
+  int i, min = 0xF;
+
+  for (i = 0; i < DEPTH; i++)
+  {
+    unsigned long j = (h * seeds[i]) >> (64 - WIDTH_BITS);
+    int c = (counters[i][j / 2] >> ((j & 1) * 4)) & 0xF;
+
+    if (c < min)
+      min = c;
+  }
+  return min + door_test(h, 0);
+}
+
+/*
+ * door_test - true if the doorkeeper may contain h; sets h's bits too
+ *     when set is nonzero (returning whether they were already set)
+ */
+static int door_test(unsigned long h, int set)
+{
+  unsigned long a = h % DOOR_BITS, b = (h >> 32) % DOOR_BITS;
+  int seen = ((door[a / 64] >> (a % 64)) & 1) &&
+             ((door[b / 64] >> (b % 64)) & 1);
+
+  if (set)
+  {
+    door[a / 64] |= 1UL << (a % 64);
+    door[b / 64] |= 1UL << (b % 64);
+  }
+  return seen;
+}
+
+/*
+ * age - halve every counter and forget the doorkeeper
+ */
+static void age(void)
+{
+  int i;
+  size_t j;
+
+  for (i = 0; i < DEPTH; i++)
+    for (j = 0; j < WIDTH / 2; j++)
+      counters[i][j] = (counters[i][j] >> 1) & 0x77;
+  memset(door, 0, sizeof(door));
+  additions /= 2;
+}
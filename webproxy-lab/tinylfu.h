@@ -0,0 +1,11 @@
+/*
+ * tinylfu.h - TinyLFU frequency sketch for cache admission
+ */
+#ifndef __TINYLFU_H__
+#define __TINYLFU_H__
+
+void tinylfu_init(void);
+void tinylfu_record(unsigned long h);
+int tinylfu_admit(unsigned long candidate, unsigned long victim);
+
+#endif /* __TINYLFU_H__ */
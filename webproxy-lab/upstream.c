@@ -0,0 +1,212 @@
+/*
+ * upstream.c - pool of idle keep-alive connections to origin servers
+ *
+ * After a response whose framing left the origin connection open and in
+ * sync, the worker parks the connection here under its "host:port"
+ * instead of closing it, and the next request for that origin takes it
+ * back rather than opening a new connection (over the addresses cached
+ * by dns.c).
+ *
+ * Each origin keeps at most UPSTREAM_MAX_IDLE idle connections, newest
+ * last; parking one more closes the oldest. Connections idle longer
+ * than UPSTREAM_IDLE_TIMEOUT seconds are closed, by a sweep over every
+ * origin at most once a second and again when they are taken. Before a
+ * connection is handed out it is checked with a non-blocking MSG_PEEK:
+ * an origin that has closed its end (or sent bytes nobody asked for)
+ * shows up there, and the connection is dropped for the next one.
+ *
+ * A connection can still die between the check and the request, so the
+ * caller is told whether it got a reused connection and should retry
+ * once on a fresh one if the origin sends nothing back.
+ */
+#include "csapp.h"
+#include "upstream.h"
+#include "dns.h"
+
+#define NBUCKETS 64 /* Hash buckets of the origin table */
+
+typedef struct
+{
+  int fd;
+  time_t since; /* When it was parked */
+} idle_conn_t;
+
+typedef struct origin
+{
+  char key[MAXLINE]; /* "host:port" */
+  idle_conn_t idle[UPSTREAM_MAX_IDLE];
+  int nidle;
+  struct origin *next;
+} origin_t;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static origin_t *buckets[NBUCKETS];
+static time_t last_sweep;
+static unsigned long nreused, nopened, nstale, nexpired;
+
+static origin_t **find(const char *key);
+static void sweep(time_t now);
+static int alive(int fd);
+
+/*
+ * upstream_get - return a connection to host:port, reusing an idle one
+ *     when possible (*reused says which), or -1 if none can be opened
+ */
+int upstream_get(const char *host, const char *port, int *reused)
+{
+  char key[MAXLINE];
+  origin_t *o;
+  int fd;
+
+  snprintf(key, sizeof(key), "%s:%s", host, port);
+  while (1)
+  {
+    fd = -1;
+    pthread_mutex_lock(&lock);
+    if ((o = *find(key)) != NULL && o->nidle > 0)
+    {
+      idle_conn_t *c = &o->idle[--o->nidle]; /* Newest first */
+      fd = c->fd;
+      if (time(NULL) - c->since > UPSTREAM_IDLE_TIMEOUT)
+      {
+        nexpired++;
+        Close(fd);
+        pthread_mutex_unlock(&lock);
+        continue;
+      }
+    }
+    pthread_mutex_unlock(&lock);
+
+    if (fd < 0)
+      break;
+    if (alive(fd))
+    {
+      __atomic_add_fetch(&nreused, 1, __ATOMIC_RELAXED);
+      *reused = 1;
+      return fd;
+    }
+    __atomic_add_fetch(&nstale, 1, __ATOMIC_RELAXED);
+    Close(fd);
+  }
+
+  *reused = 0;
+  if ((fd = dns_open_clientfd(host, port)) >= 0)
+    __atomic_add_fetch(&nopened, 1, __ATOMIC_RELAXED);
+  return fd;
+}
+
+/*
+ * upstream_put - park an idle connection to host:port for reuse
+ */
+void upstream_put(const char *host, const char *port, int fd)
+{
+  char key[MAXLINE];
+  origin_t **op, *o;
+  time_t now = time(NULL);
+
+  snprintf(key, sizeof(key), "%s:%s", host, port);
+  pthread_mutex_lock(&lock);
+  if (now != last_sweep)
+    sweep(now);
+  if ((o = *(op = find(key))) == NULL)
+  {
+    o = Calloc(1, sizeof(origin_t));
+    strcpy(o->key, key);
+    *op = o;
+  }
+  if (o->nidle == UPSTREAM_MAX_IDLE)
+  {
+    /* Full: the oldest goes */
+    Close(o->idle[0].fd);
+    memmove(o->idle, o->idle + 1, (o->nidle - 1) * sizeof(idle_conn_t));
+    o->nidle--;
+  }
+  o->idle[o->nidle].fd = fd;
+  o->idle[o->nidle++].since = now;
+  pthread_mutex_unlock(&lock);
+}
+
+/*
+ * upstream_print_stats - write connection reuse counters into buf
+ *     return the number of bytes written
+ */
+int upstream_print_stats(char *buf, size_t size)
+{
+  unsigned long idle = 0;
+  origin_t *o;
+  int i, n;
+
+  pthread_mutex_lock(&lock);
+  for (i = 0; i < NBUCKETS; i++)
+    for (o = buckets[i]; o; o = o->next)
+      idle += o->nidle;
+  n = snprintf(buf, size, "reused %lu opened %lu stale %lu expired %lu "
+                          "idle %lu\n",
+               nreused, nopened, nstale, nexpired, idle);
+  pthread_mutex_unlock(&lock);
+  return n < size ? n : size - 1;
+}
+
+/*
+ * find - the link that points at key's origin, or at the NULL where it
+ *     would go (caller holds the lock)
+ */
+static origin_t **find(const char *key)
+{
+  unsigned long h = 14695981039346656037UL; /* FNV-1a, as in cache.c */
+  const char *p;
+  origin_t **op;
+
+  for (p = key; *p; p++)
+    h = (h ^ (unsigned char)*p) * 1099511628211UL;
+  for (op = &buckets[h % NBUCKETS]; *op; op = &(*op)->next)
+    if (!strcmp((*op)->key, key))
+      break;
+  return op;
+}
+
+/*
+ * sweep - close connections idle past the timeout and forget origins
+ *     left with none (caller holds the lock)
+ */
+static void sweep(time_t now)
+{
+  origin_t **op, *o;
+  int i, j, k;
+
+  last_sweep = now;
+  for (i = 0; i < NBUCKETS; i++)
+    for (op = &buckets[i]; (o = *op) != NULL;)
+    {
+      /* Oldest first, so the expired ones are a prefix */
+      for (j = 0; j < o->nidle && now - o->idle[j].since >
+                                      UPSTREAM_IDLE_TIMEOUT; j++)
+      {
+        Close(o->idle[j].fd);
+        nexpired++;
+      }
+      for (k = j; k < o->nidle; k++)
+        o->idle[k - j] = o->idle[k];
+      o->nidle -= j;
+
+      if (o->nidle == 0)
+      {
+        *op = o->next;
+        Free(o);
+      }
+      else
+        op = &o->next;
+    }
+}
+
+/*
+ * alive - true if an idle connection is still open and has nothing
+ *     unread on it
+ */
+static int alive(int fd)
+{
+  char c;
+  ssize_t n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+
+  return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
@@ -0,0 +1,16 @@
+/*
+ * upstream.h - pool of idle keep-alive connections to origin servers
+ */
+#ifndef __UPSTREAM_H__
+#define __UPSTREAM_H__
+
+#include <stddef.h>
+
+#define UPSTREAM_MAX_IDLE 8      /* Idle connections kept per origin */
+#define UPSTREAM_IDLE_TIMEOUT 30 /* Seconds an idle connection is kept */
+
+int upstream_get(const char *host, const char *port, int *reused);
+void upstream_put(const char *host, const char *port, int fd);
+int upstream_print_stats(char *buf, size_t size);
+
+#endif /* __UPSTREAM_H__ */
@@ -0,0 +1,852 @@
+/*
+ * uring.c - io_uring proxy engine (built with "make URING=1")
+ *
+ * The same per-connection flow as event.c, but instead of one
+ * readiness notification plus one read()/write() per step, every
+ * operation is queued as a submission entry and all entries queued
+ * while handling a batch of completions are handed to the kernel in a
+ * single io_uring_enter(), which also waits for the next completions.
+ *
+ *   - one multishot accept keeps producing client descriptors
+ *   - client requests are read with a multishot recv that picks buffers
+ *     from a ring registered with the kernel (IORING_REGISTER_PBUF_RING)
+ *   - origin responses are received into the same registered buffers
+ *     and sent to the client straight from them, without another copy
+ *   - a poll on the resolver's eventfd reports name lookups that missed
+ *     the DNS cache and ran on the resolver threads
+ *
+ * Each origin recv is armed only while the connection holds fewer than
+ * RELAY_QUEUE unsent buffers, so a slow client cannot drain the shared
+ * buffer ring.
+ *
+ * As in event.c, each connection carries one deadline on the loop's
+ * timing wheel (deadline.c) for what it waits on: the request headers
+ * (408), the origin's lookup, connect and first byte (504), and then the
+ * relay making progress, which closes the connection. While the wheel
+ * holds deadlines, an IORING_OP_TIMEOUT wakes the loop at its next tick
+ * to fire those that have come due. The ring is driven with raw
+ * syscalls; liburing is not required. This engine is a pure relay and
+ * does not use the cache, so it measures the I/O path alone.
+ */
+#include <poll.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "csapp.h"
+#include "proxy.h"
+#include "uring.h"
+#include "dns.h"
+#include "resolver.h"
+#include "deadline.h"
+
+#define SQ_ENTRIES 256   /* Submission queue entries */
+#define CQ_ENTRIES 1024  /* Completion queue entries */
+#define NBUFS 1024       /* Registered buffers (power of two) */
+#define BUF_SIZE 4096    /* Size of each registered buffer */
+#define BGID 0           /* Buffer group id of the registered ring */
+#define RELAY_QUEUE 8    /* Max unsent origin buffers per connection */
+
+/* Operation kinds, kept in the low bits of user_data */
+enum
+{
+  OP_ACCEPT,
+  OP_CLIENT_RECV,
+  OP_CONNECT,
+  OP_SERVER_SEND,
+  OP_SERVER_RECV,
+  OP_CLIENT_SEND,
+  OP_CANCEL,
+  OP_RESOLVER, /* The resolver's eventfd is readable */
+  OP_TIMEOUT,  /* The wheel's next tick */
+  OP_MASK = 15 /* Connections are malloc'd, so 16-byte aligned */
+};
+
+typedef struct uconn
+{
+  int clientfd;
+  int serverfd;
+  int pending;      /* Submitted operations not yet completed */
+  int closing;      /* Tearing down; freed once pending drops to 0 */
+  int reading;      /* Still collecting the request from the client */
+  int recv_armed;   /* An origin recv is in flight */
+  int origin_done;  /* Origin sent EOF */
+  int reply_only;   /* Sending buf as a final reply, then closing */
+  int started;      /* The origin's response has begun */
+  deadline_t deadline; /* For whatever the connection waits on */
+  struct uconn *next_starved;
+  struct addrinfo *addrs, *next_addr;
+  unsigned short q[RELAY_QUEUE]; /* Buffer ids waiting to go out */
+  int qlen[RELAY_QUEUE];         /* Bytes in each queued buffer */
+  int qhead, qcount;
+  int qoff; /* Bytes of the head buffer already sent */
+  size_t len, off;
+  http_req_t req;   /* Request parsed so far in buf */
+  char buf[MAXBUF]; /* Request being collected, then sent */
+} uconn_t;
+
+static struct
+{
+  int fd;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  unsigned sq_entries;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  unsigned to_submit;
+  struct io_uring_buf_ring *br; /* Registered buffer ring */
+  unsigned short br_tail;
+  char *bufs;
+} ring;
+
+static int listenfd;
+static int resolverfd; /* Eventfd of finished name lookups */
+static uconn_t *starved; /* Connections waiting for a free buffer */
+static int timeout_armed; /* An OP_TIMEOUT is in flight */
+static struct __kernel_timespec tick; /* Its time, read when submitted */
+
+static void ring_init(void);
+static struct io_uring_sqe *get_sqe(uconn_t *c, int op);
+static void submit_and_wait(void);
+static void put_buf(unsigned short bid);
+static void handle_cqe(struct io_uring_cqe *cqe);
+static void arm_accept(void);
+static void arm_resolver(void);
+static void arm_timeout(void);
+static void arm_client_recv(uconn_t *c);
+static void arm_server_recv(uconn_t *c);
+static void client_recv_done(uconn_t *c, int res, unsigned flags);
+static void start_request(uconn_t *c);
+static void origin_resolved(void *arg, int err, struct addrinfo *res);
+static void try_connect(uconn_t *c);
+static void send_request(uconn_t *c);
+static void server_recv_done(uconn_t *c, int res, unsigned flags);
+static void send_next(uconn_t *c);
+static void client_send_done(uconn_t *c, int res);
+static void reply_raw(uconn_t *c, char *response);
+static void close_conn(uconn_t *c);
+static void put_conn(uconn_t *c);
+static void relay_deadline(uconn_t *c);
+static void conn_expired(deadline_t *d);
+
+/*
+ * uring_loop - serve connections accepted on lfd forever
+ */
+void uring_loop(int lfd)
+{
+  listenfd = lfd;
+  ring_init();
+  arm_accept();
+  resolverfd = resolver_init(RESOLVER_THREADS);
+  arm_resolver();
+
+  while (1)
+  {
+    unsigned head;
+
+    arm_timeout();
+    submit_and_wait();
+    head = *ring.cq_head;
+    while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE))
+    {
+      handle_cqe(&ring.cqes[head & *ring.cq_mask]);
+      head++;
+      __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    }
+    deadline_expire();
+  }
+}
+
+/*
+ * ring_init - create the ring, map its queues and register the buffers
+ */
+static void ring_init(void)
+{
+  struct io_uring_params p;
+  struct io_uring_buf_reg reg;
+  size_t sq_size, cq_size;
+  char *sq, *cq;
+  unsigned i;
+
+  memset(&p, 0, sizeof(p));
+  p.flags = IORING_SETUP_CQSIZE;
+  p.cq_entries = CQ_ENTRIES;
+  if ((ring.fd = syscall(__NR_io_uring_setup, SQ_ENTRIES, &p)) < 0)
+    unix_error("io_uring_setup error");
+
+  sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
+  sq = Mmap(NULL, sq_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    cq = sq;
+  else
+    cq = Mmap(NULL, cq_size, PROT_READ | PROT_WRITE,
+              MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+  ring.sqes = Mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                   PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   ring.fd, IORING_OFF_SQES);
+
+  ring.sq_head = (unsigned *)(sq + p.sq_off.head);
+  ring.sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  ring.sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+  ring.sq_array = (unsigned *)(sq + p.sq_off.array);
+  ring.sq_entries = p.sq_entries;
+  ring.cq_head = (unsigned *)(cq + p.cq_off.head);
+  ring.cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  ring.cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+  ring.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  for (i = 0; i < p.sq_entries; i++) /* SQ slot i always holds SQE i */
+    ring.sq_array[i] = i;
+
+  /* Register the provided-buffer ring and hand it every buffer */
+  ring.br = Mmap(NULL, NBUFS * sizeof(struct io_uring_buf),
+                 PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  ring.bufs = Malloc((size_t)NBUFS * BUF_SIZE);
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (unsigned long)ring.br;
+  reg.ring_entries = NBUFS;
+  reg.bgid = BGID;
+  if (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_PBUF_RING,
+              &reg, 1) < 0)
+    unix_error("io_uring_register error");
+  for (i = 0; i < NBUFS; i++)
+    put_buf(i);
+}
+
+/*
+ * get_sqe - claim the next submission entry for operation op on c,
+ *     flushing the queue to the kernel first if it is full
+ */
+static struct io_uring_sqe *get_sqe(uconn_t *c, int op)
+{
+  struct io_uring_sqe *sqe;
+  unsigned tail = *ring.sq_tail;
+
+  if (tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) ==
+      ring.sq_entries)
+  {
+    if (syscall(__NR_io_uring_enter, ring.fd, ring.to_submit, 0, 0,
+                NULL, 0) < 0)
+      unix_error("io_uring_enter error");
+    ring.to_submit = 0;
+  }
+  sqe = &ring.sqes[tail & *ring.sq_mask];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->user_data = (unsigned long)c | op;
+  __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ring.to_submit++;
+  if (c)
+    c->pending++;
+  return sqe;
+}
+
+/*
+ * submit_and_wait - submit everything queued and wait for a completion
+ */
+static void submit_and_wait(void)
+{
+  int rc;
+
+  rc = syscall(__NR_io_uring_enter, ring.fd, ring.to_submit, 1,
+               IORING_ENTER_GETEVENTS, NULL, 0);
+  if (rc < 0 && errno != EINTR)
+    unix_error("io_uring_enter error");
+  if (rc > 0)
+    ring.to_submit -= rc;
+}
+
+/*
+ * put_buf - give registered buffer bid back to the kernel
+ */
+static void put_buf(unsigned short bid)
+{
+  struct io_uring_buf *b = &ring.br->bufs[ring.br_tail & (NBUFS - 1)];
+
+  b->addr = (unsigned long)(ring.bufs + (size_t)bid * BUF_SIZE);
+  b->len = BUF_SIZE;
+  b->bid = bid;
+  ring.br_tail++;
+  __atomic_store_n(&ring.br->tail, ring.br_tail, __ATOMIC_RELEASE);
+
+  /* A connection that found the ring empty can try again */
+  if (starved)
+  {
+    uconn_t *c = starved;
+    starved = c->next_starved;
+    c->pending--;
+    arm_server_recv(c);
+  }
+}
+
+/*
+ * handle_cqe - dispatch one completion
+ */
+static void handle_cqe(struct io_uring_cqe *cqe)
+{
+  uconn_t *c = (uconn_t *)(unsigned long)(cqe->user_data & ~(__u64)OP_MASK);
+  int op = cqe->user_data & OP_MASK;
+
+  if (op == OP_ACCEPT)
+  {
+    if (cqe->res >= 0)
+    {
+      c = Calloc(1, sizeof(uconn_t));
+      c->clientfd = cqe->res;
+      c->serverfd = -1;
+      c->reading = 1;
+      http_init(&c->req);
+      deadline_arm(&c->deadline, DEADLINE_HEADER, conn_expired);
+      arm_client_recv(c);
+    }
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+      arm_accept(); /* The multishot accept was terminated */
+    return;
+  }
+  if (op == OP_RESOLVER)
+  {
+    resolver_complete(origin_resolved);
+    arm_resolver();
+    return;
+  }
+  if (op == OP_TIMEOUT)
+  {
+    timeout_armed = 0; /* The loop fires what came due */
+    return;
+  }
+
+  /* Multishot recvs keep their slot until the final completion */
+  if (!(op == OP_CLIENT_RECV && (cqe->flags & IORING_CQE_F_MORE)))
+    c->pending--;
+
+  switch (op)
+  {
+  case OP_CLIENT_RECV:
+    client_recv_done(c, cqe->res, cqe->flags);
+    break;
+  case OP_CONNECT:
+    if (c->closing || c->reply_only)
+      break;
+    if (cqe->res < 0)
+    {
+      close(c->serverfd);
+      c->serverfd = -1;
+      try_connect(c);
+    }
+    else
+      send_request(c);
+    break;
+  case OP_SERVER_SEND:
+    if (c->closing || c->reply_only)
+      break;
+    if (cqe->res < 0)
+      close_conn(c);
+    else
+    {
+      c->off += cqe->res;
+      send_request(c);
+    }
+    break;
+  case OP_SERVER_RECV:
+    server_recv_done(c, cqe->res, cqe->flags);
+    break;
+  case OP_CLIENT_SEND:
+    client_send_done(c, cqe->res);
+    break;
+  }
+
+  if (c->closing && c->pending == 0)
+    put_conn(c);
+}
+
+/*
+ * arm_accept - (re)arm the multishot accept
+ */
+static void arm_accept(void)
+{
+  struct io_uring_sqe *sqe = get_sqe(NULL, OP_ACCEPT);
+
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = listenfd;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+}
+
+/*
+ * arm_resolver - wait for the resolver's eventfd to become readable
+ */
+static void arm_resolver(void)
+{
+  struct io_uring_sqe *sqe = get_sqe(NULL, OP_RESOLVER);
+
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = resolverfd;
+  sqe->poll32_events = POLLIN;
+}
+
+/*
+ * arm_timeout - wake the loop at the wheel's next tick, if it holds
+ *     deadlines and no wakeup is queued yet
+ */
+static void arm_timeout(void)
+{
+  struct io_uring_sqe *sqe;
+  int ms;
+
+  if (timeout_armed || (ms = deadline_next()) < 0)
+    return;
+  tick.tv_sec = ms / 1000;
+  tick.tv_nsec = (long long)(ms % 1000) * 1000000;
+  sqe = get_sqe(NULL, OP_TIMEOUT);
+  sqe->opcode = IORING_OP_TIMEOUT;
+  sqe->addr = (unsigned long)&tick;
+  sqe->len = 1;
+  timeout_armed = 1;
+}
+
+/*
+ * arm_client_recv - multishot recv of the request into registered buffers
+ */
+static void arm_client_recv(uconn_t *c)
+{
+  struct io_uring_sqe *sqe = get_sqe(c, OP_CLIENT_RECV);
+
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = c->clientfd;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = BGID;
+}
+
+/*
+ * arm_server_recv - receive the next piece of the response into a
+ *     registered buffer, unless the connection already holds enough
+ */
+static void arm_server_recv(uconn_t *c)
+{
+  struct io_uring_sqe *sqe;
+
+  if (c->recv_armed || c->origin_done || c->qcount >= RELAY_QUEUE)
+    return;
+  sqe = get_sqe(c, OP_SERVER_RECV);
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = c->serverfd;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = BGID;
+  c->recv_armed = 1;
+}
+
+/*
+ * client_recv_done - append request bytes until the header block ends
+ */
+static void client_recv_done(uconn_t *c, int res, unsigned flags)
+{
+  ssize_t rc;
+
+  if (flags & IORING_CQE_F_BUFFER)
+  {
+    unsigned short bid = flags >> IORING_CQE_BUFFER_SHIFT;
+    if (c->reading && !c->closing && res > 0)
+    {
+      size_t n = res;
+      if (n > sizeof(c->buf) - 1 - c->len)
+        n = sizeof(c->buf) - 1 - c->len;
+      memcpy(c->buf + c->len, ring.bufs + (size_t)bid * BUF_SIZE, n);
+      c->len += n;
+      c->buf[c->len] = '\0';
+    }
+    put_buf(bid);
+  }
+  if (!c->reading || c->closing)
+    return;
+
+  if (res <= 0)
+  {
+    if (res == -ENOBUFS && !(flags & IORING_CQE_F_MORE))
+      arm_client_recv(c); /* Ring was empty; wait for data again */
+    else
+      close_conn(c);
+    return;
+  }
+  if ((rc = http_parse(&c->req, c->buf, c->len)) > 0)
+  {
+    struct io_uring_sqe *sqe;
+
+    /* Stop the multishot recv; the rest of the request is ignored */
+    c->reading = 0;
+    sqe = get_sqe(c, OP_CANCEL);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = (unsigned long)c | OP_CLIENT_RECV;
+    start_request(c);
+  }
+  else if (rc == HTTP_BAD || c->len == sizeof(c->buf) - 1)
+  {
+    char out[MAXBUF];
+    c->reading = 0;
+    format_error(out, sizeof(out), "request", "400", "Bad Request",
+                 rc == HTTP_BAD ? "Proxy could not parse the request"
+                                : "Request headers are too large");
+    reply_raw(c, out);
+  }
+}
+
+/*
+ * start_request - rewrite the collected request and connect to the origin
+ */
+static void start_request(uconn_t *c)
+{
+  char host[MAXLINE], port[MAXLINE], path[MAXLINE];
+  char out[MAXLINE + MAXBUF];
+  struct addrinfo *res;
+  int len, rc;
+
+  if ((len = rewrite_request(&c->req, out, sizeof(out), host, port,
+                             path)) < 0 ||
+      len >= sizeof(c->buf))
+  {
+    if (len >= 0)
+      format_error(out, sizeof(out), "request", "400", "Bad Request",
+                   "Request headers are too large");
+    reply_raw(c, out);
+    return;
+  }
+  memcpy(c->buf, out, len);
+  c->len = len;
+  c->off = 0;
+
+  /* Resolve the origin from the DNS cache, or else on the resolver
+     threads; the lookup holds the connection like an operation would.
+     One connect deadline covers the lookup, every address tried and
+     sending the request. */
+  deadline_arm(&c->deadline, DEADLINE_CONNECT, conn_expired);
+  c->pending++;
+  if ((rc = dns_peek(host, port, &res)) == DNS_MISS)
+    resolver_submit(host, port, c);
+  else
+    origin_resolved(c, rc, res);
+}
+
+/*
+ * origin_resolved - the origin's addresses are known: start connecting
+ */
+static void origin_resolved(void *arg, int err, struct addrinfo *res)
+{
+  uconn_t *c = arg;
+  char out[MAXBUF];
+
+  c->pending--;
+  if (c->closing || c->reply_only)
+  {
+    /* Closed, or answered with a 504, while the lookup ran */
+    if (err == 0)
+      dns_freeaddrinfo(res);
+    if (c->closing && c->pending == 0)
+      put_conn(c);
+    return;
+  }
+  if (err)
+  {
+    format_error(out, sizeof(out), "origin", "502", "Bad Gateway",
+                 "Proxy could not resolve the origin server");
+    reply_raw(c, out);
+    return;
+  }
+  c->addrs = c->next_addr = res;
+  try_connect(c);
+}
+
+/*
+ * try_connect - queue a connect to the next origin address
+ */
+static void try_connect(uconn_t *c)
+{
+  struct io_uring_sqe *sqe;
+  struct addrinfo *p;
+  char out[MAXBUF];
+
+  while ((p = c->next_addr) != NULL)
+  {
+    c->next_addr = p->ai_next;
+    if ((c->serverfd = socket(p->ai_family, p->ai_socktype,
+                              p->ai_protocol)) < 0)
+      continue;
+    sqe = get_sqe(c, OP_CONNECT);
+    sqe->opcode = IORING_OP_CONNECT;
+    sqe->fd = c->serverfd;
+    sqe->addr = (unsigned long)p->ai_addr;
+    sqe->off = p->ai_addrlen;
+    return;
+  }
+
+  format_error(out, sizeof(out), "origin", "502", "Bad Gateway",
+               "Proxy could not connect to the origin server");
+  reply_raw(c, out);
+}
+
+/*
+ * send_request - queue the unsent part of the request to the origin,
+ *     or start relaying once it has all gone out
+ */
+static void send_request(uconn_t *c)
+{
+  struct io_uring_sqe *sqe;
+
+  if (c->addrs)
+  {
+    dns_freeaddrinfo(c->addrs);
+    c->addrs = c->next_addr = NULL;
+  }
+  if (c->off < c->len)
+  {
+    sqe = get_sqe(c, OP_SERVER_SEND);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = c->serverfd;
+    sqe->addr = (unsigned long)(c->buf + c->off);
+    sqe->len = c->len - c->off;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    return;
+  }
+  deadline_arm(&c->deadline, DEADLINE_FIRST_BYTE, conn_expired);
+  arm_server_recv(c);
+}
+
+/*
+ * server_recv_done - queue a filled buffer for the client
+ */
+static void server_recv_done(uconn_t *c, int res, unsigned flags)
+{
+  c->recv_armed = 0;
+  if (flags & IORING_CQE_F_BUFFER)
+  {
+    unsigned short bid = flags >> IORING_CQE_BUFFER_SHIFT;
+    if (c->closing || c->reply_only || res <= 0)
+      put_buf(bid);
+    else
+    {
+      int i = (c->qhead + c->qcount) % RELAY_QUEUE;
+      c->q[i] = bid;
+      c->qlen[i] = res;
+      if (c->qcount++ == 0)
+        send_next(c);
+    }
+  }
+  if (c->closing || c->reply_only)
+    return;
+
+  if (res == -ENOBUFS)
+  {
+    if (c->qcount == 0)
+    {
+      /* Wait for another connection to hand a buffer back */
+      c->next_starved = starved;
+      starved = c;
+      c->pending++; /* Keep c alive while it sits on the list */
+    }
+    return;
+  }
+  if (res <= 0)
+  {
+    c->origin_done = 1;
+    if (c->qcount == 0)
+      close_conn(c);
+    return;
+  }
+  c->started = 1;
+  arm_server_recv(c);
+  relay_deadline(c);
+}
+
+/*
+ * send_next - queue a send of the head buffer to the client
+ */
+static void send_next(uconn_t *c)
+{
+  struct io_uring_sqe *sqe = get_sqe(c, OP_CLIENT_SEND);
+  unsigned short bid = c->q[c->qhead];
+
+  sqe->opcode = IORING_OP_SEND;
+  sqe->fd = c->clientfd;
+  sqe->addr = (unsigned long)(ring.bufs + (size_t)bid * BUF_SIZE + c->qoff);
+  sqe->len = c->qlen[c->qhead] - c->qoff;
+  sqe->msg_flags = MSG_NOSIGNAL;
+}
+
+/*
+ * client_send_done - advance the relay queue (or finish a final reply)
+ */
+static void client_send_done(uconn_t *c, int res)
+{
+  if (c->reply_only)
+  {
+    if (!c->closing && res > 0 && (c->off += res) < c->len)
+    {
+      struct io_uring_sqe *sqe = get_sqe(c, OP_CLIENT_SEND);
+      sqe->opcode = IORING_OP_SEND;
+      sqe->fd = c->clientfd;
+      sqe->addr = (unsigned long)(c->buf + c->off);
+      sqe->len = c->len - c->off;
+      sqe->msg_flags = MSG_NOSIGNAL;
+      return;
+    }
+    close_conn(c);
+    return;
+  }
+  if (c->closing)
+    return;
+  if (res <= 0)
+  {
+    close_conn(c);
+    return;
+  }
+
+  c->qoff += res;
+  if (c->qoff < c->qlen[c->qhead])
+  {
+    send_next(c); /* Short send: the rest of the same buffer */
+    return;
+  }
+  put_buf(c->q[c->qhead]);
+  c->qhead = (c->qhead + 1) % RELAY_QUEUE;
+  c->qcount--;
+  c->qoff = 0;
+  if (c->qcount > 0)
+    send_next(c);
+  else if (c->origin_done)
+  {
+    close_conn(c);
+    return;
+  }
+  arm_server_recv(c);
+  relay_deadline(c);
+}
+
+/*
+ * reply_raw - send a prepared response to the client and then close
+ */
+static void reply_raw(uconn_t *c, char *response)
+{
+  struct io_uring_sqe *sqe;
+
+  c->len = strlen(response);
+  if (c->len > sizeof(c->buf))
+    c->len = sizeof(c->buf);
+  memcpy(c->buf, response, c->len);
+  c->off = 0;
+  c->reply_only = 1;
+  deadline_arm(&c->deadline, DEADLINE_SEND, conn_expired);
+  sqe = get_sqe(c, OP_CLIENT_SEND);
+  sqe->opcode = IORING_OP_SEND;
+  sqe->fd = c->clientfd;
+  sqe->addr = (unsigned long)c->buf;
+  sqe->len = c->len;
+  sqe->msg_flags = MSG_NOSIGNAL;
+}
+
+/*
+ * close_conn - cancel everything still queued on the connection's
+ *     sockets; the connection is freed when the last completion arrives
+ */
+static void close_conn(uconn_t *c)
+{
+  int fds[2] = {c->clientfd, c->serverfd};
+  int i;
+
+  uconn_t **pp;
+
+  if (c->closing)
+    return;
+  c->closing = 1;
+  deadline_cancel(&c->deadline);
+
+  /* Drop the reference held by the starved list */
+  for (pp = &starved; *pp; pp = &(*pp)->next_starved)
+    if (*pp == c)
+    {
+      *pp = c->next_starved;
+      c->pending--;
+      break;
+    }
+
+  for (i = 0; i < 2; i++)
+  {
+    struct io_uring_sqe *sqe;
+    if (fds[i] < 0)
+      continue;
+    sqe = get_sqe(c, OP_CANCEL);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = fds[i];
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+  }
+}
+
+/*
+ * put_conn - release a closed connection with nothing left in flight
+ */
+static void put_conn(uconn_t *c)
+{
+  while (c->qcount > 0)
+  {
+    put_buf(c->q[c->qhead]);
+    c->qhead = (c->qhead + 1) % RELAY_QUEUE;
+    c->qcount--;
+  }
+  if (c->addrs)
+    dns_freeaddrinfo(c->addrs);
+  if (c->clientfd >= 0)
+    close(c->clientfd);
+  if (c->serverfd >= 0)
+    close(c->serverfd);
+  Free(c);
+}
+
+/*
+ * relay_deadline - once the response has begun, give the relay until
+ *     its next step: the origin's next bytes (idle) while a recv is
+ *     armed, else the client taking what is queued (send)
+ */
+static void relay_deadline(uconn_t *c)
+{
+  if (c->closing || !c->started)
+    return;
+  deadline_arm(&c->deadline, c->recv_armed ? DEADLINE_IDLE : DEADLINE_SEND,
+               conn_expired);
+}
+
+/*
+ * conn_expired - a connection's deadline passed: answer the client if
+ *     nothing has been sent to it yet, else just close
+ */
+static void conn_expired(deadline_t *d)
+{
+  uconn_t *c = (uconn_t *)((char *)d - offsetof(uconn_t, deadline));
+  struct io_uring_sqe *sqe;
+  char out[MAXBUF];
+
+  switch (d->kind)
+  {
+  case DEADLINE_HEADER:
+    c->reading = 0;
+    sqe = get_sqe(c, OP_CANCEL);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = (unsigned long)c | OP_CLIENT_RECV;
+    format_error(out, sizeof(out), "request", "408", "Request Timeout",
+                 "Proxy gave up waiting for the request headers");
+    reply_raw(c, out);
+    break;
+  case DEADLINE_CONNECT:
+  case DEADLINE_FIRST_BYTE:
+    if (c->serverfd >= 0) /* Else the origin is still being resolved */
+    {
+      sqe = get_sqe(c, OP_CANCEL); /* The origin's connect, send or recv */
+      sqe->opcode = IORING_OP_ASYNC_CANCEL;
+      sqe->fd = c->serverfd;
+      sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    }
+    format_error(out, sizeof(out), "origin", "504", "Gateway Timeout",
+                 "Origin server did not answer in time");
+    reply_raw(c, out);
+    break;
+  default:
+    close_conn(c);
+    break;
+  }
+}
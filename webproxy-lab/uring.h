@@ -0,0 +1,9 @@
+/*
+ * uring.h - io_uring proxy engine (compiled with -DUSE_IO_URING)
+ */
+#ifndef __URING_H__
+#define __URING_H__
+
+void uring_loop(int listenfd);
+
+#endif /* __URING_H__ */
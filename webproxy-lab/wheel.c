@@ -0,0 +1,139 @@
+/*
+ * wheel.c - hierarchical timing wheel of one-second ticks
+ *
+ * Timers are kept in WHEEL_LEVELS wheels of WHEEL_SLOTS slots. The
+ * first wheel has a slot per second for the next 64 seconds, the second
+ * a slot per 64 seconds for the next 64^2, and so on, so four wheels
+ * reach about 194 days ahead; timers further out wait in the last slot
+ * they can reach. A timer goes into the finest wheel whose span covers
+ * it. Each time a wheel comes round to slot 0, the next slot of the
+ * wheel above is emptied into the finer wheels, now that its timers are
+ * close enough to place precisely.
+ *
+ * Adding or removing a timer is O(1), and so is each firing: advancing
+ * the wheel only visits the slots of the seconds that passed and the
+ * timers due in them, never the timers that are not due yet. A timer is
+ * moved down at most WHEEL_LEVELS - 1 times in its life.
+ *
+ * The wheel does no locking; its owner serializes the calls.
+ */
+#include <stddef.h>
+#include "wheel.h"
+
+#define SLOT(t, level) (((t) >> ((level) * WHEEL_BITS)) & (WHEEL_SLOTS - 1))
+
+static void place(wheel_t *w, wheel_node_t *n);
+static void cascade(wheel_t *w, int level);
+
+/*
+ * wheel_init - start an empty wheel whose clock reads now
+ */
+void wheel_init(wheel_t *w, time_t now)
+{
+  int i, j;
+
+  w->now = now;
+  w->count = 0;
+  for (i = 0; i < WHEEL_LEVELS; i++)
+    for (j = 0; j < WHEEL_SLOTS; j++)
+      w->slots[i][j].prev = w->slots[i][j].next = &w->slots[i][j];
+}
+
+/*
+ * wheel_add - queue n to fire at when; a time already past fires on the
+ *     next tick. n must not be queued already.
+ */
+void wheel_add(wheel_t *w, wheel_node_t *n, time_t when)
+{
+  n->when = when > w->now ? when : w->now + 1;
+  place(w, n);
+  w->count++;
+}
+
+/*
+ * wheel_del - take n off the wheel if it is queued
+ */
+void wheel_del(wheel_t *w, wheel_node_t *n)
+{
+  if (n->next == NULL)
+    return;
+  n->prev->next = n->next;
+  n->next->prev = n->prev;
+  n->next = n->prev = NULL;
+  w->count--;
+}
+
+/*
+ * wheel_advance - move the clock on to now, calling fire on each timer
+ *     that comes due, in order of the second it is due. A timer is off
+ *     the wheel when fire sees it, and fire may add it again.
+ *     return the number of timers fired
+ */
+long wheel_advance(wheel_t *w, time_t now, wheel_fire_t fire, void *arg)
+{
+  wheel_node_t *head, *n;
+  long fired = 0;
+  int level;
+
+  while (w->now < now)
+  {
+    if (w->count == 0)
+    {
+      w->now = now; /* Nothing to visit on the way */
+      break;
+    }
+    w->now++;
+
+    /* A wheel back at slot 0 takes the next slot of the one above */
+    for (level = 1; level < WHEEL_LEVELS && SLOT(w->now, level - 1) == 0;
+         level++)
+      cascade(w, level);
+
+    head = &w->slots[0][SLOT(w->now, 0)];
+    while ((n = head->next) != head)
+    {
+      wheel_del(w, n);
+      fire(n, arg);
+      fired++;
+    }
+  }
+  return fired;
+}
+
+/*
+ * place - link n into the slot for n->when, in the finest wheel whose
+ *     span reaches it
+ */
+static void place(wheel_t *w, wheel_node_t *n)
+{
+  time_t delta = n->when - w->now;
+  wheel_node_t *head;
+  int level = 0;
+
+  while (level < WHEEL_LEVELS - 1 &&
+         delta >= (time_t)1 << ((level + 1) * WHEEL_BITS))
+    level++;
+  if (delta >= (time_t)1 << ((level + 1) * WHEEL_BITS))
+    head = &w->slots[level][SLOT(w->now, level)]; /* Placed again in a turn */
+  else
+    head = &w->slots[level][SLOT(n->when, level)];
+  n->next = head;
+  n->prev = head->prev;
+  head->prev->next = n;
+  head->prev = n;
+}
+
+/*
+ * cascade - empty the current slot of wheel level into the finer wheels
+ */
+static void cascade(wheel_t *w, int level)
+{
+  wheel_node_t *head = &w->slots[level][SLOT(w->now, level)], *n;
+
+  while ((n = head->next) != head)
+  {
+    n->prev->next = n->next;
+    n->next->prev = n->prev;
+    place(w, n);
+  }
+}
@@ -0,0 +1,35 @@
+/*
+ * wheel.h - hierarchical timing wheel of one-second ticks
+ */
+#ifndef __WHEEL_H__
+#define __WHEEL_H__
+
+#include <time.h>
+
+#define WHEEL_LEVELS 4    /* Wheels, each ticking once per turn of the last */
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS) /* Slots per wheel: 64 */
+
+/* Embedded in whatever is timed; next is NULL while it is not queued */
+typedef struct wheel_node
+{
+  struct wheel_node *prev, *next;
+  time_t when;
+} wheel_node_t;
+
+typedef struct
+{
+  time_t now;   /* Every timer due at or before now has fired */
+  long count;   /* Timers queued */
+  wheel_node_t slots[WHEEL_LEVELS][WHEEL_SLOTS]; /* List heads */
+} wheel_t;
+
+/* Called by wheel_advance() for each timer that comes due */
+typedef void (*wheel_fire_t)(wheel_node_t *n, void *arg);
+
+void wheel_init(wheel_t *w, time_t now);
+void wheel_add(wheel_t *w, wheel_node_t *n, time_t when);
+void wheel_del(wheel_t *w, wheel_node_t *n);
+long wheel_advance(wheel_t *w, time_t now, wheel_fire_t fire, void *arg);
+
+#endif /* __WHEEL_H__ */